@@ -17,18 +17,258 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#ifdef CONFIG_EPOLL_CREATE1
+#include <sys/epoll.h>
+#endif
 
 struct AioHandler
 {
     GPollFD pfd;
     IOHandler *io_read;
     IOHandler *io_write;
+    AioPollFn *io_poll;
     int deleted;
     int pollfds_idx;
     void *opaque;
     QLIST_ENTRY(AioHandler) node;
+#ifdef CONFIG_EPOLL_CREATE1
+    /* On ctx->ready_handlers while it has events left to dispatch */
+    bool ready;
+    QLIST_ENTRY(AioHandler) node_ready;
+#endif
 };
 
+#ifdef CONFIG_EPOLL_CREATE1
+
+/* Number of handlers above which a context switches from ppoll to epoll */
+#define EPOLL_THRESHOLD_DEFAULT 64
+
+/* Events fetched from the kernel by a single epoll_wait call */
+#define EPOLL_MAX_EVENTS        128
+
+static uint32_t epoll_events_from_pfd(int pfd_events)
+{
+    return (pfd_events & G_IO_IN ? EPOLLIN : 0) |
+           (pfd_events & G_IO_OUT ? EPOLLOUT : 0) |
+           (pfd_events & G_IO_HUP ? EPOLLHUP : 0) |
+           (pfd_events & G_IO_ERR ? EPOLLERR : 0);
+}
+
+static int pfd_events_from_epoll(uint32_t events)
+{
+    return (events & EPOLLIN ? G_IO_IN : 0) |
+           (events & EPOLLOUT ? G_IO_OUT : 0) |
+           (events & EPOLLHUP ? G_IO_HUP : 0) |
+           (events & EPOLLERR ? G_IO_ERR : 0);
+}
+
+static int aio_epoll_ctl(AioContext *ctx, int op, AioHandler *node)
+{
+    struct epoll_event event = {
+        .events = epoll_events_from_pfd(node->pfd.events),
+        .data.ptr = node,
+    };
+
+    return epoll_ctl(ctx->epollfd, op, node->pfd.fd, &event);
+}
+
+static void aio_ready_remove(AioHandler *node)
+{
+    if (node->ready) {
+        QLIST_REMOVE(node, node_ready);
+        node->ready = false;
+    }
+}
+
+/* Go back to ppoll.  Events already fetched from epoll are handed over
+ * to the per-handler GPollFDs, so that the next dispatch still sees them.
+ */
+static void aio_epoll_disable(AioContext *ctx)
+{
+    AioHandler *node;
+
+    if (!ctx->epoll_enabled) {
+        return;
+    }
+
+    ctx->epoll_enabled = false;
+    g_source_remove_poll(&ctx->source, &ctx->epoll_pfd);
+    ctx->epoll_pfd.revents = 0;
+
+    while ((node = QLIST_FIRST(&ctx->ready_handlers)) != NULL) {
+        aio_ready_remove(node);
+    }
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted) {
+            g_source_add_poll(&ctx->source, &node->pfd);
+        }
+    }
+
+    /* Start from an empty interest list the next time epoll is enabled */
+    close(ctx->epollfd);
+    ctx->epollfd = -1;
+    if (ctx->epoll_available) {
+        ctx->epollfd = epoll_create1(EPOLL_CLOEXEC);
+        ctx->epoll_available = ctx->epollfd >= 0;
+    }
+    ctx->epoll_pfd.fd = ctx->epollfd;
+}
+
+static void aio_epoll_enable(AioContext *ctx)
+{
+    AioHandler *node;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && aio_epoll_ctl(ctx, EPOLL_CTL_ADD, node) < 0) {
+            /* Some file descriptors, e.g. regular files, cannot be
+             * watched with epoll.  Stay with ppoll for good.
+             */
+            close(ctx->epollfd);
+            ctx->epollfd = ctx->epoll_pfd.fd = -1;
+            ctx->epoll_available = false;
+            return;
+        }
+    }
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted) {
+            g_source_remove_poll(&ctx->source, &node->pfd);
+            node->pfd.revents = 0;
+        }
+    }
+    g_source_add_poll(&ctx->source, &ctx->epoll_pfd);
+    ctx->epoll_enabled = true;
+}
+
+static void aio_epoll_check(AioContext *ctx)
+{
+    if (!ctx->epoll_enabled) {
+        if (ctx->epoll_available && ctx->epoll_threshold &&
+            ctx->nr_handlers >= ctx->epoll_threshold) {
+            aio_epoll_enable(ctx);
+        }
+    } else if (!ctx->epoll_threshold ||
+               ctx->nr_handlers < ctx->epoll_threshold / 2) {
+        aio_epoll_disable(ctx);
+    }
+}
+
+/* Mirror a change of @node into the epoll interest list.  Returns false
+ * if the caller must fall back to ppoll for this context.
+ */
+static bool aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
+{
+    int op;
+
+    if (!ctx->epoll_enabled) {
+        return true;
+    }
+
+    if (node->deleted || (!node->io_read && !node->io_write)) {
+        op = EPOLL_CTL_DEL;
+        aio_ready_remove(node);
+    } else {
+        op = is_new ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    }
+
+    if (aio_epoll_ctl(ctx, op, node) < 0 && op != EPOLL_CTL_DEL) {
+        ctx->epoll_available = false;
+        aio_epoll_disable(ctx);
+        return false;
+    }
+    return true;
+}
+
+/* Move the events reported by the kernel onto the ready list.  Only the
+ * descriptors that actually fired are touched.
+ */
+static int aio_epoll_fill_ready(AioContext *ctx)
+{
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    int i, ret;
+
+    ret = epoll_wait(ctx->epollfd, events, ARRAY_SIZE(events), 0);
+    for (i = 0; i < ret; i++) {
+        AioHandler *node = events[i].data.ptr;
+
+        node->pfd.revents |= pfd_events_from_epoll(events[i].events);
+        if (!node->ready) {
+            node->ready = true;
+            QLIST_INSERT_HEAD(&ctx->ready_handlers, node, node_ready);
+        }
+    }
+    ctx->epoll_pfd.revents = 0;
+    return ret;
+}
+
+static int aio_epoll_wait(AioContext *ctx, int64_t timeout)
+{
+    int ret;
+
+    /* epoll_wait only has millisecond resolution, so block in ppoll on
+     * the epoll descriptor and collect the events without waiting.
+     */
+    if (timeout) {
+        ret = qemu_poll_ns(&ctx->epoll_pfd, 1, timeout);
+        if (ret <= 0) {
+            return ret;
+        }
+    }
+    return aio_epoll_fill_ready(ctx);
+}
+
+void aio_context_setup(AioContext *ctx)
+{
+    QLIST_INIT(&ctx->ready_handlers);
+    ctx->epoll_threshold = EPOLL_THRESHOLD_DEFAULT;
+    ctx->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    ctx->epoll_available = ctx->epollfd >= 0;
+    ctx->epoll_pfd.fd = ctx->epollfd;
+    ctx->epoll_pfd.events = G_IO_IN;
+}
+
+void aio_context_destroy(AioContext *ctx)
+{
+    if (ctx->epollfd >= 0) {
+        close(ctx->epollfd);
+    }
+}
+
+void aio_context_set_epoll_threshold(AioContext *ctx, unsigned threshold)
+{
+    ctx->epoll_threshold = threshold;
+    aio_epoll_check(ctx);
+}
+
+#else
+
+static void aio_epoll_check(AioContext *ctx)
+{
+}
+
+void aio_context_setup(AioContext *ctx)
+{
+}
+
+void aio_context_destroy(AioContext *ctx)
+{
+}
+
+void aio_context_set_epoll_threshold(AioContext *ctx, unsigned threshold)
+{
+}
+
+#endif
+
+static bool aio_epoll_enabled(AioContext *ctx)
+{
+#ifdef CONFIG_EPOLL_CREATE1
+    return ctx->epoll_enabled;
+#else
+    return false;
+#endif
+}
+
 static AioHandler *find_aio_handler(AioContext *ctx, int fd)
 {
     AioHandler *node;
@@ -55,12 +295,25 @@ void aio_set_fd_handler(AioContext *ctx,
     /* Are we deleting the fd handler? */
     if (!io_read && !io_write) {
         if (node) {
-            g_source_remove_poll(&ctx->source, &node->pfd);
+            if (!aio_epoll_enabled(ctx)) {
+                g_source_remove_poll(&ctx->source, &node->pfd);
+            }
+            node->io_read = NULL;
+            node->io_write = NULL;
+            if (node->io_poll) {
+                node->io_poll = NULL;
+                ctx->poll_handlers--;
+            }
+#ifdef CONFIG_EPOLL_CREATE1
+            aio_epoll_update(ctx, node, false);
+#endif
+            ctx->nr_handlers--;
 
             /* If the lock is held, just mark the node as deleted */
             if (ctx->walking_handlers) {
                 node->deleted = 1;
                 node->pfd.revents = 0;
+                ctx->handlers_deleted = true;
             } else {
                 /* Otherwise, delete it for real.  We can't just mark it as
                  * deleted because deleted nodes are only cleaned up after
@@ -71,13 +324,18 @@ void aio_set_fd_handler(AioContext *ctx,
             }
         }
     } else {
-        if (node == NULL) {
+        bool is_new = (node == NULL);
+
+        if (is_new) {
             /* Alloc and insert if it's not already there */
             node = g_malloc0(sizeof(AioHandler));
             node->pfd.fd = fd;
             QLIST_INSERT_HEAD(&ctx->aio_handlers, node, node);
+            ctx->nr_handlers++;
 
-            g_source_add_poll(&ctx->source, &node->pfd);
+            if (!aio_epoll_enabled(ctx)) {
+                g_source_add_poll(&ctx->source, &node->pfd);
+            }
         }
         /* Update handler with latest information */
         node->io_read = io_read;
@@ -87,8 +345,12 @@ void aio_set_fd_handler(AioContext *ctx,
 
         node->pfd.events = (io_read ? G_IO_IN | G_IO_HUP | G_IO_ERR : 0);
         node->pfd.events |= (io_write ? G_IO_OUT | G_IO_ERR : 0);
+#ifdef CONFIG_EPOLL_CREATE1
+        aio_epoll_update(ctx, node, is_new);
+#endif
     }
 
+    aio_epoll_check(ctx);
     aio_notify(ctx);
 }
 
@@ -100,10 +362,35 @@ void aio_set_event_notifier(AioContext *ctx,
                        (IOHandler *)io_read, NULL, notifier);
 }
 
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll)
+{
+    AioHandler *node = find_aio_handler(ctx, fd);
+
+    assert(node);
+    ctx->poll_handlers += !!io_poll - !!node->io_poll;
+    node->io_poll = io_poll;
+    aio_notify(ctx);
+}
+
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 EventNotifierPollHandler *io_poll)
+{
+    aio_set_fd_poll(ctx, event_notifier_get_fd(notifier),
+                    (AioPollFn *)io_poll);
+}
+
 bool aio_pending(AioContext *ctx)
 {
     AioHandler *node;
 
+#ifdef CONFIG_EPOLL_CREATE1
+    if (ctx->epoll_enabled) {
+        return !QLIST_EMPTY(&ctx->ready_handlers) ||
+               (ctx->epoll_pfd.revents & G_IO_IN);
+    }
+#endif
+
     QLIST_FOREACH(node, &ctx->aio_handlers, node) {
         int revents;
 
@@ -119,11 +406,89 @@ bool aio_pending(AioContext *ctx)
     return false;
 }
 
+/* Free the handlers that aio_set_fd_handler could only mark as deleted */
+static void aio_free_deleted_handlers(AioContext *ctx)
+{
+    AioHandler *node, *tmp;
+
+    if (ctx->walking_handlers || !ctx->handlers_deleted) {
+        return;
+    }
+
+    ctx->handlers_deleted = false;
+    QLIST_FOREACH_SAFE(node, &ctx->aio_handlers, node, tmp) {
+        if (node->deleted) {
+            QLIST_REMOVE(node, node);
+            g_free(node);
+        }
+    }
+}
+
+/* Must be called with walking_handlers elevated */
+static bool aio_dispatch_handler(AioContext *ctx, AioHandler *node)
+{
+    bool progress = false;
+    int revents;
+
+    revents = node->pfd.revents & node->pfd.events;
+    node->pfd.revents = 0;
+
+    if (!node->deleted &&
+        (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) &&
+        node->io_read) {
+        node->io_read(node->opaque);
+
+        /* aio_notify() does not count as progress */
+        if (node->opaque != &ctx->notifier) {
+            progress = true;
+        }
+    }
+    if (!node->deleted &&
+        (revents & (G_IO_OUT | G_IO_ERR)) &&
+        node->io_write) {
+        node->io_write(node->opaque);
+        progress = true;
+    }
+
+    return progress;
+}
+
+#ifdef CONFIG_EPOLL_CREATE1
+static bool aio_dispatch_ready(AioContext *ctx)
+{
+    AioHandler *node;
+    bool progress = false;
+
+    /* Handlers may add or remove other handlers, including the ones
+     * still on the ready list, so always restart from the head.
+     */
+    ctx->walking_handlers++;
+    while ((node = QLIST_FIRST(&ctx->ready_handlers)) != NULL) {
+        aio_ready_remove(node);
+        progress |= aio_dispatch_handler(ctx, node);
+    }
+    ctx->walking_handlers--;
+
+    aio_free_deleted_handlers(ctx);
+    return progress;
+}
+#endif
+
 static bool aio_dispatch(AioContext *ctx)
 {
     AioHandler *node;
     bool progress = false;
 
+#ifdef CONFIG_EPOLL_CREATE1
+    if (ctx->epoll_enabled) {
+        progress = aio_dispatch_ready(ctx);
+
+        /* Run our timers */
+        progress |= timerlistgroup_run_timers(&ctx->tlg);
+        return progress;
+    }
+#endif
+
     /*
      * We have to walk very carefully in case qemu_aio_set_fd_handler is
      * called while we're walking.
@@ -131,29 +496,10 @@ static bool aio_dispatch(AioContext *ctx)
     node = QLIST_FIRST(&ctx->aio_handlers);
     while (node) {
         AioHandler *tmp;
-        int revents;
 
         ctx->walking_handlers++;
 
-        revents = node->pfd.revents & node->pfd.events;
-        node->pfd.revents = 0;
-
-        if (!node->deleted &&
-            (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) &&
-            node->io_read) {
-            node->io_read(node->opaque);
-
-            /* aio_notify() does not count as progress */
-            if (node->opaque != &ctx->notifier) {
-                progress = true;
-            }
-        }
-        if (!node->deleted &&
-            (revents & (G_IO_OUT | G_IO_ERR)) &&
-            node->io_write) {
-            node->io_write(node->opaque);
-            progress = true;
-        }
+        progress |= aio_dispatch_handler(ctx, node);
 
         tmp = node;
         node = QLIST_NEXT(node, node);
@@ -172,11 +518,39 @@ static bool aio_dispatch(AioContext *ctx)
     return progress;
 }
 
+/* Busy-wait for up to @max_ns until a polling function reports work,
+ * or a bottom half is scheduled.  Returns true if handlers were run.
+ */
+static bool aio_run_poll_handlers(AioContext *ctx, int64_t max_ns)
+{
+    int64_t end = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + max_ns;
+    uint64_t bh_seq = atomic_read(&ctx->bh_seq);
+    AioHandler *node;
+    bool progress = false;
+
+    ctx->walking_handlers++;
+    do {
+        QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+            if (!node->deleted && node->io_poll && node->io_read &&
+                node->io_poll(node->opaque)) {
+                node->io_read(node->opaque);
+                progress = true;
+            }
+        }
+    } while (!progress && atomic_read(&ctx->bh_seq) == bh_seq &&
+             qemu_clock_get_ns(QEMU_CLOCK_REALTIME) < end);
+    ctx->walking_handlers--;
+
+    aio_free_deleted_handlers(ctx);
+    return progress;
+}
+
 bool aio_poll(AioContext *ctx, bool blocking)
 {
     AioHandler *node;
     int ret;
     bool progress;
+    int64_t poll_start = 0;
 
     progress = false;
 
@@ -198,6 +572,48 @@ bool aio_poll(AioContext *ctx, bool blocking)
         return true;
     }
 
+    /* Poll for a while before going to sleep, unless a timer is due
+     * sooner than the end of the polling window.
+     */
+    if (blocking && ctx->poll_max_ns && ctx->poll_handlers) {
+        int64_t deadline = timerlistgroup_deadline_ns(&ctx->tlg);
+
+        poll_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        if (ctx->poll_ns && (deadline < 0 || deadline > ctx->poll_ns)) {
+            ctx->poll_attempts++;
+            if (aio_run_poll_handlers(ctx, ctx->poll_ns)) {
+                /* Still look at the file descriptors, without sleeping,
+                 * so that busy polled handlers cannot starve the others.
+                 */
+                ctx->poll_hits++;
+                progress = true;
+                blocking = false;
+                poll_start = 0;
+            }
+        }
+    }
+
+#ifdef CONFIG_EPOLL_CREATE1
+    if (ctx->epoll_enabled) {
+        /* early return if we only have the aio_notify() fd */
+        if (ctx->nr_handlers == 1) {
+            return progress;
+        }
+
+        /* The interest list lives in the kernel; nothing to fill */
+        aio_epoll_wait(ctx, blocking ? timerlistgroup_deadline_ns(&ctx->tlg)
+                                     : 0);
+        if (poll_start) {
+            aio_poll_adjust(ctx, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                                 poll_start);
+        }
+        if (aio_dispatch(ctx)) {
+            progress = true;
+        }
+        return progress;
+    }
+#endif
+
     ctx->walking_handlers++;
 
     g_array_set_size(ctx->pollfds, 0);
@@ -227,6 +643,11 @@ bool aio_poll(AioContext *ctx, bool blocking)
                          ctx->pollfds->len,
                          blocking ? timerlistgroup_deadline_ns(&ctx->tlg) : 0);
 
+    if (poll_start) {
+        aio_poll_adjust(ctx, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                             poll_start);
+    }
+
     /* if we have any readable fds, dispatch event */
     if (ret > 0) {
         QLIST_FOREACH(node, &ctx->aio_handlers, node) {
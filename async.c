@@ -26,6 +26,8 @@
 #include "block/aio.h"
 #include "block/thread-pool.h"
 #include "qemu/main-loop.h"
+#include "qemu/atomic.h"
+#include "trace.h"
 
 /***********************************************************/
 /* bottom halves (can be seen as timers which expire ASAP) */
@@ -35,7 +37,10 @@ struct QEMUBH {
     QEMUBHFunc *cb;
     void *opaque;
     QEMUBH *next;
+    QSIMPLEQ_ENTRY(QEMUBH) scheduled_next;
+    uint64_t queued_seq;
     bool scheduled;
+    bool queued;
     bool idle;
     bool deleted;
 };
@@ -56,19 +61,59 @@ QEMUBH *aio_bh_new(AioContext *ctx, QEMUBHFunc *cb, void *opaque)
     return bh;
 }
 
+/* Put a bottom half on the queue walked by aio_bh_poll.  A bottom half is
+ * queued at most once; cancelled ones stay queued and are skipped.
+ */
+static void aio_bh_enqueue(QEMUBH *bh)
+{
+    AioContext *ctx = bh->ctx;
+
+    qemu_mutex_lock(&ctx->bh_lock);
+    if (!bh->queued) {
+        bh->queued = true;
+        bh->queued_seq = ++ctx->bh_seq;
+        QSIMPLEQ_INSERT_TAIL(&ctx->scheduled_bh, bh, scheduled_next);
+    }
+    qemu_mutex_unlock(&ctx->bh_lock);
+}
+
+/* Take the first queued bottom half, unless it was queued after @seq.  */
+static QEMUBH *aio_bh_dequeue(AioContext *ctx, uint64_t seq)
+{
+    QEMUBH *bh;
+
+    qemu_mutex_lock(&ctx->bh_lock);
+    bh = QSIMPLEQ_FIRST(&ctx->scheduled_bh);
+    if (bh && bh->queued_seq > seq) {
+        bh = NULL;
+    }
+    if (bh) {
+        QSIMPLEQ_REMOVE_HEAD(&ctx->scheduled_bh, scheduled_next);
+        bh->queued = false;
+    }
+    qemu_mutex_unlock(&ctx->bh_lock);
+    return bh;
+}
+
 /* Multiple occurrences of aio_bh_poll cannot be called concurrently */
 int aio_bh_poll(AioContext *ctx)
 {
-    QEMUBH *bh, **bhp, *next;
+    QEMUBH *bh, **bhp;
+    uint64_t seq;
     int ret;
 
     ctx->walking_bh++;
 
+    /* Only run the bottom halves that were queued before we started;
+     * those scheduled by the callbacks wait for the next iteration.
+     * A nested aio_bh_poll may already have taken some of them.
+     */
+    qemu_mutex_lock(&ctx->bh_lock);
+    seq = ctx->bh_seq;
+    qemu_mutex_unlock(&ctx->bh_lock);
+
     ret = 0;
-    for (bh = ctx->first_bh; bh; bh = next) {
-        /* Make sure that fetching bh happens before accessing its members */
-        smp_read_barrier_depends();
-        next = bh->next;
+    while ((bh = aio_bh_dequeue(ctx, seq)) != NULL) {
         if (!bh->deleted && bh->scheduled) {
             bh->scheduled = 0;
             /* Paired with write barrier in bh schedule to ensure reading for
@@ -78,22 +123,27 @@ int aio_bh_poll(AioContext *ctx)
             if (!bh->idle)
                 ret = 1;
             bh->idle = 0;
+            ctx->bh_runs++;
             bh->cb(bh->opaque);
         }
     }
 
     ctx->walking_bh--;
 
-    /* remove deleted bhs */
-    if (!ctx->walking_bh) {
+    /* remove deleted bhs; a deletion missed by the unlocked check is
+     * handled by the next poll */
+    if (!ctx->walking_bh && atomic_read(&ctx->bh_deleted)) {
         qemu_mutex_lock(&ctx->bh_lock);
+        ctx->bh_deleted = false;
         bhp = &ctx->first_bh;
         while (*bhp) {
             bh = *bhp;
-            if (bh->deleted) {
+            if (bh->deleted && !bh->queued) {
                 *bhp = bh->next;
                 g_free(bh);
             } else {
+                /* Still queued, free it after the next poll.  */
+                ctx->bh_deleted |= bh->deleted;
                 bhp = &bh->next;
             }
         }
@@ -113,6 +163,7 @@ void qemu_bh_schedule_idle(QEMUBH *bh)
      */
     smp_wmb();
     bh->scheduled = 1;
+    aio_bh_enqueue(bh);
 }
 
 void qemu_bh_schedule(QEMUBH *bh)
@@ -125,6 +176,7 @@ void qemu_bh_schedule(QEMUBH *bh)
      */
     smp_wmb();
     bh->scheduled = 1;
+    aio_bh_enqueue(bh);
     aio_notify(bh->ctx);
 }
 
@@ -141,8 +193,14 @@ void qemu_bh_cancel(QEMUBH *bh)
  */
 void qemu_bh_delete(QEMUBH *bh)
 {
+    AioContext *ctx = bh->ctx;
+
+    /* Once bh->deleted is set, another thread's aio_bh_poll may free bh */
+    qemu_mutex_lock(&ctx->bh_lock);
     bh->scheduled = 0;
     bh->deleted = 1;
+    ctx->bh_deleted = true;
+    qemu_mutex_unlock(&ctx->bh_lock);
 }
 
 static gboolean
@@ -154,7 +212,8 @@ aio_ctx_prepare(GSource *source, gint    *timeout)
 
     /* We assume there is no timeout already supplied */
     *timeout = -1;
-    for (bh = ctx->first_bh; bh; bh = bh->next) {
+    qemu_mutex_lock(&ctx->bh_lock);
+    QSIMPLEQ_FOREACH(bh, &ctx->scheduled_bh, scheduled_next) {
         if (!bh->deleted && bh->scheduled) {
             if (bh->idle) {
                 /* idle bottom halves will be polled at least
@@ -164,10 +223,12 @@ aio_ctx_prepare(GSource *source, gint    *timeout)
                 /* non-idle bottom halves will be executed
                  * immediately */
                 *timeout = 0;
+                qemu_mutex_unlock(&ctx->bh_lock);
                 return true;
             }
         }
     }
+    qemu_mutex_unlock(&ctx->bh_lock);
 
     deadline = qemu_timeout_ns_to_ms(timerlistgroup_deadline_ns(&ctx->tlg));
     if (deadline == 0) {
@@ -186,11 +247,14 @@ aio_ctx_check(GSource *source)
     AioContext *ctx = (AioContext *) source;
     QEMUBH *bh;
 
-    for (bh = ctx->first_bh; bh; bh = bh->next) {
+    qemu_mutex_lock(&ctx->bh_lock);
+    QSIMPLEQ_FOREACH(bh, &ctx->scheduled_bh, scheduled_next) {
         if (!bh->deleted && bh->scheduled) {
+            qemu_mutex_unlock(&ctx->bh_lock);
             return true;
-	}
+        }
     }
+    qemu_mutex_unlock(&ctx->bh_lock);
     return aio_pending(ctx) || (timerlistgroup_deadline_ns(&ctx->tlg) == 0);
 }
 
@@ -214,9 +278,11 @@ aio_ctx_finalize(GSource     *source)
     thread_pool_free(ctx->thread_pool);
     aio_set_event_notifier(ctx, &ctx->notifier, NULL);
     event_notifier_cleanup(&ctx->notifier);
+    aio_context_destroy(ctx);
     qemu_mutex_destroy(&ctx->bh_lock);
     g_array_free(ctx->pollfds, TRUE);
     timerlistgroup_deinit(&ctx->tlg);
+    rfifolock_destroy(&ctx->lock);
 }
 
 static GSourceFuncs aio_source_funcs = {
@@ -250,6 +316,50 @@ static void aio_timerlist_notify(void *opaque)
     aio_notify(opaque);
 }
 
+#define AIO_POLL_GROW_DEFAULT   2
+#define AIO_POLL_START_NS       4000
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink)
+{
+    ctx->poll_max_ns = max_ns;
+    ctx->poll_grow = grow ? grow : AIO_POLL_GROW_DEFAULT;
+    ctx->poll_shrink = shrink;
+    ctx->poll_ns = 0;
+    aio_notify(ctx);
+}
+
+/* Adapt the polling window to the time the last blocking aio_poll
+ * took to find work.
+ */
+void aio_poll_adjust(AioContext *ctx, int64_t block_ns)
+{
+    int64_t old = ctx->poll_ns;
+
+    if (block_ns <= ctx->poll_ns) {
+        /* Polling was long enough, nothing to do */
+        return;
+    } else if (block_ns > ctx->poll_max_ns) {
+        /* We would have had to poll for too long, poll less */
+        ctx->poll_ns = ctx->poll_shrink ? ctx->poll_ns / ctx->poll_shrink : 0;
+        if (ctx->poll_ns != old) {
+            trace_aio_poll_shrink(ctx, old, ctx->poll_ns);
+        }
+    } else if (ctx->poll_ns < ctx->poll_max_ns) {
+        /* Polling a little longer would have caught the event */
+        ctx->poll_ns = ctx->poll_ns ? ctx->poll_ns * ctx->poll_grow
+                                    : AIO_POLL_START_NS;
+        ctx->poll_ns = MIN(ctx->poll_ns, ctx->poll_max_ns);
+        trace_aio_poll_grow(ctx, old, ctx->poll_ns);
+    }
+}
+
+static void aio_rfifolock_cb(void *opaque)
+{
+    /* Kick owner thread in case they are blocked in aio_poll() */
+    aio_notify(opaque);
+}
+
 AioContext *aio_context_new(void)
 {
     AioContext *ctx;
@@ -257,6 +367,10 @@ AioContext *aio_context_new(void)
     ctx->pollfds = g_array_new(FALSE, FALSE, sizeof(GPollFD));
     ctx->thread_pool = NULL;
     qemu_mutex_init(&ctx->bh_lock);
+    rfifolock_init(&ctx->lock, aio_rfifolock_cb, ctx);
+    QSIMPLEQ_INIT(&ctx->scheduled_bh);
+    ctx->poll_grow = AIO_POLL_GROW_DEFAULT;
+    aio_context_setup(ctx);
     event_notifier_init(&ctx->notifier, false);
     aio_set_event_notifier(ctx, &ctx->notifier, 
                            (EventNotifierHandler *)
@@ -275,3 +389,13 @@ void aio_context_unref(AioContext *ctx)
 {
     g_source_unref(&ctx->source);
 }
+
+void aio_context_acquire(AioContext *ctx)
+{
+    rfifolock_lock(&ctx->lock);
+}
+
+void aio_context_release(AioContext *ctx)
+{
+    rfifolock_unlock(&ctx->lock);
+}
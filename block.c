@@ -34,6 +34,7 @@
 #include "block/coroutine.h"
 #include "qmp-commands.h"
 #include "qemu/timer.h"
+#include "qemu/error-report.h"
 
 #ifdef CONFIG_BSD
 #include <sys/types.h>
@@ -85,6 +86,8 @@ static BlockDriverAIOCB *bdrv_co_aio_rw_vector(BlockDriverState *bs,
 static void coroutine_fn bdrv_co_do_rw(void *opaque);
 static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors);
+static void bdrv_set_dirty_bitmaps(BlockDriverState *bs, int64_t cur_sector,
+                                   int nr_sectors);
 
 static QTAILQ_HEAD(, BlockDriverState) bdrv_states =
     QTAILQ_HEAD_INITIALIZER(bdrv_states);
@@ -1491,6 +1494,11 @@ void bdrv_close(BlockDriverState *bs)
         }
     }
 
+    /* Saved last, so that the stamp covers everything the driver wrote */
+    while (!QLIST_EMPTY(&bs->dirty_bitmaps)) {
+        bdrv_release_dirty_bitmap(bs, QLIST_FIRST(&bs->dirty_bitmaps));
+    }
+
     bdrv_dev_change_media_cb(bs, false);
 
     /*throttling disk I/O limits*/
@@ -1511,7 +1519,7 @@ void bdrv_close_all(void)
 /* Check if any requests are in-flight (including throttled requests) */
 static bool bdrv_requests_pending(BlockDriverState *bs)
 {
-    if (!QLIST_EMPTY(&bs->tracked_requests)) {
+    if (!interval_tree_empty(&bs->tracked_requests)) {
         return true;
     }
     if (!qemu_co_queue_empty(&bs->throttled_reqs[0])) {
@@ -1529,17 +1537,6 @@ static bool bdrv_requests_pending(BlockDriverState *bs)
     return false;
 }
 
-static bool bdrv_requests_pending_all(void)
-{
-    BlockDriverState *bs;
-    QTAILQ_FOREACH(bs, &bdrv_states, list) {
-        if (bdrv_requests_pending(bs)) {
-            return true;
-        }
-    }
-    return false;
-}
-
 /*
  * Wait for pending requests to complete across all BlockDriverStates
  *
@@ -1559,16 +1556,33 @@ void bdrv_drain_all(void)
     BlockDriverState *bs;
 
     while (busy) {
+        busy = false;
+
         /* FIXME: We do not have timer support here, so this is effectively
          * a busy wait.
          */
         QTAILQ_FOREACH(bs, &bdrv_states, list) {
-            if (bdrv_start_throttled_reqs(bs)) {
-                busy = true;
+            AioContext *aio_context = bdrv_get_aio_context(bs);
+            bool bs_busy;
+
+            if (aio_context == qemu_get_aio_context()) {
+                bdrv_flush_io_queue(bs);
+                bdrv_start_throttled_reqs(bs);
+                busy |= bdrv_requests_pending(bs);
+                continue;
             }
+
+            /* Devices bound to an IOThread complete their requests there */
+            aio_context_acquire(aio_context);
+            bdrv_flush_io_queue(bs);
+            bdrv_start_throttled_reqs(bs);
+            bs_busy = bdrv_requests_pending(bs);
+            bs_busy |= aio_poll(aio_context, bs_busy);
+            aio_context_release(aio_context);
+
+            busy |= bs_busy;
         }
 
-        busy = bdrv_requests_pending_all();
         busy |= aio_poll(qemu_get_aio_context(), busy);
     }
 }
@@ -1623,6 +1637,11 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
 
     /* dirty bitmap */
     bs_dest->dirty_bitmap       = bs_src->dirty_bitmap;
+    bs_dest->dirty_bitmaps      = bs_src->dirty_bitmaps;
+    if (!QLIST_EMPTY(&bs_dest->dirty_bitmaps)) {
+        QLIST_FIRST(&bs_dest->dirty_bitmaps)->list.le_prev =
+            &bs_dest->dirty_bitmaps.lh_first;
+    }
 
     /* reference count */
     bs_dest->refcnt             = bs_src->refcnt;
@@ -1656,6 +1675,7 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     /* bs_new must be anonymous and shouldn't have anything fancy enabled */
     assert(bs_new->device_name[0] == '\0');
     assert(bs_new->dirty_bitmap == NULL);
+    assert(QLIST_EMPTY(&bs_new->dirty_bitmaps));
     assert(bs_new->job == NULL);
     assert(bs_new->dev == NULL);
     assert(bs_new->in_use == 0);
@@ -1976,7 +1996,7 @@ int bdrv_commit_all(void)
  */
 static void tracked_request_end(BdrvTrackedRequest *req)
 {
-    QLIST_REMOVE(req, list);
+    interval_tree_remove(&req->node, &req->bs->tracked_requests);
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
@@ -1998,7 +2018,10 @@ static void tracked_request_begin(BdrvTrackedRequest *req,
 
     qemu_co_queue_init(&req->wait_queue);
 
-    QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
+    /* Zero-length requests still occupy their first sector */
+    req->node.start = sector_num;
+    req->node.last = sector_num + MAX(nb_sectors, 1) - 1;
+    interval_tree_insert(&req->node, &bs->tracked_requests);
 }
 
 /**
@@ -2022,26 +2045,13 @@ void bdrv_round_to_clusters(BlockDriverState *bs,
     }
 }
 
-static bool tracked_request_overlaps(BdrvTrackedRequest *req,
-                                     int64_t sector_num, int nb_sectors) {
-    /*        aaaa   bbbb */
-    if (sector_num >= req->sector_num + req->nb_sectors) {
-        return false;
-    }
-    /* bbbb   aaaa        */
-    if (req->sector_num >= sector_num + nb_sectors) {
-        return false;
-    }
-    return true;
-}
-
 static void coroutine_fn wait_for_overlapping_requests(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors)
 {
     BdrvTrackedRequest *req;
+    IntervalTreeNode *node;
     int64_t cluster_sector_num;
     int cluster_nb_sectors;
-    bool retry;
 
     /* If we touch the same cluster it counts as an overlap.  This guarantees
      * that allocating writes will be serialized and not race with each other
@@ -2052,23 +2062,22 @@ static void coroutine_fn wait_for_overlapping_requests(BlockDriverState *bs,
     bdrv_round_to_clusters(bs, sector_num, nb_sectors,
                            &cluster_sector_num, &cluster_nb_sectors);
 
-    do {
-        retry = false;
-        QLIST_FOREACH(req, &bs->tracked_requests, list) {
-            if (tracked_request_overlaps(req, cluster_sector_num,
-                                         cluster_nb_sectors)) {
-                /* Hitting this means there was a reentrant request, for
-                 * example, a block driver issuing nested requests.  This must
-                 * never happen since it means deadlock.
-                 */
-                assert(qemu_coroutine_self() != req->co);
-
-                qemu_co_queue_wait(&req->wait_queue);
-                retry = true;
-                break;
-            }
-        }
-    } while (retry);
+    /* Tracked requests are kept in an interval tree, so that finding an
+     * overlapping one costs O(log n) even with hundreds in flight.
+     */
+    while ((node = interval_tree_iter_first(&bs->tracked_requests,
+                        cluster_sector_num,
+                        cluster_sector_num + MAX(cluster_nb_sectors, 1) - 1))) {
+        req = container_of(node, BdrvTrackedRequest, node);
+
+        /* Hitting this means there was a reentrant request, for
+         * example, a block driver issuing nested requests.  This must
+         * never happen since it means deadlock.
+         */
+        assert(qemu_coroutine_self() != req->co);
+
+        qemu_co_queue_wait(&req->wait_queue);
+    }
 }
 
 /*
@@ -2334,11 +2343,15 @@ static int bdrv_rwv_co(BlockDriverState *bs, int64_t sector_num,
         /* Fast-path if already in coroutine context */
         bdrv_rw_co_entry(&rwco);
     } else {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
+        aio_context_acquire(aio_context);
         co = qemu_coroutine_create(bdrv_rw_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
-            qemu_aio_wait();
+            aio_poll(aio_context, true);
         }
+        aio_context_release(aio_context);
     }
     return rwco.ret;
 }
@@ -2795,6 +2808,7 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
     if (bs->dirty_bitmap) {
         bdrv_set_dirty(bs, sector_num, nb_sectors);
     }
+    bdrv_set_dirty_bitmaps(bs, sector_num, nb_sectors);
 
     if (bs->wr_highest_sector < sector_num + nb_sectors - 1) {
         bs->wr_highest_sector = sector_num + nb_sectors - 1;
@@ -2840,6 +2854,10 @@ int bdrv_truncate(BlockDriverState *bs, int64_t offset)
         return -EACCES;
     if (bdrv_in_use(bs))
         return -EBUSY;
+    /* Named dirty bitmaps have a fixed size */
+    if (!QLIST_EMPTY(&bs->dirty_bitmaps)) {
+        return -EBUSY;
+    }
     ret = drv->bdrv_truncate(bs, offset);
     if (ret == 0) {
         ret = refresh_total_sectors(bs, offset >> BDRV_SECTOR_BITS);
@@ -3231,11 +3249,15 @@ int64_t bdrv_get_block_status(BlockDriverState *bs, int64_t sector_num,
         /* Fast-path if already in coroutine context */
         bdrv_get_block_status_co_entry(&data);
     } else {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
+        aio_context_acquire(aio_context);
         co = qemu_coroutine_create(bdrv_get_block_status_co_entry);
         qemu_coroutine_enter(co, &data);
         while (!data.done) {
-            qemu_aio_wait();
+            aio_poll(aio_context, true);
         }
+        aio_context_release(aio_context);
     }
     return data.ret;
 }
@@ -3319,20 +3341,114 @@ void bdrv_get_backing_filename(BlockDriverState *bs,
     pstrcpy(filename, filename_size, bs->backing_file);
 }
 
-int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                          const uint8_t *buf, int nb_sectors)
+typedef struct WriteCompressedCo {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    int nb_sectors;
+    QEMUIOVector *qiov;
+    int ret;
+} WriteCompressedCo;
+
+static void coroutine_fn bdrv_write_compressed_co_entry(void *opaque)
+{
+    WriteCompressedCo *wco = opaque;
+
+    wco->ret = bdrv_co_write_compressed(wco->bs, wco->sector_num,
+                                        wco->nb_sectors, wco->qiov);
+}
+
+bool bdrv_can_write_compressed(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    return drv && (drv->bdrv_co_write_compressed ||
+                   drv->bdrv_write_compressed);
+}
+
+/*
+ * Writes one compressed cluster, or finishes a series of compressed writes
+ * if nb_sectors is 0 (qiov may then be NULL).  Drivers that implement
+ * bdrv_co_write_compressed can have many of these in flight at once.
+ */
+int coroutine_fn bdrv_co_write_compressed(BlockDriverState *bs,
+                                          int64_t sector_num, int nb_sectors,
+                                          QEMUIOVector *qiov)
 {
     BlockDriver *drv = bs->drv;
+    uint8_t *buf = NULL;
+    int ret;
+
     if (!drv)
         return -ENOMEDIUM;
-    if (!drv->bdrv_write_compressed)
+    if (!bdrv_can_write_compressed(bs))
         return -ENOTSUP;
     if (bdrv_check_request(bs, sector_num, nb_sectors))
         return -EIO;
 
     assert(!bs->dirty_bitmap);
 
-    return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
+    if (drv->bdrv_co_write_compressed) {
+        return drv->bdrv_co_write_compressed(bs, sector_num, nb_sectors, qiov);
+    }
+
+    if (nb_sectors) {
+        buf = qemu_blockalign(bs, qiov->size);
+        qemu_iovec_to_buf(qiov, 0, buf, qiov->size);
+    }
+    ret = drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
+    qemu_vfree(buf);
+
+    return ret;
+}
+
+int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
+                          const uint8_t *buf, int nb_sectors)
+{
+    BlockDriver *drv = bs->drv;
+    Coroutine *co;
+    QEMUIOVector qiov;
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = nb_sectors * BDRV_SECTOR_SIZE,
+    };
+    WriteCompressedCo wco = {
+        .bs = bs,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .qiov = nb_sectors ? &qiov : NULL,
+        .ret = NOT_DONE,
+    };
+
+    if (!drv)
+        return -ENOMEDIUM;
+    if (!drv->bdrv_co_write_compressed) {
+        if (!drv->bdrv_write_compressed)
+            return -ENOTSUP;
+        if (bdrv_check_request(bs, sector_num, nb_sectors))
+            return -EIO;
+
+        assert(!bs->dirty_bitmap);
+
+        return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
+    }
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    if (qemu_in_coroutine()) {
+        /* Fast-path if already in coroutine context */
+        bdrv_write_compressed_co_entry(&wco);
+    } else {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
+        aio_context_acquire(aio_context);
+        co = qemu_coroutine_create(bdrv_write_compressed_co_entry);
+        qemu_coroutine_enter(co, &wco);
+        while (wco.ret == NOT_DONE) {
+            aio_poll(aio_context, true);
+        }
+        aio_context_release(aio_context);
+    }
+    return wco.ret;
 }
 
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
@@ -3803,7 +3919,7 @@ static BlockDriverAIOCB *bdrv_aio_rw_vector(BlockDriverState *bs,
     acb->is_write = is_write;
     acb->qiov = qiov;
     acb->bounce = qemu_blockalign(bs, qiov->size);
-    acb->bh = qemu_bh_new(bdrv_aio_bh_cb, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_aio_bh_cb, acb);
 
     if (is_write) {
         qemu_iovec_to_buf(acb->qiov, 0, acb->bounce, qiov->size);
@@ -3844,12 +3960,15 @@ static void bdrv_aio_co_cancel_em(BlockDriverAIOCB *blockacb)
 {
     BlockDriverAIOCBCoroutine *acb =
         container_of(blockacb, BlockDriverAIOCBCoroutine, common);
+    AioContext *aio_context = bdrv_get_aio_context(acb->common.bs);
     bool done = false;
 
     acb->done = &done;
+    aio_context_acquire(aio_context);
     while (!done) {
-        qemu_aio_wait();
+        aio_poll(aio_context, true);
     }
+    aio_context_release(aio_context);
 }
 
 static const AIOCBInfo bdrv_em_co_aiocb_info = {
@@ -3885,7 +4004,7 @@ static void coroutine_fn bdrv_co_do_rw(void *opaque)
             acb->req.nb_sectors, acb->req.qiov, 0);
     }
 
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -3919,7 +4038,7 @@ static void coroutine_fn bdrv_aio_flush_co_entry(void *opaque)
     BlockDriverState *bs = acb->common.bs;
 
     acb->req.error = bdrv_co_flush(bs);
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -3946,7 +4065,7 @@ static void coroutine_fn bdrv_aio_discard_co_entry(void *opaque)
     BlockDriverState *bs = acb->common.bs;
 
     acb->req.error = bdrv_co_discard(bs, acb->req.sector, acb->req.nb_sectors);
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -4162,11 +4281,15 @@ int bdrv_flush(BlockDriverState *bs)
         /* Fast-path if already in coroutine context */
         bdrv_flush_co_entry(&rwco);
     } else {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
+        aio_context_acquire(aio_context);
         co = qemu_coroutine_create(bdrv_flush_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
-            qemu_aio_wait();
+            aio_poll(aio_context, true);
         }
+        aio_context_release(aio_context);
     }
 
     return rwco.ret;
@@ -4199,6 +4322,9 @@ int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
         return 0;
     }
 
+    /* Discarded sectors may read differently, so back them up again */
+    bdrv_set_dirty_bitmaps(bs, sector_num, nb_sectors);
+
     if (bs->drv->bdrv_co_discard) {
         return bs->drv->bdrv_co_discard(bs, sector_num, nb_sectors);
     } else if (bs->drv->bdrv_aio_discard) {
@@ -4234,11 +4360,15 @@ int bdrv_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
         /* Fast-path if already in coroutine context */
         bdrv_discard_co_entry(&rwco);
     } else {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
+        aio_context_acquire(aio_context);
         co = qemu_coroutine_create(bdrv_discard_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
-            qemu_aio_wait();
+            aio_poll(aio_context, true);
         }
+        aio_context_release(aio_context);
     }
 
     return rwco.ret;
@@ -4408,6 +4538,376 @@ int64_t bdrv_get_dirty_count(BlockDriverState *bs)
     }
 }
 
+struct BdrvDirtyBitmap {
+    char *name;
+    int64_t sectors;
+    HBitmap *bitmap;
+    HBitmap *frozen;        /* bits being copied by an incremental backup */
+    char *filename;         /* sidecar file of a persistent bitmap */
+    int fd;
+    char *image;            /* image file, see dirty_bitmap_image_stamp */
+    QLIST_ENTRY(BdrvDirtyBitmap) list;
+};
+
+/*
+ * The sidecar file of a persistent bitmap holds this header, followed by
+ * one bit per granule (bit i of byte j stands for granule 8 * j + i).
+ * The in-use flag is set while the image is open, so a bitmap that was not
+ * saved at shutdown is recognized and treated as all dirty.  The same
+ * happens when the image file was written after the save, by a QEMU that
+ * ran without the bitmap or by another program: the stamp recorded at
+ * save time no longer matches.
+ */
+#define DIRTY_BITMAP_MAGIC      0x5144424d /* "QDBM" */
+#define DIRTY_BITMAP_VERSION    1
+#define DIRTY_BITMAP_IN_USE     1
+#define DIRTY_BITMAP_STAMPED    2
+
+typedef struct QEMU_PACKED DirtyBitmapHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t granularity_bits;  /* log2 of the granule size, in sectors */
+    uint64_t sectors;
+    uint64_t image_size;        /* valid with DIRTY_BITMAP_STAMPED */
+    uint64_t image_mtime;       /* in nanoseconds */
+} DirtyBitmapHeader;
+
+/* Any write to a regular file changes its size or modification time.
+ * Block devices and network storage cannot be checked this way, so
+ * persistent bitmaps are refused for them.
+ */
+static bool dirty_bitmap_image_stamp(BdrvDirtyBitmap *bitmap,
+                                     uint64_t *size, uint64_t *mtime)
+{
+    struct stat st;
+
+    if (stat(bitmap->image, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+    *size = st.st_size;
+    *mtime = (uint64_t)st.st_mtime * 1000000000;
+#ifdef CONFIG_LINUX
+    *mtime += st.st_mtim.tv_nsec;
+#endif
+    return true;
+}
+
+static int dirty_bitmap_write_header(BdrvDirtyBitmap *bitmap, uint32_t flags)
+{
+    uint64_t image_size = 0, image_mtime = 0;
+    DirtyBitmapHeader header;
+
+    if (!(flags & DIRTY_BITMAP_IN_USE) &&
+        dirty_bitmap_image_stamp(bitmap, &image_size, &image_mtime)) {
+        flags |= DIRTY_BITMAP_STAMPED;
+    }
+    header = (DirtyBitmapHeader) {
+        .magic              = cpu_to_be32(DIRTY_BITMAP_MAGIC),
+        .version            = cpu_to_be32(DIRTY_BITMAP_VERSION),
+        .flags              = cpu_to_be32(flags),
+        .granularity_bits   = cpu_to_be32(hbitmap_granularity(bitmap->bitmap)),
+        .sectors            = cpu_to_be64(bitmap->sectors),
+        .image_size         = cpu_to_be64(image_size),
+        .image_mtime        = cpu_to_be64(image_mtime),
+    };
+
+    if (lseek(bitmap->fd, 0, SEEK_SET) < 0) {
+        return -errno;
+    }
+    if (qemu_write_full(bitmap->fd, &header, sizeof(header)) !=
+        sizeof(header)) {
+        return errno ? -errno : -EIO;
+    }
+    return 0;
+}
+
+/* Whether the bits in the file may be missing writes */
+static bool dirty_bitmap_stale(BdrvDirtyBitmap *bitmap,
+                               DirtyBitmapHeader *header)
+{
+    uint32_t flags = be32_to_cpu(header->flags);
+    uint64_t image_size, image_mtime;
+
+    if (flags & DIRTY_BITMAP_IN_USE) {
+        return true;
+    }
+    return !(flags & DIRTY_BITMAP_STAMPED) ||
+           !dirty_bitmap_image_stamp(bitmap, &image_size, &image_mtime) ||
+           image_size != be64_to_cpu(header->image_size) ||
+           image_mtime != be64_to_cpu(header->image_mtime);
+}
+
+static int dirty_bitmap_load(BdrvDirtyBitmap *bitmap, Error **errp)
+{
+    DirtyBitmapHeader header;
+    int granularity = hbitmap_granularity(bitmap->bitmap);
+    uint64_t granules, i;
+    size_t size;
+    uint8_t *buf;
+    ssize_t len;
+    int ret;
+
+    len = read(bitmap->fd, &header, sizeof(header));
+    if (len == 0) {
+        /* A new file; the bitmap starts empty */
+        goto out;
+    }
+    if (len != sizeof(header) ||
+        be32_to_cpu(header.magic) != DIRTY_BITMAP_MAGIC ||
+        be32_to_cpu(header.version) != DIRTY_BITMAP_VERSION) {
+        error_setg(errp, "'%s' is not a dirty bitmap file", bitmap->filename);
+        return -EINVAL;
+    }
+    if (be32_to_cpu(header.granularity_bits) != granularity ||
+        be64_to_cpu(header.sectors) != bitmap->sectors) {
+        error_setg(errp, "Dirty bitmap file '%s' does not match the size or "
+                   "the granularity of the image", bitmap->filename);
+        return -EINVAL;
+    }
+
+    if (dirty_bitmap_stale(bitmap, &header)) {
+        hbitmap_set(bitmap->bitmap, 0, bitmap->sectors);
+        goto out;
+    }
+
+    granules = DIV_ROUND_UP(bitmap->sectors, 1ULL << granularity);
+    size = DIV_ROUND_UP(granules, 8);
+    buf = g_malloc(size);
+    len = read(bitmap->fd, buf, size);
+    if (len != size) {
+        g_free(buf);
+        error_setg(errp, "Dirty bitmap file '%s' is truncated",
+                   bitmap->filename);
+        return -EINVAL;
+    }
+    for (i = 0; i < granules; i++) {
+        if (buf[i / 8] & (1 << (i % 8))) {
+            hbitmap_set(bitmap->bitmap, i << granularity, 1ULL << granularity);
+        }
+    }
+    g_free(buf);
+
+out:
+    ret = dirty_bitmap_write_header(bitmap, DIRTY_BITMAP_IN_USE);
+    if (ret == 0 && qemu_fdatasync(bitmap->fd) < 0) {
+        ret = -errno;
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write dirty bitmap file '%s'",
+                         bitmap->filename);
+        return ret;
+    }
+    return 0;
+}
+
+static int dirty_bitmap_save(BdrvDirtyBitmap *bitmap)
+{
+    int granularity = hbitmap_granularity(bitmap->bitmap);
+    uint64_t granules;
+    HBitmapIter hbi;
+    int64_t sector;
+    size_t size;
+    uint8_t *buf;
+    int ret;
+
+    granules = DIV_ROUND_UP(bitmap->sectors, 1ULL << granularity);
+    size = DIV_ROUND_UP(granules, 8);
+    buf = g_malloc0(size);
+
+    hbitmap_iter_init(&hbi, bitmap->bitmap, 0);
+    while ((sector = hbitmap_iter_next(&hbi)) >= 0) {
+        buf[(sector >> granularity) / 8] |= 1 << ((sector >> granularity) % 8);
+    }
+    if (bitmap->frozen) {
+        hbitmap_iter_init(&hbi, bitmap->frozen, 0);
+        while ((sector = hbitmap_iter_next(&hbi)) >= 0) {
+            buf[(sector >> granularity) / 8] |=
+                1 << ((sector >> granularity) % 8);
+        }
+    }
+
+    /* Write the bits first, so that the file is marked clean only once it
+     * is complete */
+    if (lseek(bitmap->fd, sizeof(DirtyBitmapHeader), SEEK_SET) < 0) {
+        ret = -errno;
+        goto out;
+    }
+    if (qemu_write_full(bitmap->fd, buf, size) != size) {
+        ret = errno ? -errno : -EIO;
+        goto out;
+    }
+    if (qemu_fdatasync(bitmap->fd) < 0) {
+        ret = -errno;
+        goto out;
+    }
+    ret = dirty_bitmap_write_header(bitmap, 0);
+    if (ret == 0 && qemu_fdatasync(bitmap->fd) < 0) {
+        ret = -errno;
+    }
+
+out:
+    g_free(buf);
+    return ret;
+}
+
+/*
+ * Creates a dirty bitmap called @name, tracking @granularity bytes per bit.
+ * With @filename, the bitmap is persistent: it is loaded from that file if
+ * it exists, and saved there when it is released or the image is closed.
+ */
+BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs,
+                                          const char *name, int granularity,
+                                          const char *filename, Error **errp)
+{
+    BdrvDirtyBitmap *bitmap;
+    int64_t sectors;
+
+    assert((granularity & (granularity - 1)) == 0);
+    assert(granularity >= BDRV_SECTOR_SIZE);
+
+    if (bdrv_find_dirty_bitmap(bs, name)) {
+        error_setg(errp, "Dirty bitmap '%s' already exists", name);
+        return NULL;
+    }
+
+    sectors = bdrv_getlength(bs);
+    if (sectors < 0) {
+        error_setg_errno(errp, -sectors, "Could not get the image size");
+        return NULL;
+    }
+    sectors >>= BDRV_SECTOR_BITS;
+
+    bitmap = g_new0(BdrvDirtyBitmap, 1);
+    bitmap->name = g_strdup(name);
+    bitmap->sectors = sectors;
+    bitmap->bitmap = hbitmap_alloc(sectors,
+                                   ffs(granularity >> BDRV_SECTOR_BITS) - 1);
+    bitmap->fd = -1;
+
+    if (filename) {
+        uint64_t image_size, image_mtime;
+
+        bitmap->filename = g_strdup(filename);
+        bitmap->image = g_strdup(bs->file ? bs->file->filename : bs->filename);
+        if (!dirty_bitmap_image_stamp(bitmap, &image_size, &image_mtime)) {
+            error_setg(errp, "Persistent dirty bitmaps need an image in a "
+                       "regular file, '%s' is not", bitmap->image);
+            goto fail;
+        }
+        bitmap->fd = qemu_open(filename, O_RDWR | O_CREAT | O_BINARY, 0644);
+        if (bitmap->fd < 0) {
+            error_setg_errno(errp, errno, "Could not open '%s'", filename);
+            goto fail;
+        }
+        if (dirty_bitmap_load(bitmap, errp) < 0) {
+            goto fail;
+        }
+    }
+
+    QLIST_INSERT_HEAD(&bs->dirty_bitmaps, bitmap, list);
+    return bitmap;
+
+fail:
+    if (bitmap->fd >= 0) {
+        qemu_close(bitmap->fd);
+    }
+    hbitmap_free(bitmap->bitmap);
+    g_free(bitmap->image);
+    g_free(bitmap->filename);
+    g_free(bitmap->name);
+    g_free(bitmap);
+    return NULL;
+}
+
+BdrvDirtyBitmap *bdrv_find_dirty_bitmap(BlockDriverState *bs,
+                                        const char *name)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        if (!strcmp(bitmap->name, name)) {
+            return bitmap;
+        }
+    }
+    return NULL;
+}
+
+void bdrv_release_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
+{
+    if (bitmap->fd >= 0) {
+        int ret = dirty_bitmap_save(bitmap);
+
+        /* The file stays marked in use, so it is not trusted next time */
+        if (ret < 0) {
+            error_report("Could not save dirty bitmap '%s' to '%s': %s",
+                         bitmap->name, bitmap->filename, strerror(-ret));
+        }
+        qemu_close(bitmap->fd);
+    }
+
+    QLIST_REMOVE(bitmap, list);
+    if (bitmap->frozen) {
+        hbitmap_free(bitmap->frozen);
+    }
+    hbitmap_free(bitmap->bitmap);
+    g_free(bitmap->image);
+    g_free(bitmap->filename);
+    g_free(bitmap->name);
+    g_free(bitmap);
+}
+
+static void bdrv_set_dirty_bitmaps(BlockDriverState *bs, int64_t cur_sector,
+                                   int nr_sectors)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        if (cur_sector < bitmap->sectors) {
+            hbitmap_set(bitmap->bitmap, cur_sector,
+                        MIN(nr_sectors, bitmap->sectors - cur_sector));
+        }
+    }
+}
+
+bool bdrv_dirty_bitmap_frozen(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->frozen != NULL;
+}
+
+/*
+ * Hands the dirty bits over to an incremental backup.  The bitmap starts
+ * again empty, recording the writes made while the backup runs.
+ */
+HBitmap *bdrv_dirty_bitmap_freeze(BdrvDirtyBitmap *bitmap)
+{
+    assert(!bitmap->frozen);
+    bitmap->frozen = bitmap->bitmap;
+    bitmap->bitmap = hbitmap_alloc(bitmap->sectors,
+                                   hbitmap_granularity(bitmap->frozen));
+    return bitmap->frozen;
+}
+
+/*
+ * Ends an incremental backup.  If it failed, the bits that it should have
+ * copied are merged back, so that the next backup copies them.
+ */
+void bdrv_dirty_bitmap_thaw(BdrvDirtyBitmap *bitmap, bool success)
+{
+    int granularity = hbitmap_granularity(bitmap->frozen);
+    HBitmapIter hbi;
+    int64_t sector;
+
+    if (!success) {
+        hbitmap_iter_init(&hbi, bitmap->frozen, 0);
+        while ((sector = hbitmap_iter_next(&hbi)) >= 0) {
+            hbitmap_set(bitmap->bitmap, sector, 1ULL << granularity);
+        }
+    }
+    hbitmap_free(bitmap->frozen);
+    bitmap->frozen = NULL;
+}
+
 /* Get a reference to bs */
 void bdrv_ref(BlockDriverState *bs)
 {
@@ -4648,8 +5148,125 @@ out:
 
 AioContext *bdrv_get_aio_context(BlockDriverState *bs)
 {
-    /* Currently BlockDriverState always uses the main loop AioContext */
-    return qemu_get_aio_context();
+    return bs->aio_context ? bs->aio_context : qemu_get_aio_context();
+}
+
+static void bdrv_detach_aio_context(BlockDriverState *bs)
+{
+    if (!bs->drv) {
+        return;
+    }
+
+    if (bs->io_limits_enabled) {
+        throttle_detach_aio_context(&bs->throttle_state);
+    }
+    if (bs->drv->bdrv_detach_aio_context) {
+        bs->drv->bdrv_detach_aio_context(bs);
+    }
+    if (bs->file) {
+        bdrv_detach_aio_context(bs->file);
+    }
+    if (bs->backing_hd) {
+        bdrv_detach_aio_context(bs->backing_hd);
+    }
+}
+
+static void bdrv_attach_aio_context(BlockDriverState *bs,
+                                    AioContext *new_context)
+{
+    bs->aio_context = new_context;
+
+    if (!bs->drv) {
+        return;
+    }
+
+    if (bs->backing_hd) {
+        bdrv_attach_aio_context(bs->backing_hd, new_context);
+    }
+    if (bs->file) {
+        bdrv_attach_aio_context(bs->file, new_context);
+    }
+    if (bs->drv->bdrv_attach_aio_context) {
+        bs->drv->bdrv_attach_aio_context(bs, new_context);
+    }
+    if (bs->io_limits_enabled) {
+        throttle_attach_aio_context(&bs->throttle_state, new_context);
+    }
+}
+
+bool bdrv_can_set_aio_context(BlockDriverState *bs)
+{
+    if (!bs->drv) {
+        return true;
+    }
+
+    /* Protocol drivers keep file descriptors registered in an AioContext,
+     * and need to be told when it changes.
+     */
+    if (bs->drv->protocol_name && !bs->drv->bdrv_attach_aio_context) {
+        return false;
+    }
+    if (bs->file && !bdrv_can_set_aio_context(bs->file)) {
+        return false;
+    }
+    if (bs->backing_hd && !bdrv_can_set_aio_context(bs->backing_hd)) {
+        return false;
+    }
+    return true;
+}
+
+void bdrv_set_aio_context(BlockDriverState *bs, AioContext *new_context)
+{
+    assert(bdrv_can_set_aio_context(bs));
+
+    bdrv_drain_all(); /* ensure there are no in-flight requests */
+
+    bdrv_detach_aio_context(bs);
+
+    /* This function executes in the old AioContext so acquire the new one in
+     * case it runs in a different thread.
+     */
+    aio_context_acquire(new_context);
+    bdrv_attach_aio_context(bs, new_context);
+    aio_context_release(new_context);
+}
+
+/*
+ * Device models plug the BlockDriverState while they process a batch of
+ * guest requests, so that the protocol driver can submit them to the host
+ * with a single system call when it is unplugged.
+ */
+void bdrv_io_plug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_plug) {
+        drv->bdrv_io_plug(bs);
+    } else if (bs->file) {
+        bdrv_io_plug(bs->file);
+    }
+}
+
+void bdrv_io_unplug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_unplug) {
+        drv->bdrv_io_unplug(bs);
+    } else if (bs->file) {
+        bdrv_io_unplug(bs->file);
+    }
+}
+
+void bdrv_flush_io_queue(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_flush_io_queue) {
+        drv->bdrv_flush_io_queue(bs);
+    } else if (bs->file) {
+        bdrv_flush_io_queue(bs->file);
+    }
 }
 
 void bdrv_add_before_write_notifier(BlockDriverState *bs,
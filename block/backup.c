@@ -44,6 +44,8 @@ typedef struct BackupBlockJob {
     CoRwlock flush_rwlock;
     uint64_t sectors_read;
     HBitmap *bitmap;
+    BdrvDirtyBitmap *sync_bitmap;
+    HBitmap *copy_bitmap;   /* clusters to copy in incremental mode */
     QLIST_HEAD(, CowRequest) inflight_reqs;
 } BackupBlockJob;
 
@@ -84,6 +86,30 @@ static void cow_request_end(CowRequest *req)
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
+/*
+ * In incremental mode, only the clusters that were dirty when the backup
+ * started are copied, also when the guest overwrites the others.
+ */
+static bool backup_cluster_needed(BackupBlockJob *job, int64_t cluster)
+{
+    int64_t sector = cluster * BACKUP_SECTORS_PER_CLUSTER;
+    int64_t end = MIN(sector + BACKUP_SECTORS_PER_CLUSTER,
+                      job->common.len / BDRV_SECTOR_SIZE);
+    int64_t granule;
+
+    if (!job->copy_bitmap) {
+        return true;
+    }
+
+    granule = 1LL << hbitmap_granularity(job->copy_bitmap);
+    for (; sector < end; sector += granule) {
+        if (hbitmap_get(job->copy_bitmap, sector)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 static int coroutine_fn backup_do_cow(BlockDriverState *bs,
                                       int64_t sector_num, int nb_sectors,
                                       bool *error_is_read)
@@ -108,9 +134,10 @@ static int coroutine_fn backup_do_cow(BlockDriverState *bs,
     cow_request_begin(&cow_request, job, start, end);
 
     for (; start < end; start++) {
-        if (hbitmap_get(job->bitmap, start)) {
+        if (hbitmap_get(job->bitmap, start) ||
+            !backup_cluster_needed(job, start)) {
             trace_backup_do_cow_skip(job, start);
-            continue; /* already copied */
+            continue; /* already copied, or not dirty */
         }
 
         trace_backup_do_cow_process(job, start);
@@ -221,6 +248,71 @@ static BlockErrorAction backup_error_action(BackupBlockJob *job,
     }
 }
 
+/* Sleeps as the speed limit requires; returns whether the job was
+ * cancelled meanwhile.
+ */
+static bool coroutine_fn backup_yield(BackupBlockJob *job)
+{
+    if (block_job_is_cancelled(&job->common)) {
+        return true;
+    }
+
+    /* we need to yield so that qemu_aio_flush() returns.
+     * (without, VM does not reboot)
+     */
+    if (job->common.speed) {
+        uint64_t delay_ns = ratelimit_calculate_delay(
+                &job->limit, job->sectors_read);
+        job->sectors_read = 0;
+        block_job_sleep_ns(&job->common, QEMU_CLOCK_REALTIME, delay_ns);
+    } else {
+        block_job_sleep_ns(&job->common, QEMU_CLOCK_REALTIME, 0);
+    }
+
+    return block_job_is_cancelled(&job->common);
+}
+
+/* Copies the clusters that the frozen dirty bitmap marks, skipping over
+ * clean areas without looking at them.
+ */
+static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
+{
+    BlockDriverState *bs = job->common.bs;
+    int64_t sectors = job->common.len / BDRV_SECTOR_SIZE;
+    int64_t granule = 1LL << hbitmap_granularity(job->copy_bitmap);
+    int64_t sector, cluster, end;
+    HBitmapIter hbi;
+    int ret;
+
+    hbitmap_iter_init(&hbi, job->copy_bitmap, 0);
+    while ((sector = hbitmap_iter_next(&hbi)) >= 0) {
+        cluster = sector / BACKUP_SECTORS_PER_CLUSTER;
+        end = DIV_ROUND_UP(MIN(sector + granule, sectors),
+                           BACKUP_SECTORS_PER_CLUSTER);
+
+        for (; cluster < end; cluster++) {
+            bool error_is_read;
+
+            if (backup_yield(job)) {
+                return 0;
+            }
+
+            ret = backup_do_cow(bs, cluster * BACKUP_SECTORS_PER_CLUSTER,
+                                BACKUP_SECTORS_PER_CLUSTER, &error_is_read);
+            if (ret < 0) {
+                /* Depending on error action, fail now or retry cluster */
+                BlockErrorAction action =
+                    backup_error_action(job, error_is_read, -ret);
+                if (action == BDRV_ACTION_REPORT) {
+                    return ret;
+                }
+                cluster--;
+            }
+        }
+    }
+    return 0;
+}
+
 static void coroutine_fn backup_run(void *opaque)
 {
     BackupBlockJob *job = opaque;
@@ -256,28 +348,14 @@ static void coroutine_fn backup_run(void *opaque)
             qemu_coroutine_yield();
             job->common.busy = true;
         }
+    } else if (job->sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) {
+        ret = backup_run_incremental(job);
     } else {
         /* Both FULL and TOP SYNC_MODE's require copying.. */
         for (; start < end; start++) {
             bool error_is_read;
 
-            if (block_job_is_cancelled(&job->common)) {
-                break;
-            }
-
-            /* we need to yield so that qemu_aio_flush() returns.
-             * (without, VM does not reboot)
-             */
-            if (job->common.speed) {
-                uint64_t delay_ns = ratelimit_calculate_delay(
-                        &job->limit, job->sectors_read);
-                job->sectors_read = 0;
-                block_job_sleep_ns(&job->common, QEMU_CLOCK_REALTIME, delay_ns);
-            } else {
-                block_job_sleep_ns(&job->common, QEMU_CLOCK_REALTIME, 0);
-            }
-
-            if (block_job_is_cancelled(&job->common)) {
+            if (backup_yield(job)) {
                 break;
             }
 
@@ -337,6 +415,13 @@ static void coroutine_fn backup_run(void *opaque)
 
     hbitmap_free(job->bitmap);
 
+    /* The dirty bits are dropped only if the backup has all of them */
+    if (job->sync_bitmap) {
+        bdrv_dirty_bitmap_thaw(job->sync_bitmap,
+                               ret == 0 &&
+                               !block_job_is_cancelled(&job->common));
+    }
+
     bdrv_iostatus_disable(target);
     bdrv_unref(target);
 
@@ -345,6 +430,7 @@ static void coroutine_fn backup_run(void *opaque)
 
 void backup_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, MirrorSyncMode sync_mode,
+                  BdrvDirtyBitmap *sync_bitmap,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockDriverCompletionFunc *cb, void *opaque,
@@ -355,6 +441,7 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
     assert(bs);
     assert(target);
     assert(cb);
+    assert((sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) == !!sync_bitmap);
 
     if ((on_source_error == BLOCKDEV_ON_ERROR_STOP ||
          on_source_error == BLOCKDEV_ON_ERROR_ENOSPC) &&
@@ -363,6 +450,11 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
         return;
     }
 
+    if (sync_bitmap && bdrv_dirty_bitmap_frozen(sync_bitmap)) {
+        error_setg(errp, "The dirty bitmap is in use by another backup");
+        return;
+    }
+
     len = bdrv_getlength(bs);
     if (len < 0) {
         error_setg_errno(errp, -len, "unable to get length for '%s'",
@@ -380,6 +472,10 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
     job->on_target_error = on_target_error;
     job->target = target;
     job->sync_mode = sync_mode;
+    if (sync_bitmap) {
+        job->sync_bitmap = sync_bitmap;
+        job->copy_bitmap = bdrv_dirty_bitmap_freeze(sync_bitmap);
+    }
     job->common.len = len;
     job->common.co = qemu_coroutine_create(backup_run);
     qemu_coroutine_enter(job->common.co, job);
@@ -12,18 +12,37 @@
 #include "qemu/queue.h"
 #include "block/raw-aio.h"
 #include "qemu/event_notifier.h"
+#include "qemu/error-report.h"
 
+#include <sys/utsname.h>
 #include <libaio.h>
 
 /*
- * Queue size (per-device).
- *
- * XXX: eventually we need to communicate this to the guest and/or make it
- *      tunable by the guest.  If we get more outstanding requests at a time
- *      than this we will get EAGAIN from io_submit which is communicated to
- *      the guest as an I/O error.
+ * Largest number of iocbs passed to io_submit at a time, and of events
+ * reaped by io_getevents at a time.  The size of the ring (per-device) is
+ * set by laio_init; requests beyond it wait in the pending queue until
+ * earlier ones complete.
+ */
+#define MAX_QUEUED_IO 128
+
+/*
+ * Layout of the completion ring that the kernel maps at the address of the
+ * io_context_t (see fs/aio.c).  The events between head and tail are ready,
+ * and userspace may consume them by moving head forward.
  */
-#define MAX_EVENTS 128
+struct aio_ring {
+    unsigned id;
+    unsigned nr;
+    unsigned head;
+    unsigned tail;
+    unsigned magic;
+    unsigned compat_features;
+    unsigned incompat_features;
+    unsigned header_length;
+    struct io_event io_events[0];
+};
+
+#define AIO_RING_MAGIC 0xa10a10a1
 
 struct qemu_laiocb {
     BlockDriverAIOCB common;
@@ -33,12 +52,28 @@ struct qemu_laiocb {
     size_t nbytes;
     QEMUIOVector *qiov;
     bool is_read;
-    QLIST_ENTRY(qemu_laiocb) node;
+    bool queued;        /* in the pending or failed queue, not the kernel */
+    QSIMPLEQ_ENTRY(qemu_laiocb) next;
 };
 
+typedef struct {
+    int plugged;
+    unsigned int in_queue;
+    unsigned int in_flight;
+    QSIMPLEQ_HEAD(, qemu_laiocb) pending;
+    QSIMPLEQ_HEAD(, qemu_laiocb) failed;
+} LaioQueue;
+
 struct qemu_laio_state {
     io_context_t ctx;
     EventNotifier e;
+    unsigned int max_events;
+    LaioQueue io_q;
+    QEMUBH *failed_bh;
+
+    /* Completion ring, if completions are polled from userspace */
+    struct aio_ring *ring;
+    AioContext *aio_context;
 };
 
 static inline ssize_t io_event_ret(struct io_event *ev)
@@ -74,36 +109,204 @@ static void qemu_laio_process_completion(struct qemu_laio_state *s,
     qemu_aio_release(laiocb);
 }
 
-static void qemu_laio_completion_cb(EventNotifier *e)
+/*
+ * Kernels without commit f8567a3845ac ("aio: fix aio request leak when
+ * events are reaped by userspace", Linux 3.16) only give the slot of a
+ * request back when its event is read with io_getevents.  A kernel that
+ * claims to be newer but still leaks shows up as io_submit failing with
+ * EAGAIN although nothing is in flight.  The slots are lost for good, so
+ * switch to a new context and to io_getevents.  If no new context can be
+ * set up, the old one is kept and the request fails.
+ */
+static int qemu_laio_stop_ring(struct qemu_laio_state *s)
 {
-    struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
+    io_context_t ctx = 0;
+    int ret;
+
+    ret = io_setup(s->max_events, &ctx);
+    if (ret < 0) {
+        error_report("linux-aio: kernel leaks requests reaped from userspace, "
+                     "and a new context could not be set up: %s",
+                     strerror(-ret));
+        return ret;
+    }
+
+    error_report("linux-aio: kernel leaks requests reaped from userspace, "
+                 "disabling aio-poll");
+    if (s->aio_context) {
+        aio_set_event_notifier_poll(s->aio_context, &s->e, NULL);
+    }
+    s->ring = NULL;
+
+    io_destroy(s->ctx);
+    s->ctx = ctx;
+    return 0;
+}
+
+/*
+ * Submits the pending requests in batches, as long as the ring has room for
+ * them.  Requests that the kernel rejects are completed from a bottom half,
+ * so that their callback never runs before laio_submit has returned.
+ */
+static void ioq_submit(struct qemu_laio_state *s)
+{
+    struct iocb *iocbs[MAX_QUEUED_IO];
+    struct qemu_laiocb *laiocb;
+    int ret, len, i;
+
+    while (!QSIMPLEQ_EMPTY(&s->io_q.pending) &&
+           s->io_q.in_flight < s->max_events) {
+        len = 0;
+        QSIMPLEQ_FOREACH(laiocb, &s->io_q.pending, next) {
+            iocbs[len++] = &laiocb->iocb;
+            if (len == MAX_QUEUED_IO ||
+                s->io_q.in_flight + len == s->max_events) {
+                break;
+            }
+        }
+
+        ret = io_submit(s->ctx, len, iocbs);
+        if (ret == -EAGAIN && s->io_q.in_flight > 0) {
+            /* Out of kernel resources; retry when requests complete */
+            break;
+        }
+        if (ret == -EAGAIN && s->ring && qemu_laio_stop_ring(s) == 0) {
+            continue;
+        }
+        if (ret < 0) {
+            /* Fail the first request and retry the others */
+            laiocb = QSIMPLEQ_FIRST(&s->io_q.pending);
+            QSIMPLEQ_REMOVE_HEAD(&s->io_q.pending, next);
+            s->io_q.in_queue--;
+            laiocb->ret = ret;
+            QSIMPLEQ_INSERT_TAIL(&s->io_q.failed, laiocb, next);
+            qemu_bh_schedule(s->failed_bh);
+            continue;
+        }
+
+        for (i = 0; i < ret; i++) {
+            laiocb = QSIMPLEQ_FIRST(&s->io_q.pending);
+            QSIMPLEQ_REMOVE_HEAD(&s->io_q.pending, next);
+            laiocb->queued = false;
+        }
+        s->io_q.in_queue -= ret;
+        s->io_q.in_flight += ret;
+        if (ret < len) {
+            break;
+        }
+    }
+}
+
+static void qemu_laio_failed_bh(void *opaque)
+{
+    struct qemu_laio_state *s = opaque;
+    struct qemu_laiocb *laiocb;
+
+    while ((laiocb = QSIMPLEQ_FIRST(&s->io_q.failed))) {
+        QSIMPLEQ_REMOVE_HEAD(&s->io_q.failed, next);
+        qemu_laio_process_completion(s, laiocb);
+    }
+}
+
+static void qemu_laio_complete_event(struct qemu_laio_state *s,
+                                     struct io_event *event)
+{
+    struct qemu_laiocb *laiocb =
+            container_of(event->obj, struct qemu_laiocb, iocb);
+
+    s->io_q.in_flight--;
+    laiocb->ret = io_event_ret(event);
+    qemu_laio_process_completion(s, laiocb);
+}
+
+/*
+ * Consumes the completed events straight from the ring, without a system
+ * call.  Each event is copied and its slot released before the callback
+ * runs, so the callbacks may submit, cancel or reap requests themselves.
+ */
+static void qemu_laio_reap_ring(struct qemu_laio_state *s)
+{
+    struct aio_ring *ring = s->ring;
+    struct io_event event;
+    unsigned int head;
 
-    while (event_notifier_test_and_clear(&s->e)) {
-        struct io_event events[MAX_EVENTS];
-        struct timespec ts = { 0 };
-        int nevents, i;
+    while ((head = atomic_read(&ring->head)) != atomic_read(&ring->tail)) {
+        /* Read the event after the tail that covers it... */
+        smp_rmb();
+        event = ring->io_events[head];
+        /* ...and before the kernel can reuse its slot */
+        smp_mb();
+        atomic_set(&ring->head, (head + 1) % ring->nr);
+        qemu_laio_complete_event(s, &event);
+    }
+}
 
+static void qemu_laio_reap_syscall(struct qemu_laio_state *s)
+{
+    struct io_event events[MAX_QUEUED_IO];
+    struct timespec ts = { 0 };
+    int nevents, i;
+
+    do {
         do {
-            nevents = io_getevents(s->ctx, MAX_EVENTS, MAX_EVENTS, events, &ts);
+            nevents = io_getevents(s->ctx, 0, MAX_QUEUED_IO, events, &ts);
         } while (nevents == -EINTR);
 
         for (i = 0; i < nevents; i++) {
-            struct iocb *iocb = events[i].obj;
-            struct qemu_laiocb *laiocb =
-                    container_of(iocb, struct qemu_laiocb, iocb);
-
-            laiocb->ret = io_event_ret(&events[i]);
-            qemu_laio_process_completion(s, laiocb);
+            qemu_laio_complete_event(s, &events[i]);
         }
+    } while (nevents == MAX_QUEUED_IO);
+}
+
+static void qemu_laio_completion_cb(EventNotifier *e)
+{
+    struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
+
+    /* The kernel signals the eventfd after it fills the ring, so every event
+     * that is not reaped below will cause another call.  When polling, the
+     * eventfd may not have been signalled yet.
+     */
+    event_notifier_test_and_clear(&s->e);
+    if (s->ring) {
+        qemu_laio_reap_ring(s);
+    } else {
+        qemu_laio_reap_syscall(s);
+    }
+
+    /* Room was freed in the ring for requests that spilled over */
+    if (!s->io_q.plugged && !QSIMPLEQ_EMPTY(&s->io_q.pending)) {
+        ioq_submit(s);
     }
 }
 
+/* Called in a busy loop by aio_poll() before it goes to sleep */
+static bool qemu_laio_poll_cb(EventNotifier *e)
+{
+    struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
+
+    return atomic_read(&s->ring->head) != atomic_read(&s->ring->tail);
+}
+
 static void laio_cancel(BlockDriverAIOCB *blockacb)
 {
     struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
+    struct qemu_laio_state *s = laiocb->ctx;
     struct io_event event;
     int ret;
 
+    if (laiocb->queued) {
+        /* The request never reached the kernel */
+        if (laiocb->ret == -EINPROGRESS) {
+            QSIMPLEQ_REMOVE(&s->io_q.pending, laiocb, qemu_laiocb, next);
+            s->io_q.in_queue--;
+            qemu_aio_release(laiocb);
+        } else {
+            /* The bottom half releases it without calling the callback */
+            laiocb->ret = -ECANCELED;
+        }
+        return;
+    }
+
     if (laiocb->ret != -EINPROGRESS)
         return;
 
@@ -114,6 +317,7 @@ static void laio_cancel(BlockDriverAIOCB *blockacb)
      */
     ret = io_cancel(laiocb->ctx->ctx, &laiocb->iocb, &event);
     if (ret == 0) {
+        s->io_q.in_flight--;
         laiocb->ret = -ECANCELED;
         return;
     }
@@ -168,8 +372,12 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
     }
     io_set_eventfd(&laiocb->iocb, event_notifier_get_fd(&s->e));
 
-    if (io_submit(s->ctx, 1, &iocbs) < 0)
-        goto out_free_aiocb;
+    laiocb->queued = true;
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.pending, laiocb, next);
+    s->io_q.in_queue++;
+    if (!s->io_q.plugged || s->io_q.in_queue >= MAX_QUEUED_IO) {
+        ioq_submit(s);
+    }
     return &laiocb->common;
 
 out_free_aiocb:
@@ -177,20 +385,81 @@ out_free_aiocb:
     return NULL;
 }
 
-void *laio_init(void)
+void laio_io_plug(BlockDriverState *bs, void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    s->io_q.plugged++;
+}
+
+/*
+ * Submits the requests queued since the outermost laio_io_plug.  With
+ * @unplug false, the queue is flushed whether or not it is plugged.
+ */
+void laio_io_unplug(BlockDriverState *bs, void *aio_ctx, bool unplug)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    if (unplug) {
+        assert(s->io_q.plugged > 0);
+        if (--s->io_q.plugged > 0) {
+            return;
+        }
+    }
+
+    if (!QSIMPLEQ_EMPTY(&s->io_q.pending)) {
+        ioq_submit(s);
+    }
+
+    /* Fast devices may have completed some requests already */
+    if (s->ring) {
+        qemu_laio_reap_ring(s);
+    }
+}
+
+/* See qemu_laio_stop_ring */
+static bool qemu_laio_kernel_reaps_ring(void)
+{
+    struct utsname uts;
+    int major, minor;
+
+    if (uname(&uts) < 0 ||
+        sscanf(uts.release, "%d.%d", &major, &minor) != 2) {
+        return false;
+    }
+    return major > 3 || (major == 3 && minor >= 16);
+}
+
+/*
+ * With @poll, completions are reaped from the ring in userspace, also right
+ * after the queue is unplugged and while aio_poll busy-waits, rather than
+ * only through the eventfd and io_getevents.  Kernels older than 3.16, or
+ * whose ring has an unknown layout, use io_getevents.
+ */
+void *laio_init(unsigned int max_events, bool poll)
 {
     struct qemu_laio_state *s;
 
     s = g_malloc0(sizeof(*s));
+    s->max_events = max_events;
+    QSIMPLEQ_INIT(&s->io_q.pending);
+    QSIMPLEQ_INIT(&s->io_q.failed);
     if (event_notifier_init(&s->e, false) < 0) {
         goto out_free_state;
     }
 
-    if (io_setup(MAX_EVENTS, &s->ctx) != 0) {
+    if (io_setup(max_events, &s->ctx) != 0) {
         goto out_close_efd;
     }
 
-    qemu_aio_set_event_notifier(&s->e, qemu_laio_completion_cb);
+    if (poll && qemu_laio_kernel_reaps_ring()) {
+        struct aio_ring *ring = (struct aio_ring *)s->ctx;
+
+        if (ring->magic == AIO_RING_MAGIC && ring->incompat_features == 0 &&
+            ring->header_length == sizeof(*ring)) {
+            s->ring = ring;
+        }
+    }
 
     return s;
 
@@ -200,3 +469,36 @@ out_free_state:
     g_free(s);
     return NULL;
 }
+
+void laio_cleanup(void *s_)
+{
+    struct qemu_laio_state *s = s_;
+
+    assert(QSIMPLEQ_EMPTY(&s->io_q.pending));
+    assert(QSIMPLEQ_EMPTY(&s->io_q.failed));
+    event_notifier_cleanup(&s->e);
+    io_destroy(s->ctx);
+    g_free(s);
+}
+
+void laio_detach_aio_context(void *s_, AioContext *old_context)
+{
+    struct qemu_laio_state *s = s_;
+
+    aio_set_event_notifier(old_context, &s->e, NULL);
+    qemu_bh_delete(s->failed_bh);
+    s->failed_bh = NULL;
+    s->aio_context = NULL;
+}
+
+void laio_attach_aio_context(void *s_, AioContext *new_context)
+{
+    struct qemu_laio_state *s = s_;
+
+    s->aio_context = new_context;
+    s->failed_bh = aio_bh_new(new_context, qemu_laio_failed_bh, s);
+    aio_set_event_notifier(new_context, &s->e, qemu_laio_completion_cb);
+    if (s->ring) {
+        aio_set_event_notifier_poll(new_context, &s->e, qemu_laio_poll_cb);
+    }
+}
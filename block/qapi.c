@@ -316,6 +316,11 @@ BlockStats *bdrv_query_stats(const BlockDriverState *bs)
     s->stats->rd_total_time_ns = bs->total_time_ns[BDRV_ACCT_READ];
     s->stats->flush_total_time_ns = bs->total_time_ns[BDRV_ACCT_FLUSH];
 
+    if (bs->drv && bs->drv->bdrv_get_metadata_cache_stats) {
+        s->metadata_cache = bs->drv->bdrv_get_metadata_cache_stats(bs);
+        s->has_metadata_cache = s->metadata_cache != NULL;
+    }
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = bdrv_query_stats(bs->file);
@@ -1318,29 +1318,130 @@ static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
     return 0;
 }
 
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
+typedef struct Qcow2DecompressData {
+    uint8_t *out_buf;
+    int out_buf_size;
+    const uint8_t *buf;
+    int buf_size;
+} Qcow2DecompressData;
+
+static int decompress_buffer_func(void *opaque)
+{
+    Qcow2DecompressData *data = opaque;
+
+    if (decompress_buffer(data->out_buf, data->out_buf_size,
+                          data->buf, data->buf_size) < 0) {
+        return -EIO;
+    }
+    return 0;
+}
+
+/* Forgets all decompressed clusters, including those that are being
+ * decompressed right now */
+void qcow2_compressed_cache_reset(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < QCOW2_COMPRESSED_CACHE_SIZE; i++) {
+        s->cluster_cache_offset[i] = -1;
+        s->cluster_cache_lru[i] = 0;
+    }
+    s->cluster_cache_generation++;
+}
+
+/*
+ * Copies the part of a compressed cluster that starts offset_in_cluster bytes
+ * into the cluster to qiov.  Must be called with s->lock held.  On a cache
+ * miss the lock is dropped while the compressed data is read and inflated in
+ * a worker thread, so that many compressed clusters can be decompressed in
+ * parallel.
+ */
+int coroutine_fn qcow2_decompress_cluster(BlockDriverState *bs,
+                                          uint64_t cluster_offset,
+                                          int offset_in_cluster,
+                                          QEMUIOVector *qiov)
 {
     BDRVQcowState *s = bs->opaque;
     int ret, csize, nb_csectors, sector_offset;
+    int i, victim;
     uint64_t coffset;
+    uint8_t *buf, *out_buf;
+    unsigned generation;
+    QEMUIOVector local_qiov;
+    struct iovec iov;
+    Qcow2DecompressData data;
 
     coffset = cluster_offset & s->cluster_offset_mask;
-    if (s->cluster_cache_offset != coffset) {
-        nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
-        sector_offset = coffset & 511;
-        csize = nb_csectors * 512 - sector_offset;
-        BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-        ret = bdrv_read(bs->file, coffset >> 9, s->cluster_data, nb_csectors);
-        if (ret < 0) {
-            return ret;
+    victim = 0;
+    for (i = 0; i < QCOW2_COMPRESSED_CACHE_SIZE; i++) {
+        if (s->cluster_cache_offset[i] == coffset) {
+            s->cluster_cache_lru[i] = ++s->cluster_cache_lru_counter;
+            qemu_iovec_from_buf(qiov, 0, s->cluster_cache +
+                                (size_t) i * s->cluster_size +
+                                offset_in_cluster, qiov->size);
+            return 0;
         }
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data + sector_offset, csize) < 0) {
-            return -EIO;
+        if (s->cluster_cache_lru[i] < s->cluster_cache_lru[victim]) {
+            victim = i;
         }
-        s->cluster_cache_offset = coffset;
     }
-    return 0;
+
+    nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
+    sector_offset = coffset & 511;
+    csize = nb_csectors * 512 - sector_offset;
+
+    buf = qemu_blockalign(bs, nb_csectors * 512);
+    out_buf = qemu_blockalign(bs, s->cluster_size);
+    generation = s->cluster_cache_generation;
+
+    qemu_co_mutex_unlock(&s->lock);
+
+    iov.iov_base = buf;
+    iov.iov_len = nb_csectors * 512;
+    qemu_iovec_init_external(&local_qiov, &iov, 1);
+
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_co_readv(bs->file, coffset >> 9, nb_csectors, &local_qiov);
+    if (ret >= 0) {
+        data = (Qcow2DecompressData) {
+            .out_buf        = out_buf,
+            .out_buf_size   = s->cluster_size,
+            .buf            = buf + sector_offset,
+            .buf_size       = csize,
+        };
+        ret = qcow2_co_run_in_thread(bs, decompress_buffer_func, &data);
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+
+    if (ret >= 0) {
+        qemu_iovec_from_buf(qiov, 0, out_buf + offset_in_cluster, qiov->size);
+
+        /* Only cache the result if the compressed data cannot have been
+         * replaced while the lock was dropped */
+        if (generation == s->cluster_cache_generation) {
+            for (i = 0; i < QCOW2_COMPRESSED_CACHE_SIZE; i++) {
+                if (s->cluster_cache_offset[i] == coffset) {
+                    break;
+                }
+                if (s->cluster_cache_lru[i] < s->cluster_cache_lru[victim]) {
+                    victim = i;
+                }
+            }
+            if (i == QCOW2_COMPRESSED_CACHE_SIZE) {
+                memcpy(s->cluster_cache + (size_t) victim * s->cluster_size,
+                       out_buf, s->cluster_size);
+                s->cluster_cache_offset[victim] = coffset;
+                s->cluster_cache_lru[victim] = ++s->cluster_cache_lru_counter;
+            }
+        }
+        ret = 0;
+    }
+
+    qemu_vfree(buf);
+    qemu_vfree(out_buf);
+    return ret;
 }
 
 /*
@@ -26,12 +26,16 @@
 #include "block/block_int.h"
 #include "block/qcow2.h"
 #include "qemu/range.h"
+#include "qemu/bitmap.h"
 #include "qapi/qmp/types.h"
 
 static int64_t alloc_clusters_noref(BlockDriverState *bs, int64_t size);
 static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
                             int64_t offset, int64_t length,
                             int addend, enum qcow2_discard_type type);
+static void free_index_drop(BDRVQcowState *s);
+static void free_index_update(BDRVQcowState *s, int64_t cluster_index,
+                              bool free);
 
 
 /*********************************************************/
@@ -61,6 +65,7 @@ int qcow2_refcount_init(BlockDriverState *bs)
 void qcow2_refcount_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+    free_index_drop(s);
     g_free(s->refcount_table);
 }
 
@@ -234,6 +239,7 @@ static int alloc_refcount_block(BlockDriverState *bs,
         int block_index = (new_block >> s->cluster_bits) &
             ((1 << (s->cluster_bits - REFCOUNT_SHIFT)) - 1);
         (*refcount_block)[block_index] = cpu_to_be16(1);
+        free_index_update(s, new_block >> s->cluster_bits, false);
     } else {
         /* Described somewhere else. This can recurse at most twice before we
          * arrive at a block that describes itself. */
@@ -400,6 +406,9 @@ static int alloc_refcount_block(BlockDriverState *bs,
     s->refcount_table_size = table_size;
     s->refcount_table_offset = table_offset;
 
+    /* The free cluster index covers the old table only; rebuild it lazily */
+    free_index_drop(s);
+
     /* Free old table. Remember, we must not change free_cluster_index */
     uint64_t old_free_cluster_index = s->free_cluster_index;
     qcow2_free_clusters(bs, old_table_offset, old_table_size * sizeof(uint64_t),
@@ -558,6 +567,7 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
             s->free_cluster_index = cluster_index;
         }
         refcount_block[block_index] = cpu_to_be16(refcount);
+        free_index_update(s, cluster_index, refcount == 0);
 
         if (refcount == 0 && s->discard_passthrough[type]) {
             update_refcount_discard(bs, cluster_offset, s->cluster_size);
@@ -625,21 +635,220 @@ int qcow2_update_cluster_refcount(BlockDriverState *bs,
 
 
 
+/*
+ * The free cluster index has one bit for each cluster covered by the refcount
+ * table, set if the refcount of the cluster is zero.  It is built lazily:
+ * all bits start out set, and the bits covered by one refcount block become
+ * exact the first time the allocator looks at one of its clusters.  From
+ * then on update_refcount keeps them exact.
+ *
+ * The allocator still does a first fit search from free_cluster_index, but
+ * runs of used clusters are skipped with a bitmap search rather than one
+ * refcount lookup per cluster.
+ *
+ * The refcount table can describe far more clusters than the image has (2^28
+ * with a single 64k table cluster), so the bitmap only covers the clusters of
+ * the image file when it is built, and is doubled when the allocator goes past
+ * its end.  Bits beyond the end are not kept; the refcount blocks that cover
+ * them are loaded when the bitmap grows.  Clusters that the bitmap cannot
+ * cover are looked up with get_refcount.
+ */
+
+static void free_index_drop(BDRVQcowState *s)
+{
+    if (s->free_cluster_bitmap) {
+        hbitmap_free(s->free_cluster_bitmap);
+        s->free_cluster_bitmap = NULL;
+    }
+    g_free(s->free_cluster_loaded);
+    s->free_cluster_loaded = NULL;
+    s->free_cluster_bitmap_size = 0;
+}
+
+/* Makes the index cover at least size clusters, if the refcount table does */
+static void free_index_grow(BDRVQcowState *s, uint64_t size)
+{
+    uint64_t block_size = 1ULL << (s->cluster_bits - REFCOUNT_SHIFT);
+    uint64_t old_size = s->free_cluster_bitmap_size;
+    uint64_t max_size, i;
+    HBitmapIter hbi;
+    HBitmap *hb;
+    int64_t next;
+
+    max_size = MIN((uint64_t) s->refcount_table_size * block_size,
+                   1ULL << HBITMAP_LOG_MAX_SIZE);
+    size = MIN(ROUND_UP(MAX(size, old_size * 2), block_size), max_size);
+    if (size <= old_size) {
+        return;
+    }
+
+    hb = hbitmap_alloc(size, 0);
+    for (i = 0; i < old_size; i += block_size) {
+        if (!test_bit(i / block_size, s->free_cluster_loaded)) {
+            hbitmap_set(hb, i, block_size);
+            continue;
+        }
+        hbitmap_iter_init(&hbi, s->free_cluster_bitmap, i);
+        while ((next = hbitmap_iter_next(&hbi)) >= 0 &&
+               next < i + block_size) {
+            hbitmap_set(hb, next, 1);
+        }
+    }
+    hbitmap_set(hb, old_size, size - old_size);
+
+    if (s->free_cluster_bitmap) {
+        hbitmap_free(s->free_cluster_bitmap);
+    } else {
+        s->free_cluster_loaded = bitmap_new(s->refcount_table_size);
+    }
+    s->free_cluster_bitmap = hb;
+    s->free_cluster_bitmap_size = size;
+}
+
+static void free_index_init(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t file_size = bdrv_getlength(bs->file);
+
+    assert(!s->free_cluster_bitmap);
+    free_index_grow(s, file_size > 0 ? DIV_ROUND_UP(file_size, s->cluster_size)
+                                     : 1);
+}
+
+static void free_index_update(BDRVQcowState *s, int64_t cluster_index,
+                              bool free)
+{
+    if (cluster_index >= s->free_cluster_bitmap_size) {
+        return;
+    }
+
+    if (free) {
+        hbitmap_set(s->free_cluster_bitmap, cluster_index, 1);
+    } else {
+        hbitmap_reset(s->free_cluster_bitmap, cluster_index, 1);
+    }
+}
+
+/* Makes the bits covered by the refcount block at table_index exact */
+static int free_index_load(BlockDriverState *bs, int64_t table_index)
+{
+    BDRVQcowState *s = bs->opaque;
+    int nb_entries = 1 << (s->cluster_bits - REFCOUNT_SHIFT);
+    int64_t first = table_index << (s->cluster_bits - REFCOUNT_SHIFT);
+    uint16_t *refcount_block;
+    int i, ret;
+
+    if (s->refcount_table[table_index]) {
+        ret = load_refcount_block(bs, s->refcount_table[table_index],
+                                  (void **) &refcount_block);
+        if (ret < 0) {
+            return ret;
+        }
+
+        for (i = 0; i < nb_entries; i++) {
+            free_index_update(s, first + i, refcount_block[i] == 0);
+        }
+
+        ret = qcow2_cache_put(bs, s->refcount_block_cache,
+                              (void **) &refcount_block);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    set_bit(table_index, s->free_cluster_loaded);
+    return 0;
+}
+
+/*
+ * Returns 1 if the cluster is free, 0 if it is in use and -errno on error.
+ * Like get_refcount, this does not know about clusters that were returned by
+ * alloc_clusters_noref but whose refcount has not been increased yet.
+ */
+static int free_index_is_free(BlockDriverState *bs, int64_t cluster_index)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t table_index;
+    int ret;
+
+    if (cluster_index >= s->free_cluster_bitmap_size) {
+        free_index_grow(s, cluster_index + 1);
+    }
+    if (cluster_index >= s->free_cluster_bitmap_size) {
+        ret = get_refcount(bs, cluster_index);
+        return ret < 0 ? ret : ret == 0;
+    }
+
+    table_index = cluster_index >> (s->cluster_bits - REFCOUNT_SHIFT);
+    if (!test_bit(table_index, s->free_cluster_loaded)) {
+        ret = free_index_load(bs, table_index);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return hbitmap_get(s->free_cluster_bitmap, cluster_index);
+}
+
+/* Returns the first free cluster at or after cluster_index, or -errno */
+static int64_t free_index_find(BlockDriverState *bs, int64_t cluster_index)
+{
+    BDRVQcowState *s = bs->opaque;
+    HBitmapIter hbi;
+    int64_t next, table_index;
+    int ret;
+
+    for (;;) {
+        if (cluster_index >= s->free_cluster_bitmap_size) {
+            return cluster_index;
+        }
+
+        hbitmap_iter_init(&hbi, s->free_cluster_bitmap, cluster_index);
+        next = hbitmap_iter_next(&hbi);
+        if (next < 0) {
+            return s->free_cluster_bitmap_size;
+        }
+
+        table_index = next >> (s->cluster_bits - REFCOUNT_SHIFT);
+        if (test_bit(table_index, s->free_cluster_loaded)) {
+            return next;
+        }
+
+        /* Each refcount block is loaded at most once, after which the
+         * search continues from the same place with exact bits */
+        ret = free_index_load(bs, table_index);
+        if (ret < 0) {
+            return ret;
+        }
+        cluster_index = next;
+    }
+}
+
 /* return < 0 if error */
 static int64_t alloc_clusters_noref(BlockDriverState *bs, int64_t size)
 {
     BDRVQcowState *s = bs->opaque;
-    int i, nb_clusters, refcount;
+    int i, nb_clusters, ret;
+    int64_t next_free;
+
+    if (!s->free_cluster_bitmap) {
+        free_index_init(bs);
+    }
 
     nb_clusters = size_to_clusters(s, size);
 retry:
     for(i = 0; i < nb_clusters; i++) {
         int64_t next_cluster_index = s->free_cluster_index++;
-        refcount = get_refcount(bs, next_cluster_index);
+        ret = free_index_is_free(bs, next_cluster_index);
 
-        if (refcount < 0) {
-            return refcount;
-        } else if (refcount != 0) {
+        if (ret < 0) {
+            return ret;
+        } else if (ret == 0) {
+            next_free = free_index_find(bs, s->free_cluster_index);
+            if (next_free < 0) {
+                return next_free;
+            }
+            s->free_cluster_index = next_free;
             goto retry;
         }
     }
@@ -1460,7 +1669,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                           BdrvCheckMode fix)
 {
     BDRVQcowState *s = bs->opaque;
-    int64_t size, i, highest_cluster;
+    int64_t size, i, highest_cluster, extent;
     int nb_clusters, refcount1, refcount2;
     QCowSnapshot *sn;
     uint16_t *refcount_table;
@@ -1619,6 +1828,20 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         goto fail;
     }
 
+    /* Free space between the clusters in use, i.e. before the image end */
+    for (i = 0, extent = 0; i <= highest_cluster; i++) {
+        if (refcount_table[i] == 0) {
+            res->bfi.free_clusters++;
+            if (extent++ == 0) {
+                res->bfi.free_extents++;
+            }
+            res->bfi.largest_free_extent =
+                MAX(res->bfi.largest_free_extent, extent);
+        } else {
+            extent = 0;
+        }
+    }
+
     res->image_end_offset = (highest_cluster + 1) * s->cluster_size;
     ret = 0;
 
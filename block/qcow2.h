@@ -26,7 +26,9 @@
 #define BLOCK_QCOW2_H
 
 #include "qemu/aes.h"
+#include "qemu/hbitmap.h"
 #include "block/coroutine.h"
+#include "block/thread-pool.h"
 
 //#define DEBUG_ALLOC
 //#define DEBUG_ALLOC2
@@ -51,13 +53,33 @@
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
-#define L2_CACHE_SIZE 16
+/* Minimum and default sizes of the metadata caches.  The minimums are in
+ * tables, the defaults in bytes (1 MB of L2 tables covers 8 GB of guest
+ * disk with 64 kB clusters). */
+
+/* Must be at least 2 to cover COW: l2_allocate reads the old table while it
+ * holds the new one */
+#define MIN_L2_CACHE_SIZE 2
 
 /* Must be at least 4 to cover all cases of refcount table growth */
-#define REFCOUNT_CACHE_SIZE 4
+#define MIN_REFCOUNT_CACHE_SIZE 4
+
+#define DEFAULT_L2_CACHE_BYTE_SIZE 1048576 /* bytes */
+
+/* The refcount block cache gets a quarter of the L2 table cache, or a fifth of
+ * the combined size if only cache-size is given */
+#define DEFAULT_L2_REFCOUNT_SIZE_RATIO 4
 
 #define DEFAULT_CLUSTER_SIZE 65536
 
+/* Number of decompressed clusters kept in memory */
+#define QCOW2_COMPRESSED_CACHE_SIZE 16
+
+/* Maximum number of clusters that are compressed or decompressed in worker
+ * threads at the same time; the rest of the thread pool stays available for
+ * file I/O */
+#define QCOW2_MAX_THREADS 16
+
 
 #define QCOW2_OPT_LAZY_REFCOUNTS "lazy-refcounts"
 #define QCOW2_OPT_DISCARD_REQUEST "pass-discard-request"
@@ -72,6 +94,9 @@
 #define QCOW2_OPT_OVERLAP_SNAPSHOT_TABLE "overlap-check.snapshot-table"
 #define QCOW2_OPT_OVERLAP_INACTIVE_L1 "overlap-check.inactive-l1"
 #define QCOW2_OPT_OVERLAP_INACTIVE_L2 "overlap-check.inactive-l2"
+#define QCOW2_OPT_CACHE_SIZE "cache-size"
+#define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
+#define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -183,9 +208,13 @@ typedef struct BDRVQcowState {
     Qcow2Cache* l2_table_cache;
     Qcow2Cache* refcount_block_cache;
 
+    /* Decompressed clusters, looked up by the offset of their compressed
+     * data; see qcow2_decompress_cluster */
     uint8_t *cluster_cache;
-    uint8_t *cluster_data;
-    uint64_t cluster_cache_offset;
+    uint64_t cluster_cache_offset[QCOW2_COMPRESSED_CACHE_SIZE];
+    uint64_t cluster_cache_lru[QCOW2_COMPRESSED_CACHE_SIZE];
+    uint64_t cluster_cache_lru_counter;
+    unsigned cluster_cache_generation;
     QLIST_HEAD(QCowClusterAlloc, QCowL2Meta) cluster_allocs;
 
     uint64_t *refcount_table;
@@ -194,8 +223,17 @@ typedef struct BDRVQcowState {
     int64_t free_cluster_index;
     int64_t free_byte_offset;
 
+    /* Free cluster index, see qcow2-refcount.c */
+    HBitmap *free_cluster_bitmap;
+    unsigned long *free_cluster_loaded;
+    uint64_t free_cluster_bitmap_size;
+
     CoMutex lock;
 
+    /* Compression and decompression in worker threads */
+    int nb_threads;
+    CoQueue thread_queue;
+
     uint32_t crypt_method; /* current crypt method, 0 if no key yet */
     uint32_t crypt_method_header;
     AES_KEY aes_encrypt_key;
@@ -419,6 +457,9 @@ static inline uint64_t l2meta_cow_end(QCowL2Meta *m)
 int qcow2_backing_read1(BlockDriverState *bs, QEMUIOVector *qiov,
                   int64_t sector_num, int nb_sectors);
 
+int coroutine_fn qcow2_co_run_in_thread(BlockDriverState *bs,
+                                        ThreadPoolFunc *func, void *arg);
+
 int qcow2_mark_dirty(BlockDriverState *bs);
 int qcow2_mark_corrupt(BlockDriverState *bs);
 int qcow2_mark_consistent(BlockDriverState *bs);
@@ -459,7 +500,11 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
                         bool exact_size);
 int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index);
 void qcow2_l2_cache_reset(BlockDriverState *bs);
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset);
+int coroutine_fn qcow2_decompress_cluster(BlockDriverState *bs,
+                                          uint64_t cluster_offset,
+                                          int offset_in_cluster,
+                                          QEMUIOVector *qiov);
+void qcow2_compressed_cache_reset(BlockDriverState *bs);
 void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
                      uint8_t *out_buf, const uint8_t *in_buf,
                      int nb_sectors, int enc,
@@ -496,6 +541,8 @@ int qcow2_read_snapshots(BlockDriverState *bs);
 /* qcow2-cache.c functions */
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
+void qcow2_cache_get_stats(Qcow2Cache *c, int64_t *size, uint64_t *hits,
+                           uint64_t *misses);
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table);
 int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c);
@@ -168,13 +168,16 @@ static void qed_sync_cb(void *opaque, int ret)
 
 int qed_read_l1_table_sync(BDRVQEDState *s)
 {
+    AioContext *aio_context = bdrv_get_aio_context(s->bs);
     int ret = -EINPROGRESS;
 
+    aio_context_acquire(aio_context);
     qed_read_table(s, s->header.l1_table_offset,
                    s->l1_table, qed_sync_cb, &ret);
     while (ret == -EINPROGRESS) {
-        qemu_aio_wait();
+        aio_poll(aio_context, true);
     }
+    aio_context_release(aio_context);
 
     return ret;
 }
@@ -190,12 +193,15 @@ void qed_write_l1_table(BDRVQEDState *s, unsigned int index, unsigned int n,
 int qed_write_l1_table_sync(BDRVQEDState *s, unsigned int index,
                             unsigned int n)
 {
+    AioContext *aio_context = bdrv_get_aio_context(s->bs);
     int ret = -EINPROGRESS;
 
+    aio_context_acquire(aio_context);
     qed_write_l1_table(s, index, n, qed_sync_cb, &ret);
     while (ret == -EINPROGRESS) {
-        qemu_aio_wait();
+        aio_poll(aio_context, true);
     }
+    aio_context_release(aio_context);
 
     return ret;
 }
@@ -263,12 +269,15 @@ void qed_read_l2_table(BDRVQEDState *s, QEDRequest *request, uint64_t offset,
 
 int qed_read_l2_table_sync(BDRVQEDState *s, QEDRequest *request, uint64_t offset)
 {
+    AioContext *aio_context = bdrv_get_aio_context(s->bs);
     int ret = -EINPROGRESS;
 
+    aio_context_acquire(aio_context);
     qed_read_l2_table(s, request, offset, qed_sync_cb, &ret);
     while (ret == -EINPROGRESS) {
-        qemu_aio_wait();
+        aio_poll(aio_context, true);
     }
+    aio_context_release(aio_context);
 
     return ret;
 }
@@ -285,12 +294,15 @@ void qed_write_l2_table(BDRVQEDState *s, QEDRequest *request,
 int qed_write_l2_table_sync(BDRVQEDState *s, QEDRequest *request,
                             unsigned int index, unsigned int n, bool flush)
 {
+    AioContext *aio_context = bdrv_get_aio_context(s->bs);
     int ret = -EINPROGRESS;
 
+    aio_context_acquire(aio_context);
     qed_write_l2_table(s, request, index, n, flush, qed_sync_cb, &ret);
     while (ret == -EINPROGRESS) {
-        qemu_aio_wait();
+        aio_poll(aio_context, true);
     }
+    aio_context_release(aio_context);
 
     return ret;
 }
@@ -137,6 +137,8 @@ typedef struct BDRVRawState {
 #ifdef CONFIG_LINUX_AIO
     int use_aio;
     void *aio_ctx;
+    unsigned int aio_max_events;
+    bool aio_poll;
 #endif
 #ifdef CONFIG_XFS
     bool is_xfs : 1;
@@ -231,7 +233,14 @@ static void raw_parse_flags(int bdrv_flags, int *open_flags)
 }
 
 #ifdef CONFIG_LINUX_AIO
-static int raw_set_aio(void **aio_ctx, int *use_aio, int bdrv_flags)
+/* Default size of the native AIO ring, and the largest that we accept; the
+ * kernel's fs.aio-max-nr limits the total for the host anyway */
+#define RAW_AIO_MAX_EVENTS          128
+#define RAW_AIO_MAX_EVENTS_LIMIT    65536
+
+static int raw_set_aio(void **aio_ctx, int *use_aio, int bdrv_flags,
+                       unsigned int max_events, bool poll,
+                       AioContext *aio_context)
 {
     int ret = -1;
     assert(aio_ctx != NULL);
@@ -245,10 +254,11 @@ static int raw_set_aio(void **aio_ctx, int *use_aio, int bdrv_flags)
 
         /* if non-NULL, laio_init() has already been run */
         if (*aio_ctx == NULL) {
-            *aio_ctx = laio_init();
+            *aio_ctx = laio_init(max_events, poll);
             if (!*aio_ctx) {
                 goto error;
             }
+            laio_attach_aio_context(*aio_ctx, aio_context);
         }
         *use_aio = 1;
     } else {
@@ -271,6 +281,18 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "File name of the image",
         },
+        {
+            .name = "aio-max-events",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of requests submitted to native AIO at a time "
+                    "(default: 128)",
+        },
+        {
+            .name = "aio-poll",
+            .type = QEMU_OPT_BOOL,
+            .help = "Reap native AIO completions from userspace "
+                    "(default: off)",
+        },
         { /* end of list */ }
     },
 };
@@ -282,6 +304,9 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     QemuOpts *opts;
     Error *local_err = NULL;
     const char *filename;
+#ifdef CONFIG_LINUX_AIO
+    uint64_t max_events;
+#endif
     int fd, ret;
 
     opts = qemu_opts_create_nofail(&raw_runtime_opts);
@@ -294,6 +319,19 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
 
     filename = qemu_opt_get(opts, "filename");
 
+#ifdef CONFIG_LINUX_AIO
+    max_events = qemu_opt_get_number(opts, "aio-max-events",
+                                     RAW_AIO_MAX_EVENTS);
+    if (max_events < 1 || max_events > RAW_AIO_MAX_EVENTS_LIMIT) {
+        error_setg(errp, "aio-max-events must be between 1 and %d",
+                   RAW_AIO_MAX_EVENTS_LIMIT);
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->aio_max_events = max_events;
+    s->aio_poll = qemu_opt_get_bool(opts, "aio-poll", false);
+#endif
+
     ret = raw_normalize_devicepath(&filename);
     if (ret != 0) {
         error_setg_errno(errp, -ret, "Could not normalize device path");
@@ -315,7 +353,8 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     s->fd = fd;
 
 #ifdef CONFIG_LINUX_AIO
-    if (raw_set_aio(&s->aio_ctx, &s->use_aio, bdrv_flags)) {
+    if (raw_set_aio(&s->aio_ctx, &s->use_aio, bdrv_flags, s->aio_max_events,
+                    s->aio_poll, bdrv_get_aio_context(bs))) {
         qemu_close(fd);
         ret = -errno;
         error_setg_errno(errp, -ret, "Could not set AIO state");
@@ -372,7 +411,9 @@ static int raw_reopen_prepare(BDRVReopenState *state,
     /* we can use s->aio_ctx instead of a copy, because the use_aio flag is
      * valid in the 'false' condition even if aio_ctx is set, and raw_set_aio()
      * won't override aio_ctx if aio_ctx is non-NULL */
-    if (raw_set_aio(&s->aio_ctx, &raw_s->use_aio, state->flags)) {
+    if (raw_set_aio(&s->aio_ctx, &raw_s->use_aio, state->flags,
+                    s->aio_max_events, s->aio_poll,
+                    bdrv_get_aio_context(state->bs))) {
         error_setg(errp, "Could not set AIO state");
         return -1;
     }
@@ -866,9 +907,73 @@ static BlockDriverAIOCB *raw_aio_flush(BlockDriverState *bs,
     return paio_submit(bs, s->fd, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH);
 }
 
+static void raw_detach_aio_context(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+
+    if (s->aio_ctx) {
+        laio_detach_aio_context(s->aio_ctx, bdrv_get_aio_context(bs));
+    }
+#endif
+}
+
+static void raw_attach_aio_context(BlockDriverState *bs,
+                                   AioContext *new_context)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+
+    if (s->aio_ctx) {
+        laio_attach_aio_context(s->aio_ctx, new_context);
+    }
+#endif
+}
+
+static void raw_io_plug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_aio) {
+        laio_io_plug(bs, s->aio_ctx);
+    }
+#endif
+}
+
+static void raw_io_unplug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_aio) {
+        laio_io_unplug(bs, s->aio_ctx, true);
+    }
+#endif
+}
+
+static void raw_flush_io_queue(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_aio) {
+        laio_io_unplug(bs, s->aio_ctx, false);
+    }
+#endif
+}
+
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
+
+    raw_detach_aio_context(bs);
+#ifdef CONFIG_LINUX_AIO
+    if (s->aio_ctx) {
+        laio_cleanup(s->aio_ctx);
+        s->aio_ctx = NULL;
+    }
+#endif
     if (s->fd >= 0) {
         qemu_close(s->fd);
         s->fd = -1;
@@ -1219,6 +1324,11 @@ static BlockDriver bdrv_file = {
     .bdrv_reopen_commit = raw_reopen_commit,
     .bdrv_reopen_abort = raw_reopen_abort,
     .bdrv_close = raw_close,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_io_plug = raw_io_plug,
+    .bdrv_io_unplug = raw_io_unplug,
+    .bdrv_flush_io_queue = raw_flush_io_queue,
     .bdrv_create = raw_create,
     .bdrv_has_zero_init = bdrv_has_zero_init_1,
     .bdrv_co_get_block_status = raw_co_get_block_status,
@@ -1572,6 +1682,11 @@ static BlockDriver bdrv_host_device = {
     .bdrv_probe_device  = hdev_probe_device,
     .bdrv_file_open     = hdev_open,
     .bdrv_close         = raw_close,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_io_plug = raw_io_plug,
+    .bdrv_io_unplug = raw_io_unplug,
+    .bdrv_flush_io_queue = raw_flush_io_queue,
     .bdrv_reopen_prepare = raw_reopen_prepare,
     .bdrv_reopen_commit  = raw_reopen_commit,
     .bdrv_reopen_abort   = raw_reopen_abort,
@@ -1703,6 +1818,11 @@ static BlockDriver bdrv_host_floppy = {
     .bdrv_probe_device	= floppy_probe_device,
     .bdrv_file_open     = floppy_open,
     .bdrv_close         = raw_close,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_io_plug = raw_io_plug,
+    .bdrv_io_unplug = raw_io_unplug,
+    .bdrv_flush_io_queue = raw_flush_io_queue,
     .bdrv_reopen_prepare = raw_reopen_prepare,
     .bdrv_reopen_commit  = raw_reopen_commit,
     .bdrv_reopen_abort   = raw_reopen_abort,
@@ -1813,6 +1933,11 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_probe_device	= cdrom_probe_device,
     .bdrv_file_open     = cdrom_open,
     .bdrv_close         = raw_close,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_io_plug = raw_io_plug,
+    .bdrv_io_unplug = raw_io_unplug,
+    .bdrv_flush_io_queue = raw_flush_io_queue,
     .bdrv_reopen_prepare = raw_reopen_prepare,
     .bdrv_reopen_commit  = raw_reopen_commit,
     .bdrv_reopen_abort   = raw_reopen_abort,
@@ -1942,6 +2067,11 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_probe_device	= cdrom_probe_device,
     .bdrv_file_open     = cdrom_open,
     .bdrv_close         = raw_close,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_io_plug = raw_io_plug,
+    .bdrv_io_unplug = raw_io_unplug,
+    .bdrv_flush_io_queue = raw_flush_io_queue,
     .bdrv_reopen_prepare = raw_reopen_prepare,
     .bdrv_reopen_commit  = raw_reopen_commit,
     .bdrv_reopen_abort   = raw_reopen_abort,
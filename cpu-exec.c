@@ -22,6 +22,7 @@
 #include "tcg.h"
 #include "qemu/atomic.h"
 #include "sysemu/qtest.h"
+#include "sysemu/cpus.h"
 
 bool qemu_cpu_has_work(CPUState *cpu)
 {
@@ -635,9 +636,23 @@ int cpu_exec(CPUArchState *env)
                 cpu->current_tb = tb;
                 barrier();
                 if (likely(!cpu->exit_request)) {
+#if !defined(CONFIG_USER_ONLY)
+                    if (mttcg_enabled && !qemu_tcg_exec_start(cpu)) {
+                        /* Another vCPU ran an exclusive section (e.g.
+                           tb_flush) meanwhile, this TB may be stale.  */
+                        cpu->current_tb = NULL;
+                        next_tb = 0;
+                        continue;
+                    }
+#endif
                     tc_ptr = tb->tc_ptr;
                     /* execute the generated code */
                     next_tb = cpu_tb_exec(cpu, tc_ptr);
+#if !defined(CONFIG_USER_ONLY)
+                    if (mttcg_enabled) {
+                        qemu_tcg_exec_end(cpu);
+                    }
+#endif
                     switch (next_tb & TB_EXIT_MASK) {
                     case TB_EXIT_REQUESTED:
                         /* Something asked us to stop executing
@@ -693,6 +708,18 @@ int cpu_exec(CPUArchState *env)
 #if !(defined(CONFIG_USER_ONLY) && \
       (defined(TARGET_M68K) || defined(TARGET_PPC) || defined(TARGET_S390X)))
             cc = CPU_GET_CLASS(cpu);
+#endif
+#if !defined(CONFIG_USER_ONLY)
+            /* An exception raised from translated code: get the global
+               mutex back before handling it.  One raised in an exclusive
+               section (e.g. a fault in an ARM store exclusive) also ends
+               the section.  */
+            if (mttcg_enabled) {
+                if (cpu->running) {
+                    qemu_tcg_exec_end(cpu);
+                }
+                tcg_cancel_exclusive(cpu);
+            }
 #endif
         }
     } /* for(;;) */
@@ -111,9 +111,21 @@ static int icount_time_shift;
 /* Arbitrarily pick 1MIPS as the minimum allowable speed.  */
 #define MAX_ICOUNT_SHIFT 10
 
-/* Only written by TCG thread */
+/* Only written by TCG thread.  With multi-threaded TCG, only written
+ * under the global mutex at the end of each quantum; it then holds the
+ * instruction count at the start of the current quantum.  */
 static int64_t qemu_icount;
 
+/* Multi-threaded TCG runs the vCPUs in lockstep quanta of at most
+ * icount_quantum instructions.  No vCPU starts the next quantum until
+ * every running vCPU has used up its budget for the current one, so
+ * virtual time does not depend on the host scheduling of the threads.
+ */
+#define ICOUNT_QUANTUM_DEFAULT 10000
+static int64_t icount_quantum = ICOUNT_QUANTUM_DEFAULT;
+/* Length of the current quantum.  Protected by the global mutex.  */
+static int64_t icount_quantum_len;
+
 static QEMUTimer *icount_rt_timer;
 static QEMUTimer *icount_vm_timer;
 static QEMUTimer *icount_warp_timer;
@@ -146,7 +158,14 @@ static int64_t cpu_get_icount_locked(void)
         if (!can_do_io(env)) {
             fprintf(stderr, "Bad clock read\n");
         }
-        icount -= (env->icount_decr.u16.low + env->icount_extra);
+        if (mttcg_enabled) {
+            /* Local time of this vCPU within the quantum.  */
+            icount += icount_quantum_len - (cpu->icount_budget +
+                                            env->icount_decr.u16.low +
+                                            env->icount_extra);
+        } else {
+            icount -= (env->icount_decr.u16.low + env->icount_extra);
+        }
     }
     return qemu_icount_bias + (icount << icount_time_shift);
 }
@@ -445,15 +464,32 @@ static const VMStateDescription vmstate_timers = {
 
 void configure_icount(const char *option)
 {
+    const char *quantum;
+    char *end;
+
     seqlock_init(&timers_state.vm_clock_seqlock, NULL);
     vmstate_register(NULL, 0, &vmstate_timers, &timers_state);
     if (!option) {
         return;
     }
 
+    quantum = strstr(option, ",quantum=");
+    if (quantum) {
+        if (!mttcg_enabled) {
+            fprintf(stderr, "qemu: icount quantum requires "
+                    "-tcg-threads multi\n");
+            exit(1);
+        }
+        icount_quantum = strtoll(quantum + strlen(",quantum="), &end, 0);
+        if (*end || icount_quantum <= 0) {
+            fprintf(stderr, "qemu: invalid icount quantum\n");
+            exit(1);
+        }
+    }
+
     icount_warp_timer = timer_new_ns(QEMU_CLOCK_REALTIME,
                                           icount_warp_rt, NULL);
-    if (strcmp(option, "auto") != 0) {
+    if (strncmp(option, "auto", 4) != 0) {
         icount_time_shift = strtol(option, NULL, 0);
         use_icount = 1;
         return;
@@ -716,6 +752,19 @@ static QemuThread io_thread;
 static QemuThread *tcg_cpu_thread;
 static QemuCond *tcg_halt_cond;
 
+/* Multi-threaded TCG: every vCPU runs on its own host thread and only
+ * drops the global mutex while it executes translated code.  */
+bool mttcg_enabled;
+static DEFINE_TLS(bool, iothread_locked);
+#define iothread_locked tls_var(iothread_locked)
+
+/* Exclusive sections (e.g. tb_flush) stop every other vCPU outside of
+ * translated code.  Protected by the global mutex.  */
+static bool tcg_exclusive_pending;
+static CPUState *tcg_exclusive_cpu;
+static QemuCond tcg_exclusive_cond;
+static QemuCond tcg_exclusive_resume;
+
 /* cpu creation */
 static QemuCond qemu_cpu_cond;
 /* system init */
@@ -729,6 +778,8 @@ void qemu_init_cpu_loop(void)
     qemu_cond_init(&qemu_pause_cond);
     qemu_cond_init(&qemu_work_cond);
     qemu_cond_init(&qemu_io_proceeded_cond);
+    qemu_cond_init(&tcg_exclusive_cond);
+    qemu_cond_init(&tcg_exclusive_resume);
     qemu_mutex_init(&qemu_global_mutex);
 
     qemu_thread_get_self(&io_thread);
@@ -840,6 +891,77 @@ static void qemu_tcg_wait_io_event(void)
     }
 }
 
+/* Start the next icount quantum once every vCPU either used up its
+ * budget or is halted.  The virtual clock timers that expired during the
+ * quantum run before any vCPU proceeds, and the next quantum ends no later
+ * than the next timer deadline.  Called with the global mutex held.
+ */
+static void tcg_icount_quantum_try_end(void)
+{
+    CPUState *cpu;
+    bool consumed = false;
+    int64_t deadline, count;
+
+    CPU_FOREACH(cpu) {
+        if (cpu->stopped) {
+            return;
+        }
+        if (cpu->icount_budget == 0) {
+            consumed = true;
+        } else if (!cpu_thread_is_idle(cpu)) {
+            return;
+        }
+    }
+    if (!consumed) {
+        return;
+    }
+
+    seqlock_write_lock(&timers_state.vm_clock_seqlock);
+    qemu_icount += icount_quantum_len;
+    icount_quantum_len = 0;
+    seqlock_write_unlock(&timers_state.vm_clock_seqlock);
+
+    qemu_clock_run_timers(QEMU_CLOCK_VIRTUAL);
+
+    count = icount_quantum;
+    deadline = qemu_clock_deadline_ns_all(QEMU_CLOCK_VIRTUAL);
+    if (deadline >= 0) {
+        count = MAX(MIN(count, qemu_icount_round(deadline)), 1);
+    }
+
+    seqlock_write_lock(&timers_state.vm_clock_seqlock);
+    icount_quantum_len = count;
+    CPU_FOREACH(cpu) {
+        cpu->icount_budget = count;
+    }
+    seqlock_write_unlock(&timers_state.vm_clock_seqlock);
+
+    CPU_FOREACH(cpu) {
+        qemu_cond_broadcast(cpu->halt_cond);
+    }
+}
+
+static bool tcg_icount_quantum_done(CPUState *cpu)
+{
+    return use_icount && cpu->icount_budget == 0 &&
+           !cpu->stop && !cpu->queued_work_first;
+}
+
+static void qemu_tcg_vcpu_wait_io_event(CPUState *cpu)
+{
+    while (cpu_thread_is_idle(cpu) || tcg_icount_quantum_done(cpu)) {
+        if (use_icount) {
+            tcg_icount_quantum_try_end();
+            if (!cpu_thread_is_idle(cpu) && !tcg_icount_quantum_done(cpu)) {
+                break;
+            }
+        }
+        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+    }
+
+    qemu_wait_io_event_common(cpu);
+}
+
 static void qemu_kvm_wait_io_event(CPUState *cpu)
 {
     while (cpu_thread_is_idle(cpu)) {
@@ -969,6 +1091,39 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
     return NULL;
 }
 
+static int tcg_cpu_exec(CPUArchState *env);
+
+/* Per-vCPU thread used when multi-threaded TCG is enabled.  The global
+ * mutex is held everywhere except while translated code runs, see
+ * qemu_tcg_exec_start() and qemu_tcg_exec_end().  */
+static void *qemu_tcg_vcpu_thread_fn(void *arg)
+{
+    CPUState *cpu = arg;
+    int r;
+
+    qemu_tcg_init_cpu_signals();
+    qemu_mutex_lock_iothread();
+    qemu_thread_get_self(cpu->thread);
+    cpu->thread_id = qemu_get_thread_id();
+    current_cpu = cpu;
+
+    /* signal CPU creation */
+    cpu->created = true;
+    qemu_cond_signal(&qemu_cpu_cond);
+
+    while (1) {
+        if (cpu_can_run(cpu) && !tcg_icount_quantum_done(cpu)) {
+            r = tcg_cpu_exec(cpu->env_ptr);
+            if (r == EXCP_DEBUG) {
+                cpu_handle_guest_debug(cpu);
+            }
+        }
+        qemu_tcg_vcpu_wait_io_event(cpu);
+    }
+
+    return NULL;
+}
+
 static void qemu_cpu_kick_thread(CPUState *cpu)
 {
 #ifndef _WIN32
@@ -1011,7 +1166,10 @@ static void qemu_cpu_kick_thread(CPUState *cpu)
 void qemu_cpu_kick(CPUState *cpu)
 {
     qemu_cond_broadcast(cpu->halt_cond);
-    if (!tcg_enabled() && !cpu->thread_kicked) {
+    if (mttcg_enabled) {
+        /* The vCPU thread polls its exit request between TBs.  */
+        cpu_exit(cpu);
+    } else if (!tcg_enabled() && !cpu->thread_kicked) {
         qemu_cpu_kick_thread(cpu);
         cpu->thread_kicked = true;
     }
@@ -1043,7 +1201,7 @@ static bool qemu_in_vcpu_thread(void)
 
 void qemu_mutex_lock_iothread(void)
 {
-    if (!tcg_enabled()) {
+    if (!tcg_enabled() || mttcg_enabled) {
         qemu_mutex_lock(&qemu_global_mutex);
     } else {
         iothread_requesting_mutex = true;
@@ -1054,13 +1212,97 @@ void qemu_mutex_lock_iothread(void)
         iothread_requesting_mutex = false;
         qemu_cond_broadcast(&qemu_io_proceeded_cond);
     }
+    iothread_locked = true;
 }
 
 void qemu_mutex_unlock_iothread(void)
 {
+    iothread_locked = false;
     qemu_mutex_unlock(&qemu_global_mutex);
 }
 
+bool qemu_tcg_lock_iothread(void)
+{
+    if (!mttcg_enabled || iothread_locked) {
+        return false;
+    }
+    qemu_mutex_lock_iothread();
+    return true;
+}
+
+bool qemu_tcg_exec_start(CPUState *cpu)
+{
+    bool waited = false;
+
+    while (tcg_exclusive_pending) {
+        qemu_cond_wait(&tcg_exclusive_resume, &qemu_global_mutex);
+        waited = true;
+    }
+    if (waited) {
+        return false;
+    }
+    cpu->running = true;
+    qemu_mutex_unlock_iothread();
+    return true;
+}
+
+void qemu_tcg_exec_end(CPUState *cpu)
+{
+    if (!iothread_locked) {
+        qemu_mutex_lock_iothread();
+    }
+    cpu->running = false;
+    if (tcg_exclusive_pending) {
+        qemu_cond_broadcast(&tcg_exclusive_cond);
+    }
+}
+
+static bool tcg_other_cpus_running(void)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        if (cpu != current_cpu && cpu->running) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void tcg_start_exclusive(void)
+{
+    CPUState *cpu;
+
+    while (tcg_exclusive_pending) {
+        qemu_cond_wait(&tcg_exclusive_resume, &qemu_global_mutex);
+    }
+    tcg_exclusive_pending = true;
+    tcg_exclusive_cpu = current_cpu;
+
+    CPU_FOREACH(cpu) {
+        if (cpu != current_cpu) {
+            cpu_exit(cpu);
+        }
+    }
+    while (tcg_other_cpus_running()) {
+        qemu_cond_wait(&tcg_exclusive_cond, &qemu_global_mutex);
+    }
+}
+
+void tcg_end_exclusive(void)
+{
+    tcg_exclusive_pending = false;
+    tcg_exclusive_cpu = NULL;
+    qemu_cond_broadcast(&tcg_exclusive_resume);
+}
+
+void tcg_cancel_exclusive(CPUState *cpu)
+{
+    if (tcg_exclusive_pending && tcg_exclusive_cpu == cpu) {
+        tcg_end_exclusive();
+    }
+}
+
 static int all_vcpus_paused(void)
 {
     CPUState *cpu;
@@ -1086,7 +1328,7 @@ void pause_all_vcpus(void)
 
     if (qemu_in_vcpu_thread()) {
         cpu_stop_current();
-        if (!kvm_enabled()) {
+        if (!kvm_enabled() && !mttcg_enabled) {
             CPU_FOREACH(cpu) {
                 cpu->stop = false;
                 cpu->stopped = true;
@@ -1125,6 +1367,18 @@ void resume_all_vcpus(void)
 
 static void qemu_tcg_init_vcpu(CPUState *cpu)
 {
+    if (mttcg_enabled) {
+        cpu->thread = g_malloc0(sizeof(QemuThread));
+        cpu->halt_cond = g_malloc0(sizeof(QemuCond));
+        qemu_cond_init(cpu->halt_cond);
+        qemu_thread_create(cpu->thread, qemu_tcg_vcpu_thread_fn, cpu,
+                           QEMU_THREAD_JOINABLE);
+        while (!cpu->created) {
+            qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        }
+        return;
+    }
+
     /* share a single thread for all cpus with TCG */
     if (!tcg_cpu_thread) {
         cpu->thread = g_malloc0(sizeof(QemuThread));
@@ -1233,7 +1487,15 @@ static int tcg_cpu_exec(CPUArchState *env)
 #ifdef CONFIG_PROFILER
     ti = profile_getclock();
 #endif
-    if (use_icount) {
+    if (use_icount && mttcg_enabled) {
+        CPUState *cpu = ENV_GET_CPU(env);
+        int64_t count = cpu->icount_budget;
+        int decr = (count > 0xffff) ? 0xffff : count;
+
+        cpu->icount_budget = 0;
+        env->icount_decr.u16.low = decr;
+        env->icount_extra = count - decr;
+    } else if (use_icount) {
         int64_t count;
         int64_t deadline;
         int decr;
@@ -1262,7 +1524,13 @@ static int tcg_cpu_exec(CPUArchState *env)
 #ifdef CONFIG_PROFILER
     qemu_time += profile_getclock() - ti;
 #endif
-    if (use_icount) {
+    if (use_icount && mttcg_enabled) {
+        /* Give the unused instructions back to the quantum budget.  */
+        ENV_GET_CPU(env)->icount_budget = env->icount_decr.u16.low
+                                          + env->icount_extra;
+        env->icount_decr.u32 = 0;
+        env->icount_extra = 0;
+    } else if (use_icount) {
         /* Fold pending instructions back into the
            instruction counter, and clear the interrupt flag.  */
         qemu_icount -= (env->icount_decr.u16.low
@@ -22,6 +22,7 @@
 #include "exec/exec-all.h"
 #include "exec/memory.h"
 #include "exec/address-spaces.h"
+#include "qemu/main-loop.h"
 
 #include "exec/cputlb.h"
 
@@ -73,6 +74,7 @@ void tlb_flush(CPUArchState *env, int flush_global)
     }
 
     memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
+    memset(env->mmio_cache, 0, sizeof(env->mmio_cache));
 
     env->tlb_flush_addr = -1;
     env->tlb_flush_mask = 0;
@@ -129,7 +131,7 @@ void tlb_protect_code(ram_addr_t ram_addr)
 {
     cpu_physical_memory_reset_dirty(ram_addr,
                                     ram_addr + TARGET_PAGE_SIZE,
-                                    CODE_DIRTY_FLAG);
+                                    DIRTY_MEMORY_CODE);
 }
 
 /* update the TLB so that writes in physical page 'phys_addr' are no longer
@@ -137,7 +139,7 @@ void tlb_protect_code(ram_addr_t ram_addr)
 void tlb_unprotect_code_phys(CPUArchState *env, ram_addr_t ram_addr,
                              target_ulong vaddr)
 {
-    cpu_physical_memory_set_dirty_flags(ram_addr, CODE_DIRTY_FLAG);
+    cpu_physical_memory_set_dirty_flag(ram_addr, DIRTY_MEMORY_CODE);
 }
 
 static bool tlb_is_dirty_ram(CPUTLBEntry *tlbe)
@@ -253,6 +255,7 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
         tlb_add_large_page(env, vaddr, size);
     }
 
+    tlb_check_memory_map(env);
     sz = size;
     section = address_space_translate_for_iotlb(&address_space_memory, paddr,
                                                 &xlat, &sz);
@@ -309,6 +312,38 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
     }
 }
 
+/* Look up the memory region behind an I/O iotlb entry.  */
+CPUMMIOCacheEntry *tlb_mmio_cache_lookup(CPUArchState *env, hwaddr iotlb)
+{
+    hwaddr section = iotlb & ~TARGET_PAGE_MASK;
+    CPUMMIOCacheEntry *e;
+
+    e = &env->mmio_cache[section & (CPU_MMIO_CACHE_SIZE - 1)];
+    if (unlikely(e->key != section + 1)) {
+        e->mr = iotlb_to_region(env, iotlb);
+        e->read_sizes = memory_region_direct_sizes(e->mr, false);
+        e->write_sizes = memory_region_direct_sizes(e->mr, true);
+        e->key = section + 1;
+    }
+    return e;
+}
+
+/* Slow path TLB refill from translated code.  With multi-threaded TCG
+ * the vCPU does not hold the global mutex at this point, but the target
+ * page walk reads the memory map.  If tlb_fill raises a guest exception
+ * the mutex is left held and cpu_exec takes over from there.
+ */
+void tlb_fill_locked(CPUArchState *env, target_ulong addr, int is_write,
+                     int mmu_idx, uintptr_t retaddr)
+{
+    bool locked = qemu_tcg_lock_iothread();
+
+    tlb_fill(env, addr, is_write, mmu_idx, retaddr);
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
 /* NOTE: this function can trigger an exception */
 /* NOTE2: the returned address is not exactly the physical address: it
  * is actually a ram_addr_t (in system mode; the user mode emulation
@@ -327,7 +362,7 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
         cpu_ldub_code(env1, addr);
     }
     pd = env1->iotlb[mmu_idx][page_index] & ~TARGET_PAGE_MASK;
-    mr = iotlb_to_region(pd);
+    mr = iotlb_to_region(env1, pd);
     if (memory_region_is_unassigned(mr)) {
         CPUState *cpu = ENV_GET_CPU(env1);
         CPUClass *cc = CPU_GET_CLASS(cpu);
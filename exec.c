@@ -33,6 +33,8 @@
 #include "qemu/osdep.h"
 #include "sysemu/kvm.h"
 #include "sysemu/sysemu.h"
+#include "sysemu/cpus.h"
+#include "qemu/main-loop.h"
 #include "hw/xen/xen.h"
 #include "qemu/timer.h"
 #include "qemu/config-file.h"
@@ -121,6 +123,9 @@ typedef struct PhysPageMap {
     unsigned nodes_nb_alloc;
     Node *nodes;
     MemoryRegionSection *sections;
+    /* vCPUs that have not yet flushed their TLB since this map was
+       replaced, see tcg_commit */
+    unsigned users;
 } PhysPageMap;
 
 static PhysPageMap *prev_map;
@@ -699,24 +704,59 @@ void cpu_abort(CPUArchState *env, const char *fmt, ...)
 static RAMBlock *qemu_get_ram_block(ram_addr_t addr)
 {
     RAMBlock *block;
+    int lo, hi, mid;
 
     /* The list is protected by the iothread lock here.  */
+    ram_list.lookups++;
     block = ram_list.mru_block;
     if (block && addr - block->offset < block->length) {
-        goto found;
-    }
-    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        if (addr - block->offset < block->length) {
-            goto found;
+        ram_list.mru_hits++;
+        return block;
+    }
+
+    lo = 0;
+    hi = ram_list.nr_blocks - 1;
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        block = ram_list.by_offset[mid];
+        if (addr < block->offset) {
+            hi = mid - 1;
+        } else if (addr - block->offset >= block->length) {
+            lo = mid + 1;
+        } else {
+            ram_list.mru_block = block;
+            return block;
         }
     }
 
     fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
     abort();
+}
+
+static RAMBlock *qemu_get_ram_block_by_host(uint8_t *host)
+{
+    RAMBlock *block;
+    int lo, hi, mid;
 
-found:
-    ram_list.mru_block = block;
-    return block;
+    block = ram_list.mru_block;
+    if (block && block->host && host - block->host < block->length) {
+        return block;
+    }
+
+    lo = 0;
+    hi = ram_list.nr_host_blocks - 1;
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        block = ram_list.by_host[mid];
+        if (host < block->host) {
+            hi = mid - 1;
+        } else if (host - block->host >= block->length) {
+            lo = mid + 1;
+        } else {
+            return block;
+        }
+    }
+    return NULL;
 }
 
 static void tlb_reset_dirty_range_all(ram_addr_t start, ram_addr_t end,
@@ -733,7 +773,7 @@ static void tlb_reset_dirty_range_all(ram_addr_t start, ram_addr_t end,
 
 /* Note: start and end must be within the same ram block.  */
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
-                                     int dirty_flags)
+                                     unsigned client)
 {
     uintptr_t length;
 
@@ -743,13 +783,57 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
     length = end - start;
     if (length == 0)
         return;
-    cpu_physical_memory_mask_dirty_range(start, length, dirty_flags);
+    cpu_physical_memory_clear_dirty_range(start, length, client);
 
     if (tcg_enabled()) {
         tlb_reset_dirty_range_all(start, end, length);
     }
 }
 
+/* Mark as dirty the pages whose bit is set in a little-endian bitmap,
+ * such as the ones filled in by KVM_GET_DIRTY_LOG.  Each run of set bits
+ * becomes a single range operation, so a fully dirty word costs as much
+ * as a single dirty page.
+ */
+void cpu_physical_memory_set_dirty_lebitmap(const unsigned long *bitmap,
+                                            ram_addr_t start,
+                                            uint64_t nr_bits,
+                                            ram_addr_t bit_size)
+{
+    uint64_t i, bit, run_start = 0, nr_words;
+    ram_addr_t addr;
+    unsigned long c;
+    bool in_run = false;
+    int j;
+
+    nr_words = (nr_bits + HOST_LONG_BITS - 1) / HOST_LONG_BITS;
+    for (i = 0; i < nr_words; i++) {
+        c = leul_to_cpu(bitmap[i]);
+        if ((in_run && c == ~0UL) || (!in_run && c == 0)) {
+            continue;
+        }
+        for (j = 0; j < HOST_LONG_BITS; j++) {
+            bool dirty = (c >> j) & 1;
+
+            bit = i * HOST_LONG_BITS + j;
+            if (dirty && !in_run) {
+                run_start = bit;
+                in_run = true;
+            } else if (!dirty && in_run) {
+                addr = start + run_start * bit_size;
+                cpu_physical_memory_set_dirty_range(addr,
+                                                    (bit - run_start) * bit_size);
+                in_run = false;
+            }
+        }
+    }
+    if (in_run) {
+        bit = MIN(nr_words * HOST_LONG_BITS, nr_bits);
+        cpu_physical_memory_set_dirty_range(start + run_start * bit_size,
+                                            (bit - run_start) * bit_size);
+    }
+}
+
 static int cpu_physical_memory_set_dirty_tracking(int enable)
 {
     int ret = 0;
@@ -947,6 +1031,99 @@ void qemu_mutex_unlock_ramlist(void)
     qemu_mutex_unlock(&ram_list.mutex);
 }
 
+static int ram_block_cmp_offset(const void *a, const void *b)
+{
+    const RAMBlock *ba = *(RAMBlock * const *)a;
+    const RAMBlock *bb = *(RAMBlock * const *)b;
+
+    return ba->offset < bb->offset ? -1 : ba->offset > bb->offset;
+}
+
+static int ram_block_cmp_host(const void *a, const void *b)
+{
+    const RAMBlock *ba = *(RAMBlock * const *)a;
+    const RAMBlock *bb = *(RAMBlock * const *)b;
+
+    return ba->host < bb->host ? -1 : ba->host > bb->host;
+}
+
+/* Grow the dirty bitmaps to cover @new_pages pages.  HBitmaps cannot be
+ * resized, so copy the dirty pages to new ones; this only happens when
+ * RAM is added.
+ */
+static void dirty_memory_extend(ram_addr_t new_pages)
+{
+    HBitmap *old, *new;
+    HBitmapIter hbi;
+    int64_t page;
+    unsigned client;
+
+    if (new_pages <= ram_list.dirty_pages) {
+        return;
+    }
+    for (client = 0; client < DIRTY_MEMORY_NUM; client++) {
+        old = ram_list.dirty_memory[client];
+        new = hbitmap_alloc(new_pages, 0);
+        if (old) {
+            hbitmap_iter_init(&hbi, old, 0);
+            while ((page = hbitmap_iter_next(&hbi)) >= 0) {
+                hbitmap_set(new, page, 1);
+            }
+            hbitmap_free(old);
+        }
+        ram_list.dirty_memory[client] = new;
+    }
+    ram_list.dirty_pages = new_pages;
+}
+
+/* Rebuild the lookup indexes of ram_list.  Called with both the
+ * iothread and the ramlist lock held.  Blocks that are not mapped in
+ * QEMU (Xen) are left out of the host index.
+ */
+static void ram_list_rebuild_index(void)
+{
+    RAMBlock *block;
+    int n = 0, nr_host = 0;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        n++;
+    }
+    g_free(ram_list.by_offset);
+    g_free(ram_list.by_host);
+    ram_list.by_offset = g_new(RAMBlock *, n);
+    ram_list.by_host = g_new0(RAMBlock *, n);
+
+    n = 0;
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        ram_list.by_offset[n++] = block;
+        if (block->host) {
+            ram_list.by_host[nr_host++] = block;
+        }
+    }
+    qsort(ram_list.by_offset, n, sizeof(RAMBlock *), ram_block_cmp_offset);
+    qsort(ram_list.by_host, nr_host, sizeof(RAMBlock *), ram_block_cmp_host);
+    ram_list.nr_blocks = n;
+    ram_list.nr_host_blocks = nr_host;
+    ram_list.mru_block = NULL;
+}
+
+void dump_ram_blocks(FILE *f, fprintf_function cpu_fprintf)
+{
+    RAMBlock *block;
+    int i;
+
+    for (i = 0; i < ram_list.nr_blocks; i++) {
+        block = ram_list.by_offset[i];
+        cpu_fprintf(f, RAM_ADDR_FMT "-" RAM_ADDR_FMT " %p %s\n",
+                    block->offset, block->offset + block->length - 1,
+                    block->host, block->idstr[0] ? block->idstr
+                                                 : block->mr->name);
+    }
+    cpu_fprintf(f, "%d blocks, %" PRIu64 " lookups, %" PRIu64
+                " most-recently-used hits\n",
+                ram_list.nr_blocks, ram_list.lookups, ram_list.mru_hits);
+}
+
 #ifdef __linux__
 
 #include <sys/vfs.h>
@@ -1226,16 +1403,13 @@ ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
     } else {
         QTAILQ_INSERT_TAIL(&ram_list.blocks, new_block, next);
     }
-    ram_list.mru_block = NULL;
+    ram_list_rebuild_index();
 
     ram_list.version++;
     qemu_mutex_unlock_ramlist();
 
-    ram_list.phys_dirty = g_realloc(ram_list.phys_dirty,
-                                       last_ram_offset() >> TARGET_PAGE_BITS);
-    memset(ram_list.phys_dirty + (new_block->offset >> TARGET_PAGE_BITS),
-           0, size >> TARGET_PAGE_BITS);
-    cpu_physical_memory_set_dirty_range(new_block->offset, size, 0xff);
+    dirty_memory_extend(last_ram_offset() >> TARGET_PAGE_BITS);
+    cpu_physical_memory_set_dirty_range(new_block->offset, size);
 
     qemu_ram_setup_dump(new_block->host, size);
     qemu_madvise(new_block->host, size, QEMU_MADV_HUGEPAGE);
@@ -1261,7 +1435,7 @@ void qemu_ram_free_from_ptr(ram_addr_t addr)
     QTAILQ_FOREACH(block, &ram_list.blocks, next) {
         if (addr == block->offset) {
             QTAILQ_REMOVE(&ram_list.blocks, block, next);
-            ram_list.mru_block = NULL;
+            ram_list_rebuild_index();
             ram_list.version++;
             g_free(block);
             break;
@@ -1279,7 +1453,7 @@ void qemu_ram_free(ram_addr_t addr)
     QTAILQ_FOREACH(block, &ram_list.blocks, next) {
         if (addr == block->offset) {
             QTAILQ_REMOVE(&ram_list.blocks, block, next);
-            ram_list.mru_block = NULL;
+            ram_list_rebuild_index();
             ram_list.version++;
             if (block->flags & RAM_PREALLOC_MASK) {
                 ;
@@ -1393,18 +1567,12 @@ static void *qemu_ram_ptr_length(ram_addr_t addr, hwaddr *size)
     if (xen_enabled()) {
         return xen_map_cache(addr, *size, 1);
     } else {
-        RAMBlock *block;
+        RAMBlock *block = qemu_get_ram_block(addr);
 
-        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-            if (addr - block->offset < block->length) {
-                if (addr - block->offset + *size > block->length)
-                    *size = block->length - addr + block->offset;
-                return block->host + (addr - block->offset);
-            }
+        if (addr - block->offset + *size > block->length) {
+            *size = block->length - addr + block->offset;
         }
-
-        fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
-        abort();
+        return block->host + (addr - block->offset);
     }
 }
 
@@ -1420,24 +1588,11 @@ MemoryRegion *qemu_ram_addr_from_host(void *ptr, ram_addr_t *ram_addr)
         return qemu_get_ram_block(*ram_addr)->mr;
     }
 
-    block = ram_list.mru_block;
-    if (block && block->host && host - block->host < block->length) {
-        goto found;
-    }
-
-    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        /* This case append when the block is not mapped. */
-        if (block->host == NULL) {
-            continue;
-        }
-        if (host - block->host < block->length) {
-            goto found;
-        }
+    block = qemu_get_ram_block_by_host(host);
+    if (!block) {
+        return NULL;
     }
 
-    return NULL;
-
-found:
     *ram_addr = block->offset + (host - block->host);
     return block->mr;
 }
@@ -1445,11 +1600,8 @@ found:
 static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
                                uint64_t val, unsigned size)
 {
-    int dirty_flags;
-    dirty_flags = cpu_physical_memory_get_dirty_flags(ram_addr);
-    if (!(dirty_flags & CODE_DIRTY_FLAG)) {
+    if (!cpu_physical_memory_get_dirty_flag(ram_addr, DIRTY_MEMORY_CODE)) {
         tb_invalidate_phys_page_fast(ram_addr, size);
-        dirty_flags = cpu_physical_memory_get_dirty_flags(ram_addr);
     }
     switch (size) {
     case 1:
@@ -1464,11 +1616,11 @@ static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
     default:
         abort();
     }
-    dirty_flags |= (0xff & ~CODE_DIRTY_FLAG);
-    cpu_physical_memory_set_dirty_flags(ram_addr, dirty_flags);
+    cpu_physical_memory_set_dirty_flag(ram_addr, DIRTY_MEMORY_VGA);
+    cpu_physical_memory_set_dirty_flag(ram_addr, DIRTY_MEMORY_MIGRATION);
     /* we remove the notdirty callback only if the code has been
        flushed */
-    if (dirty_flags == 0xff) {
+    if (cpu_physical_memory_is_dirty(ram_addr)) {
         CPUArchState *env = current_cpu->env_ptr;
         tlb_set_dirty(env, env->mem_io_vaddr);
     }
@@ -1686,9 +1838,28 @@ static uint16_t dummy_section(MemoryRegion *mr)
     return phys_section_add(&section);
 }
 
-MemoryRegion *iotlb_to_region(hwaddr index)
+MemoryRegion *iotlb_to_region(CPUArchState *env, hwaddr index)
+{
+    MemoryRegionSection *sections = env->iotlb_sections;
+
+    if (!sections) {
+        sections = address_space_memory.dispatch->sections;
+    }
+    return sections[index & ~TARGET_PAGE_MASK].mr;
+}
+
+/* Called before filling a TLB entry.  A vCPU that has not run the flush
+ * queued by tcg_commit yet still has entries that index the old map;
+ * flush them now so that a TLB never mixes sections of two maps.
+ */
+void tlb_check_memory_map(CPUArchState *env)
 {
-    return address_space_memory.dispatch->sections[index & ~TARGET_PAGE_MASK].mr;
+    MemoryRegionSection *sections = address_space_memory.dispatch->sections;
+
+    if (env->iotlb_sections != sections) {
+        tlb_flush(env, 1);
+        env->iotlb_sections = sections;
+    }
 }
 
 static void io_mem_init(void)
@@ -1748,20 +1919,69 @@ static void core_begin(MemoryListener *listener)
  */
 static void core_commit(MemoryListener *listener)
 {
-    phys_sections_free(prev_map);
+    /* With multi-threaded TCG, tcg_commit took over the old map.  */
+    if (prev_map) {
+        phys_sections_free(prev_map);
+        prev_map = NULL;
+    }
+}
+
+typedef struct TCGCommitFlush {
+    CPUState *cpu;
+    PhysPageMap *map;
+} TCGCommitFlush;
+
+static void tcg_commit_flush(CPUState *cpu)
+{
+    CPUArchState *env = cpu->env_ptr;
+
+    tlb_flush(env, 1);
+    env->iotlb_sections = address_space_memory.dispatch->sections;
+}
+
+static void tcg_commit_flush_async(void *data)
+{
+    TCGCommitFlush *f = data;
+
+    tcg_commit_flush(f->cpu);
+    if (--f->map->users == 0) {
+        phys_sections_free(f->map);
+    }
+    g_free(f);
 }
 
 static void tcg_commit(MemoryListener *listener)
 {
+    PhysPageMap *map;
     CPUState *cpu;
 
     /* since each CPU stores ram addresses in its TLB cache, we must
        reset the modified entries */
     /* XXX: slow ! */
+    if (!mttcg_enabled) {
+        CPU_FOREACH(cpu) {
+            tcg_commit_flush(cpu);
+        }
+        return;
+    }
+
+    /* The TLB belongs to the thread running that vCPU, which keeps
+       looking up MMIO sections in the old map until it has flushed.
+       Free the old map only after the last vCPU is done with it.  */
+    map = prev_map;
     CPU_FOREACH(cpu) {
-        CPUArchState *env = cpu->env_ptr;
+        map->users++;
+    }
+    if (map->users == 0) {
+        return;
+    }
+    prev_map = NULL;
+    CPU_FOREACH(cpu) {
+        TCGCommitFlush *f = g_new(TCGCommitFlush, 1);
 
-        tlb_flush(env, 1);
+        f->cpu = cpu;
+        f->map = map;
+        async_run_on_cpu(cpu, tcg_commit_flush_async, f);
     }
 }
 
@@ -1888,7 +2108,7 @@ static void invalidate_and_set_dirty(hwaddr addr,
         /* invalidate code */
         tb_invalidate_phys_page_range(addr, addr + length, 0);
         /* set dirty bit */
-        cpu_physical_memory_set_dirty_flags(addr, (0xff & ~CODE_DIRTY_FLAG));
+        cpu_physical_memory_set_dirty_nocode(addr, length);
     }
     xen_modified_memory(addr, length);
 }
@@ -1943,6 +2163,7 @@ bool address_space_rw(AddressSpace *as, hwaddr addr, uint8_t *buf,
     hwaddr addr1;
     MemoryRegion *mr;
     bool error = false;
+    bool locked = qemu_tcg_lock_iothread();
 
     while (len > 0) {
         l = len;
@@ -2023,6 +2244,9 @@ bool address_space_rw(AddressSpace *as, hwaddr addr, uint8_t *buf,
         addr += l;
     }
 
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
     return error;
 }
 
@@ -2270,6 +2494,7 @@ static inline uint32_t ldl_phys_internal(hwaddr addr,
     MemoryRegion *mr;
     hwaddr l = 4;
     hwaddr addr1;
+    bool locked = qemu_tcg_lock_iothread();
 
     mr = address_space_translate(&address_space_memory, addr, &addr1, &l,
                                  false);
@@ -2302,6 +2527,9 @@ static inline uint32_t ldl_phys_internal(hwaddr addr,
             break;
         }
     }
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
     return val;
 }
 
@@ -2329,6 +2557,7 @@ static inline uint64_t ldq_phys_internal(hwaddr addr,
     MemoryRegion *mr;
     hwaddr l = 8;
     hwaddr addr1;
+    bool locked = qemu_tcg_lock_iothread();
 
     mr = address_space_translate(&address_space_memory, addr, &addr1, &l,
                                  false);
@@ -2361,6 +2590,9 @@ static inline uint64_t ldq_phys_internal(hwaddr addr,
             break;
         }
     }
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
     return val;
 }
 
@@ -2396,6 +2628,7 @@ static inline uint32_t lduw_phys_internal(hwaddr addr,
     MemoryRegion *mr;
     hwaddr l = 2;
     hwaddr addr1;
+    bool locked = qemu_tcg_lock_iothread();
 
     mr = address_space_translate(&address_space_memory, addr, &addr1, &l,
                                  false);
@@ -2428,6 +2661,9 @@ static inline uint32_t lduw_phys_internal(hwaddr addr,
             break;
         }
     }
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
     return val;
 }
 
@@ -2455,6 +2691,7 @@ void stl_phys_notdirty(hwaddr addr, uint32_t val)
     MemoryRegion *mr;
     hwaddr l = 4;
     hwaddr addr1;
+    bool locked = qemu_tcg_lock_iothread();
 
     mr = address_space_translate(&address_space_memory, addr, &addr1, &l,
                                  true);
@@ -2470,11 +2707,13 @@ void stl_phys_notdirty(hwaddr addr, uint32_t val)
                 /* invalidate code */
                 tb_invalidate_phys_page_range(addr1, addr1 + 4, 0);
                 /* set dirty bit */
-                cpu_physical_memory_set_dirty_flags(
-                    addr1, (0xff & ~CODE_DIRTY_FLAG));
+                cpu_physical_memory_set_dirty_nocode(addr1, 4);
             }
         }
     }
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
 }
 
 /* warning: addr must be aligned */
@@ -2485,6 +2724,7 @@ static inline void stl_phys_internal(hwaddr addr, uint32_t val,
     MemoryRegion *mr;
     hwaddr l = 4;
     hwaddr addr1;
+    bool locked = qemu_tcg_lock_iothread();
 
     mr = address_space_translate(&address_space_memory, addr, &addr1, &l,
                                  true);
@@ -2516,6 +2756,9 @@ static inline void stl_phys_internal(hwaddr addr, uint32_t val,
         }
         invalidate_and_set_dirty(addr1, 4);
     }
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
 }
 
 void stl_phys(hwaddr addr, uint32_t val)
@@ -2548,6 +2791,7 @@ static inline void stw_phys_internal(hwaddr addr, uint32_t val,
     MemoryRegion *mr;
     hwaddr l = 2;
     hwaddr addr1;
+    bool locked = qemu_tcg_lock_iothread();
 
     mr = address_space_translate(&address_space_memory, addr, &addr1, &l,
                                  true);
@@ -2579,6 +2823,9 @@ static inline void stw_phys_internal(hwaddr addr, uint32_t val,
         }
         invalidate_and_set_dirty(addr1, 2);
     }
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
 }
 
 void stw_phys(hwaddr addr, uint32_t val)
@@ -1660,6 +1660,8 @@ show emulated PCI device info
 show virtual to physical memory mappings (i386, SH4, SPARC, PPC, and Xtensa only)
 @item info mem
 show the active virtual memory mappings (i386 only)
+@item info ramblock
+show RAM blocks and lookup statistics
 @item info jit
 show dynamic compiler info
 @item info numa
@@ -1034,6 +1034,7 @@ static Property virtio_ccw_blk_properties[] = {
                     VIRTIO_CCW_FLAG_USE_IOEVENTFD_BIT, true),
 #ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
     DEFINE_PROP_BIT("x-data-plane", VirtIOBlkCcw, blk.data_plane, 0, false),
+    DEFINE_PROP_STRING("x-iothread", VirtIOBlkCcw, blk.iothread),
 #endif
     DEFINE_PROP_END_OF_LIST(),
 };
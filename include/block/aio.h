@@ -20,6 +20,7 @@
 #include "qemu/event_notifier.h"
 #include "qemu/thread.h"
 #include "qemu/timer.h"
+#include "qemu/rfifolock.h"
 
 typedef struct BlockDriverAIOCB BlockDriverAIOCB;
 typedef void BlockDriverCompletionFunc(void *opaque, int ret);
@@ -43,10 +44,15 @@ void qemu_aio_release(void *p);
 typedef struct AioHandler AioHandler;
 typedef void QEMUBHFunc(void *opaque);
 typedef void IOHandler(void *opaque);
+typedef bool AioPollFn(void *opaque);
+typedef bool EventNotifierPollHandler(EventNotifier *e);
 
 struct AioContext {
     GSource source;
 
+    /* Protects all fields from multi-threaded access */
+    RFifoLock lock;
+
     /* The list of registered AIO handlers */
     QLIST_HEAD(, AioHandler) aio_handlers;
 
@@ -56,11 +62,45 @@ struct AioContext {
      */
     int walking_handlers;
 
+    /* Number of live entries in aio_handlers */
+    int nr_handlers;
+
+    /* Set when a handler was only marked as deleted by aio_set_fd_handler */
+    bool handlers_deleted;
+
+#ifdef CONFIG_EPOLL_CREATE1
+    /* With many handlers the descriptors are registered once with epoll
+     * instead of being passed to ppoll on every iteration.  The GSource
+     * then polls epoll_pfd only, and aio_poll dispatches the handlers on
+     * ready_handlers.
+     */
+    int epollfd;
+    bool epoll_available;
+    bool epoll_enabled;
+    unsigned epoll_threshold;
+    GPollFD epoll_pfd;
+    QLIST_HEAD(, AioHandler) ready_handlers;
+#endif
+
     /* lock to protect between bh's adders and deleter */
     QemuMutex bh_lock;
     /* Anchor of the list of Bottom Halves belonging to the context */
     struct QEMUBH *first_bh;
 
+    /* Bottom halves waiting to run, in scheduling order, so that polling
+     * does not walk the idle ones.  Protected by bh_lock.
+     */
+    QSIMPLEQ_HEAD(, QEMUBH) scheduled_bh;
+    uint64_t bh_seq;
+
+    /* Set by qemu_bh_delete, cleared once the bottom halves are freed.
+     * Protected by bh_lock.
+     */
+    bool bh_deleted;
+
+    /* Number of bottom half callbacks run */
+    uint64_t bh_runs;
+
     /* A simple lock used to protect the first_bh list, and ensure that
      * no callbacks are removed while we're walking and dispatching callbacks.
      */
@@ -77,6 +117,21 @@ struct AioContext {
 
     /* TimerLists for calling timers - one per clock type */
     QEMUTimerListGroup tlg;
+
+    /* Adaptive polling, see aio_context_set_poll_params.  poll_ns is the
+     * current polling window; it moves between 0 and poll_max_ns.
+     */
+    int poll_handlers;
+    int64_t poll_ns;
+    int64_t poll_max_ns;
+    int64_t poll_grow;
+    int64_t poll_shrink;
+
+    /* Blocking aio_poll calls that polled, and those of them that found
+     * work without going to sleep.
+     */
+    uint64_t poll_attempts;
+    uint64_t poll_hits;
 };
 
 /**
@@ -88,6 +143,46 @@ struct AioContext {
  */
 AioContext *aio_context_new(void);
 
+/**
+ * aio_context_setup:
+ * @ctx: The AioContext to initialize.
+ *
+ * Initialize the host-specific part of a new AioContext.  Called by
+ * aio_context_new; aio_context_destroy releases the resources.
+ */
+void aio_context_setup(AioContext *ctx);
+void aio_context_destroy(AioContext *ctx);
+
+/**
+ * aio_context_set_epoll_threshold:
+ * @ctx: The AioContext to operate on.
+ * @threshold: Number of handlers from which epoll is used, 0 to never
+ * use it.
+ *
+ * On Linux an AioContext with many file descriptors registers them with
+ * epoll, so that waking up costs the number of ready descriptors rather
+ * than the number of registered ones.  The context goes back to ppoll
+ * when the number of handlers drops below half the threshold.  This is
+ * a no-op on hosts without epoll.
+ */
+void aio_context_set_epoll_threshold(AioContext *ctx, unsigned threshold);
+
+/**
+ * aio_context_set_poll_params:
+ * @ctx: The AioContext to operate on.
+ * @max_ns: Longest time to busy-poll before sleeping, 0 to disable polling.
+ * @grow: Factor by which the polling window grows, 0 for the default.
+ * @shrink: Divisor by which the polling window shrinks, 0 to reset it to 0.
+ *
+ * Before sleeping, a blocking aio_poll can call the handlers' polling
+ * functions in a loop, which avoids the system calls and the wakeup
+ * latency when work arrives quickly.  The window starts at 0, grows each
+ * time an event arrives after the window but within @max_ns, and shrinks
+ * when the wait goes beyond @max_ns.
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink);
+
 /**
  * aio_context_ref:
  * @ctx: The AioContext to operate on.
@@ -104,6 +199,25 @@ void aio_context_ref(AioContext *ctx);
  */
 void aio_context_unref(AioContext *ctx);
 
+/* aio_context_acquire:
+ * @ctx: The AioContext
+ *
+ * An AioContext has a lock that allows one thread at a time to run its
+ * handlers.  Code outside the thread that polls the context, such as the
+ * main loop stopping a device whose context is owned by an IOThread, must
+ * hold it while touching the context or the BlockDriverStates bound to it.
+ * A thread blocked in aio_poll is kicked out of it so that the lock can be
+ * taken.  The lock is recursive.
+ */
+void aio_context_acquire(AioContext *ctx);
+
+/* aio_context_release:
+ * @ctx: The AioContext
+ *
+ * Release the AioContext lock.
+ */
+void aio_context_release(AioContext *ctx);
+
 /**
  * aio_bh_new: Allocate a new bottom half structure.
  *
@@ -137,6 +251,14 @@ void aio_notify(AioContext *ctx);
  */
 int aio_bh_poll(AioContext *ctx);
 
+/**
+ * aio_poll_adjust: Resize the adaptive polling window.
+ *
+ * Internal function used by aio_poll after a blocking wait that took
+ * @block_ns nanoseconds, polling included.
+ */
+void aio_poll_adjust(AioContext *ctx, int64_t block_ns);
+
 /**
  * qemu_bh_schedule: Schedule a bottom half.
  *
@@ -212,6 +334,13 @@ void aio_set_fd_handler(AioContext *ctx,
                         IOHandler *io_read,
                         IOHandler *io_write,
                         void *opaque);
+
+/* Attach a polling function to the handler registered for @fd.  @io_poll
+ * must be cheap and return true if io_read has work to do; it is called
+ * in a busy loop by aio_poll when adaptive polling is enabled.  Pass NULL
+ * to detach it.
+ */
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll);
 #endif
 
 /* Register an event notifier and associated callbacks.  Behaves very similarly
@@ -225,6 +354,15 @@ void aio_set_event_notifier(AioContext *ctx,
                             EventNotifier *notifier,
                             EventNotifierHandler *io_read);
 
+/* Attach a polling function to an event notifier registered with
+ * aio_set_event_notifier.  When @io_poll returns true, the notifier's
+ * handler is called even though the notifier has not been set, so it
+ * must not rely on event_notifier_test_and_clear() succeeding.
+ */
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 EventNotifierPollHandler *io_poll);
+
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
  */
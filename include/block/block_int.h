@@ -33,6 +33,7 @@
 #include "qapi/qmp/qerror.h"
 #include "monitor/monitor.h"
 #include "qemu/hbitmap.h"
+#include "qemu/interval-tree.h"
 #include "block/snapshot.h"
 #include "qemu/main-loop.h"
 #include "qemu/throttle.h"
@@ -59,7 +60,7 @@ typedef struct BdrvTrackedRequest {
     int64_t sector_num;
     int nb_sectors;
     bool is_write;
-    QLIST_ENTRY(BdrvTrackedRequest) list;
+    IntervalTreeNode node; /* covers the sectors of the request */
     Coroutine *co; /* owner, used for deadlock detection */
     CoQueue wait_queue; /* coroutines blocked on this request */
 } BdrvTrackedRequest;
@@ -102,6 +103,24 @@ struct BlockDriver {
                       const uint8_t *buf, int nb_sectors);
     void (*bdrv_close)(BlockDriverState *bs);
     void (*bdrv_rebind)(BlockDriverState *bs);
+
+    /* Called when the BlockDriverState moves to another AioContext, see
+     * bdrv_set_aio_context.  Drivers that register file descriptors, bottom
+     * halves or timers must move them here; protocol drivers that do not
+     * implement these stay in the main loop.
+     */
+    void (*bdrv_detach_aio_context)(BlockDriverState *bs);
+    void (*bdrv_attach_aio_context)(BlockDriverState *bs,
+                                    AioContext *new_context);
+
+    /* Requests submitted between bdrv_io_plug and bdrv_io_unplug may be
+     * queued and submitted to the host together; bdrv_flush_io_queue
+     * submits them at once.  Plugs nest.
+     */
+    void (*bdrv_io_plug)(BlockDriverState *bs);
+    void (*bdrv_io_unplug)(BlockDriverState *bs);
+    void (*bdrv_flush_io_queue)(BlockDriverState *bs);
+
     int (*bdrv_create)(const char *filename, QEMUOptionParameter *options,
                        Error **errp);
     int (*bdrv_set_key)(BlockDriverState *bs, const char *key);
@@ -163,6 +182,8 @@ struct BlockDriver {
 
     int (*bdrv_write_compressed)(BlockDriverState *bs, int64_t sector_num,
                                  const uint8_t *buf, int nb_sectors);
+    int coroutine_fn (*bdrv_co_write_compressed)(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, QEMUIOVector *qiov);
 
     int (*bdrv_snapshot_create)(BlockDriverState *bs,
                                 QEMUSnapshotInfo *sn_info);
@@ -178,6 +199,8 @@ struct BlockDriver {
                                   const char *snapshot_name);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
     ImageInfoSpecific *(*bdrv_get_specific_info)(BlockDriverState *bs);
+    BlockMetadataCacheStats *(*bdrv_get_metadata_cache_stats)(
+        const BlockDriverState *bs);
 
     int (*bdrv_save_vmstate)(BlockDriverState *bs, QEMUIOVector *qiov,
                              int64_t pos);
@@ -272,6 +295,9 @@ struct BlockDriverState {
     /* number of in-flight copy-on-read requests */
     unsigned int copy_on_read_in_flight;
 
+    /* The AioContext in which requests complete, NULL for the main loop */
+    AioContext *aio_context;
+
     /* I/O throttling */
     ThrottleState throttle_state;
     CoQueue      throttled_reqs[2];
@@ -302,11 +328,12 @@ struct BlockDriverState {
     BlockDeviceIoStatus iostatus;
     char device_name[32];
     HBitmap *dirty_bitmap;
+    QLIST_HEAD(, BdrvDirtyBitmap) dirty_bitmaps;
     int refcnt;
     int in_use; /* users other than guest access, eg. block migration */
     QTAILQ_ENTRY(BlockDriverState) list;
 
-    QLIST_HEAD(, BdrvTrackedRequest) tracked_requests;
+    IntervalTreeRoot tracked_requests;
 
     /* long-running background operation */
     BlockJob *job;
@@ -336,6 +363,24 @@ void bdrv_add_before_write_notifier(BlockDriverState *bs,
  */
 AioContext *bdrv_get_aio_context(BlockDriverState *bs);
 
+/**
+ * bdrv_can_set_aio_context:
+ *
+ * Returns: whether every driver in the chain of @bs supports moving to
+ * another #AioContext.
+ */
+bool bdrv_can_set_aio_context(BlockDriverState *bs);
+
+/**
+ * bdrv_set_aio_context:
+ *
+ * Changes the #AioContext used for fd handlers, timers, and BHs by this
+ * BlockDriverState and all its children, e.g. to let an IOThread run them.
+ * All requests are drained first.  The caller must hold the AioContext
+ * lock of the current context, if it is not the main loop.
+ */
+void bdrv_set_aio_context(BlockDriverState *bs, AioContext *new_context);
+
 #ifdef _WIN32
 int is_windows_drive(const char *filename);
 #endif
@@ -415,6 +460,9 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
  * @target: Block device to write to.
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
  * @sync_mode: What parts of the disk image should be copied to the destination.
+ * @sync_bitmap: The dirty bitmap whose clusters are copied if @sync_mode is
+ * MIRROR_SYNC_MODE_INCREMENTAL, NULL otherwise.  It is cleared if the backup
+ * succeeds.
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
  * @cb: Completion function for the job.
@@ -425,6 +473,7 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
  */
 void backup_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, MirrorSyncMode sync_mode,
+                  BdrvDirtyBitmap *sync_bitmap,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockDriverCompletionFunc *cb, void *opaque,
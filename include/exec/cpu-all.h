@@ -435,6 +435,9 @@ void cpu_watchpoint_remove_all(CPUArchState *env, int mask);
 
 #if !defined(CONFIG_USER_ONLY)
 
+#include "exec/memory.h"
+#include "qemu/hbitmap.h"
+
 /* memory API */
 
 extern ram_addr_t ram_size;
@@ -458,9 +461,22 @@ typedef struct RAMBlock {
 
 typedef struct RAMList {
     QemuMutex mutex;
-    /* Protected by the iothread lock.  */
-    uint8_t *phys_dirty;
+    /* Protected by the iothread lock.  One bit per target page and per
+     * DIRTY_MEMORY_* client, indexed by ram_addr_t >> TARGET_PAGE_BITS.
+     */
+    HBitmap *dirty_memory[DIRTY_MEMORY_NUM];
+    ram_addr_t dirty_pages;
     RAMBlock *mru_block;
+    /* Blocks sorted by offset and by host address, for binary search.
+     * Rebuilt whenever a block is added or removed; writes take both
+     * locks.
+     */
+    RAMBlock **by_offset;
+    RAMBlock **by_host;
+    int nr_blocks;
+    int nr_host_blocks;
+    uint64_t lookups;
+    uint64_t mru_hits;
     /* Protected by the ramlist lock.  */
     QTAILQ_HEAD(, RAMBlock) blocks;
     uint32_t version;
@@ -481,6 +497,7 @@ extern int mem_prealloc;
 #define TLB_MMIO        (1 << 5)
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf);
+void dump_ram_blocks(FILE *f, fprintf_function cpu_fprintf);
 ram_addr_t last_ram_offset(void);
 void qemu_mutex_lock_ramlist(void);
 void qemu_mutex_unlock_ramlist(void);
@@ -103,12 +103,28 @@ typedef struct CPUTLBEntry {
 
 QEMU_BUILD_BUG_ON(sizeof(CPUTLBEntry) != (1 << CPU_TLB_ENTRY_BITS));
 
+/* Per-vCPU MMIO dispatch cache, indexed by the section number held in
+   the low bits of an iotlb entry.  It is flushed with the TLB, which is
+   also what happens whenever section numbers are reassigned.  */
+#define CPU_MMIO_CACHE_BITS 4
+#define CPU_MMIO_CACHE_SIZE (1 << CPU_MMIO_CACHE_BITS)
+
+typedef struct CPUMMIOCacheEntry {
+    hwaddr key;                 /* section number + 1, 0 if unused */
+    struct MemoryRegion *mr;
+    unsigned read_sizes;        /* access sizes that can bypass */
+    unsigned write_sizes;       /* memory_region_dispatch_*() */
+} CPUMMIOCacheEntry;
+
 #define CPU_COMMON_TLB \
     /* The meaning of the MMU modes is defined in the target code. */   \
     CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
     hwaddr iotlb[NB_MMU_MODES][CPU_TLB_SIZE];               \
     target_ulong tlb_flush_addr;                                        \
-    target_ulong tlb_flush_mask;
+    target_ulong tlb_flush_mask;                                        \
+    CPUMMIOCacheEntry mmio_cache[CPU_MMIO_CACHE_SIZE];                  \
+    /* sections of the memory map the iotlb entries were built from */ \
+    struct MemoryRegionSection *iotlb_sections;
 
 #else
 
@@ -335,14 +335,23 @@ extern uintptr_t tci_tb_ptr;
 
 void phys_mem_set_alloc(void *(*alloc)(size_t));
 
-struct MemoryRegion *iotlb_to_region(hwaddr index);
+struct MemoryRegion *iotlb_to_region(CPUArchState *env, hwaddr index);
+void tlb_check_memory_map(CPUArchState *env);
 bool io_mem_read(struct MemoryRegion *mr, hwaddr addr,
                  uint64_t *pvalue, unsigned size);
 bool io_mem_write(struct MemoryRegion *mr, hwaddr addr,
                   uint64_t value, unsigned size);
+unsigned memory_region_direct_sizes(struct MemoryRegion *mr, bool is_write);
+uint64_t io_mem_read_direct(struct MemoryRegion *mr, hwaddr addr,
+                            unsigned size);
+void io_mem_write_direct(struct MemoryRegion *mr, hwaddr addr,
+                         uint64_t value, unsigned size);
+CPUMMIOCacheEntry *tlb_mmio_cache_lookup(CPUArchState *env, hwaddr iotlb);
 
 void tlb_fill(CPUArchState *env1, target_ulong addr, int is_write, int mmu_idx,
               uintptr_t retaddr);
+void tlb_fill_locked(CPUArchState *env1, target_ulong addr, int is_write,
+                     int mmu_idx, uintptr_t retaddr);
 
 uint8_t helper_ldb_cmmu(CPUArchState *env, target_ulong addr, int mmu_idx);
 uint16_t helper_ldw_cmmu(CPUArchState *env, target_ulong addr, int mmu_idx);
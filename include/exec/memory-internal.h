@@ -40,84 +40,118 @@ void *qemu_get_ram_ptr(ram_addr_t addr);
 void qemu_ram_free(ram_addr_t addr);
 void qemu_ram_free_from_ptr(ram_addr_t addr);
 
-#define VGA_DIRTY_FLAG       0x01
-#define CODE_DIRTY_FLAG      0x02
-#define MIGRATION_DIRTY_FLAG 0x08
-
-static inline int cpu_physical_memory_get_dirty_flags(ram_addr_t addr)
+static inline bool cpu_physical_memory_get_dirty_flag(ram_addr_t addr,
+                                                      unsigned client)
 {
-    return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS];
+    assert(client < DIRTY_MEMORY_NUM);
+    return hbitmap_get(ram_list.dirty_memory[client],
+                       addr >> TARGET_PAGE_BITS);
 }
 
-/* read dirty bit (return 0 or 1) */
-static inline int cpu_physical_memory_is_dirty(ram_addr_t addr)
+/* Return the first page at or after @start that is dirty for @client,
+ * or @end if there is none.  Clean ranges are skipped a word of the
+ * upper levels of the bitmap at a time.
+ */
+static inline ram_addr_t cpu_physical_memory_find_dirty(ram_addr_t start,
+                                                        ram_addr_t end,
+                                                        unsigned client)
 {
-    return cpu_physical_memory_get_dirty_flags(addr) == 0xff;
+    HBitmapIter hbi;
+    int64_t page;
+
+    assert(client < DIRTY_MEMORY_NUM);
+    start &= TARGET_PAGE_MASK;
+    if (start >= end) {
+        return end;
+    }
+    hbitmap_iter_init(&hbi, ram_list.dirty_memory[client],
+                      start >> TARGET_PAGE_BITS);
+    page = hbitmap_iter_next(&hbi);
+    if (page < 0 || ((ram_addr_t)page << TARGET_PAGE_BITS) >= end) {
+        return end;
+    }
+    return (ram_addr_t)page << TARGET_PAGE_BITS;
 }
 
-static inline int cpu_physical_memory_get_dirty(ram_addr_t start,
-                                                ram_addr_t length,
-                                                int dirty_flags)
+static inline bool cpu_physical_memory_get_dirty(ram_addr_t start,
+                                                 ram_addr_t length,
+                                                 unsigned client)
 {
-    int ret = 0;
-    ram_addr_t addr, end;
+    ram_addr_t end = TARGET_PAGE_ALIGN(start + length);
 
-    end = TARGET_PAGE_ALIGN(start + length);
-    start &= TARGET_PAGE_MASK;
-    for (addr = start; addr < end; addr += TARGET_PAGE_SIZE) {
-        ret |= cpu_physical_memory_get_dirty_flags(addr) & dirty_flags;
-    }
-    return ret;
+    return cpu_physical_memory_find_dirty(start, end, client) < end;
 }
 
-static inline int cpu_physical_memory_set_dirty_flags(ram_addr_t addr,
-                                                      int dirty_flags)
+/* read dirty bit (return 0 or 1) */
+static inline bool cpu_physical_memory_is_dirty(ram_addr_t addr)
 {
-    return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] |= dirty_flags;
+    return cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_VGA) &&
+           cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_CODE) &&
+           cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_MIGRATION);
 }
 
-static inline void cpu_physical_memory_set_dirty(ram_addr_t addr)
+static inline void cpu_physical_memory_set_dirty_flag(ram_addr_t addr,
+                                                      unsigned client)
 {
-    cpu_physical_memory_set_dirty_flags(addr, 0xff);
+    assert(client < DIRTY_MEMORY_NUM);
+    hbitmap_set(ram_list.dirty_memory[client], addr >> TARGET_PAGE_BITS, 1);
 }
 
-static inline int cpu_physical_memory_clear_dirty_flags(ram_addr_t addr,
-                                                        int dirty_flags)
+static inline void cpu_physical_memory_set_client_dirty(ram_addr_t start,
+                                                        ram_addr_t length,
+                                                        unsigned client)
 {
-    int mask = ~dirty_flags;
+    ram_addr_t end = TARGET_PAGE_ALIGN(start + length);
 
-    return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] &= mask;
+    start &= TARGET_PAGE_MASK;
+    if (end > start) {
+        hbitmap_set(ram_list.dirty_memory[client], start >> TARGET_PAGE_BITS,
+                    (end - start) >> TARGET_PAGE_BITS);
+    }
 }
 
 static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
-                                                       ram_addr_t length,
-                                                       int dirty_flags)
+                                                       ram_addr_t length)
 {
-    ram_addr_t addr, end;
+    unsigned client;
 
-    end = TARGET_PAGE_ALIGN(start + length);
-    start &= TARGET_PAGE_MASK;
-    for (addr = start; addr < end; addr += TARGET_PAGE_SIZE) {
-        cpu_physical_memory_set_dirty_flags(addr, dirty_flags);
+    for (client = 0; client < DIRTY_MEMORY_NUM; client++) {
+        cpu_physical_memory_set_client_dirty(start, length, client);
     }
-    xen_modified_memory(addr, length);
+    xen_modified_memory(start, length);
 }
 
-static inline void cpu_physical_memory_mask_dirty_range(ram_addr_t start,
-                                                        ram_addr_t length,
-                                                        int dirty_flags)
+/* Dirty a range for every client except DIRTY_MEMORY_CODE, after the
+ * translated code for it has been invalidated.
+ */
+static inline void cpu_physical_memory_set_dirty_nocode(ram_addr_t start,
+                                                        ram_addr_t length)
+{
+    cpu_physical_memory_set_client_dirty(start, length, DIRTY_MEMORY_VGA);
+    cpu_physical_memory_set_client_dirty(start, length,
+                                         DIRTY_MEMORY_MIGRATION);
+}
+
+static inline void cpu_physical_memory_clear_dirty_range(ram_addr_t start,
+                                                         ram_addr_t length,
+                                                         unsigned client)
 {
-    ram_addr_t addr, end;
+    ram_addr_t end = TARGET_PAGE_ALIGN(start + length);
 
-    end = TARGET_PAGE_ALIGN(start + length);
+    assert(client < DIRTY_MEMORY_NUM);
     start &= TARGET_PAGE_MASK;
-    for (addr = start; addr < end; addr += TARGET_PAGE_SIZE) {
-        cpu_physical_memory_clear_dirty_flags(addr, dirty_flags);
+    if (end > start) {
+        hbitmap_reset(ram_list.dirty_memory[client], start >> TARGET_PAGE_BITS,
+                      (end - start) >> TARGET_PAGE_BITS);
     }
 }
 
+void cpu_physical_memory_set_dirty_lebitmap(const unsigned long *bitmap,
+                                            ram_addr_t start,
+                                            uint64_t nr_bits,
+                                            ram_addr_t bit_size);
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
-                                     int dirty_flags);
+                                     unsigned client);
 
 #endif
 
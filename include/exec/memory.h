@@ -33,12 +33,13 @@
 typedef struct MemoryRegionOps MemoryRegionOps;
 typedef struct MemoryRegionMmio MemoryRegionMmio;
 
-/* Must match *_DIRTY_FLAGS in cpu-all.h.  To be replaced with dynamic
- * registration.
+/* Clients of the dirty memory tracking; each has its own bitmap in
+ * ram_list.dirty_memory.  To be replaced with dynamic registration.
  */
 #define DIRTY_MEMORY_VGA       0
 #define DIRTY_MEMORY_CODE      1
-#define DIRTY_MEMORY_MIGRATION 3
+#define DIRTY_MEMORY_MIGRATION 2
+#define DIRTY_MEMORY_NUM       3
 
 struct MemoryRegionMmio {
     CPUReadMemoryFunc *read[3];
@@ -153,6 +154,8 @@ struct MemoryRegion {
     bool flush_coalesced_mmio;
     MemoryRegion *alias;
     hwaddr alias_offset;
+    QTAILQ_HEAD(aliases, MemoryRegion) aliases;     /* aliases of this region */
+    QTAILQ_ENTRY(MemoryRegion) aliases_link;
     int priority;
     bool may_overlap;
     QTAILQ_HEAD(subregions, MemoryRegion) subregions;
@@ -163,6 +166,8 @@ struct MemoryRegion {
     unsigned ioeventfd_nb;
     MemoryRegionIoeventfd *ioeventfds;
     NotifierList iommu_notify;
+    uint64_t mmio_reads;        /* accesses dispatched from the CPU side */
+    uint64_t mmio_writes;
 };
 
 typedef struct MemoryListener MemoryListener;
@@ -206,6 +211,10 @@ struct AddressSpace {
     char *name;
     MemoryRegion *root;
     struct FlatView *current_map;
+    /* Part of the address space to render again at the next commit */
+    bool update_pending;
+    Int128 update_start;
+    Int128 update_end;
     int ioeventfd_nb;
     struct MemoryRegionIoeventfd *ioeventfds;
     struct AddressSpaceDispatch *dispatch;
@@ -570,6 +579,42 @@ bool memory_region_get_dirty(MemoryRegion *mr, hwaddr addr,
 void memory_region_set_dirty(MemoryRegion *mr, hwaddr addr,
                              hwaddr size);
 
+/**
+ * memory_region_set_dirty_lebitmap: Mark as dirty the pages set in a bitmap
+ *
+ * Marks as dirty, for all clients, the pages whose bit is set in a
+ * little-endian bitmap such as the one returned by KVM_GET_DIRTY_LOG.
+ * Runs of set bits are marked with a single range operation.
+ *
+ * @mr: the memory region being dirtied.
+ * @addr: the address (relative to the start of the region) covered by
+ *        bit 0 of @bitmap.
+ * @bitmap: the bitmap, in little-endian longs.
+ * @nr_bits: the number of bits in @bitmap.
+ * @bit_size: the number of bytes covered by each bit.
+ */
+void memory_region_set_dirty_lebitmap(MemoryRegion *mr, hwaddr addr,
+                                      const unsigned long *bitmap,
+                                      uint64_t nr_bits, hwaddr bit_size);
+
+/**
+ * memory_region_find_dirty: Find the next dirty page for a specified client.
+ *
+ * Returns the offset (relative to the start of the region) of the first
+ * page in [@addr, @addr + @size) that has been written to since the last
+ * call to memory_region_reset_dirty() with the same @client, or @addr +
+ * @size if there is none.  The cost depends on the number of dirty pages
+ * rather than on @size, so callers can walk a large region with it.
+ *
+ * @mr: the memory region being queried.
+ * @addr: the address (relative to the start of the region) to start from.
+ * @size: the size of the range being queried.
+ * @client: the user of the logging information; %DIRTY_MEMORY_MIGRATION or
+ *          %DIRTY_MEMORY_VGA.
+ */
+hwaddr memory_region_find_dirty(MemoryRegion *mr, hwaddr addr,
+                                hwaddr size, unsigned client);
+
 /**
  * memory_region_test_and_clear_dirty: Check whether a range of bytes is dirty
  *                                     for a specified client. It clears them.
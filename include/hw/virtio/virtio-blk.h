@@ -110,6 +110,7 @@ struct VirtIOBlkConf
     uint32_t scsi;
     uint32_t config_wce;
     uint32_t data_plane;
+    char *iothread;     /* id of the IOThread that runs x-data-plane */
 };
 
 struct VirtIOBlockDataPlane;
@@ -362,10 +362,14 @@ size_t qemu_iovec_memset(QEMUIOVector *qiov, size_t offset,
                          int fillc, size_t bytes);
 
 bool buffer_is_zero(const void *buf, size_t len);
+size_t buffer_zero_run(const void *buf, size_t len, size_t block_size,
+                       bool *is_zero);
+bool test_buffer_is_zero_next_accel(void);
 
 void qemu_progress_init(int enabled, float min_skip);
 void qemu_progress_end(void);
 void qemu_progress_print(float delta, int max);
+void qemu_progress_set_rate(float rate);
 const char *qemu_get_vm_name(void);
 
 #define QEMU_FILE_TYPE_BIOS   0
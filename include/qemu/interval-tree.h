@@ -0,0 +1,95 @@
+/*
+ * Interval tree
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_INTERVAL_TREE_H
+#define QEMU_INTERVAL_TREE_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* An interval tree stores closed intervals [start, last] and finds those
+ * that overlap a given range in O(log n + k) time.  Nodes are embedded in
+ * the structures that they describe, so the tree never allocates memory.
+ * Several nodes may have the same interval.
+ *
+ * The tree is a treap ordered by start (then by node address), where
+ * each node also records the largest "last" in its subtree.
+ */
+typedef struct IntervalTreeNode IntervalTreeNode;
+
+struct IntervalTreeNode {
+    uint64_t start;
+    uint64_t last;
+
+    /* private: */
+    uint64_t subtree_last;
+    unsigned int priority;
+    IntervalTreeNode *left;
+    IntervalTreeNode *right;
+};
+
+typedef struct IntervalTreeRoot {
+    IntervalTreeNode *root;
+    unsigned int seed;
+} IntervalTreeRoot;
+
+#define INTERVAL_TREE_ROOT_INIT { NULL, 0 }
+
+static inline void interval_tree_init(IntervalTreeRoot *root)
+{
+    root->root = NULL;
+    root->seed = 0;
+}
+
+static inline bool interval_tree_empty(const IntervalTreeRoot *root)
+{
+    return root->root == NULL;
+}
+
+/**
+ * interval_tree_insert:
+ * @node: The node to insert, with start and last already set.
+ * @root: The tree.
+ */
+void interval_tree_insert(IntervalTreeNode *node, IntervalTreeRoot *root);
+
+/**
+ * interval_tree_remove:
+ * @node: A node that is in @root.
+ * @root: The tree.
+ */
+void interval_tree_remove(IntervalTreeNode *node, IntervalTreeRoot *root);
+
+/**
+ * interval_tree_iter_first:
+ * @root: The tree.
+ * @start: First element of the range.
+ * @last: Last element of the range.
+ *
+ * Returns the node with the lowest start among those that overlap
+ * [@start, @last], or NULL if there is none.
+ */
+IntervalTreeNode *interval_tree_iter_first(IntervalTreeRoot *root,
+                                           uint64_t start, uint64_t last);
+
+/**
+ * interval_tree_foreach_overlap:
+ * @root: The tree.
+ * @start: First element of the range.
+ * @last: Last element of the range.
+ * @fn: Function called, in order of start, for each node that overlaps
+ * [@start, @last].  Returning false stops the walk.  It must not modify
+ * the tree.
+ * @opaque: Passed to @fn.
+ */
+void interval_tree_foreach_overlap(IntervalTreeRoot *root,
+                                   uint64_t start, uint64_t last,
+                                   bool (*fn)(IntervalTreeNode *node,
+                                              void *opaque),
+                                   void *opaque);
+
+#endif
@@ -81,6 +81,20 @@ int qemu_init_main_loop(void);
  */
 int main_loop_wait(int nonblocking);
 
+/**
+ * qemu_main_loop_get_stats: Read the main loop activity counters.
+ *
+ * Returns the number of times main_loop_wait() woke up, and the number
+ * of bottom halves and timer callbacks that the main loop ran, since
+ * startup.
+ *
+ * @wakeups: returns the number of wakeups.
+ * @bh_runs: returns the number of bottom half callbacks run.
+ * @timers_fired: returns the number of timer callbacks run.
+ */
+void qemu_main_loop_get_stats(uint64_t *wakeups, uint64_t *bh_runs,
+                              uint64_t *timers_fired);
+
 /**
  * qemu_get_aio_context: Return the main loop's AioContext
  */
@@ -299,6 +313,17 @@ void qemu_mutex_lock_iothread(void);
  */
 void qemu_mutex_unlock_iothread(void);
 
+/**
+ * qemu_tcg_lock_iothread: Take the main loop mutex from a TCG vCPU.
+ *
+ * With multi-threaded TCG a vCPU runs translated code without the main
+ * loop mutex.  Helpers that reach device or memory map state call this
+ * function, which takes the mutex unless the calling thread already
+ * holds it.  Returns true if the caller must release it with
+ * qemu_mutex_unlock_iothread().
+ */
+bool qemu_tcg_lock_iothread(void);
+
 /* internal interfaces */
 
 void qemu_fd_register(int fd);
@@ -390,13 +390,43 @@ bool timerlistgroup_run_timers(QEMUTimerListGroup *tlg);
  * Determine the deadline of the soonest timer to
  * expire associated with any timer list linked to
  * the timer list group. Only clocks suitable for
- * deadline calculation are included.
+ * deadline calculation are included.  The deadline
+ * may be extended by the timer slack, see
+ * qemu_timer_set_slack_ns().
  *
  * Returns: the deadline in nanoseconds or -1 if no
  * timers are to expire.
  */
 int64_t timerlistgroup_deadline_ns(QEMUTimerListGroup *tlg);
 
+/**
+ * timerlistgroup_timers_fired:
+ * @tlg: the timer list group
+ *
+ * Returns: the number of timer callbacks run so far by the timer
+ * lists of the group
+ */
+uint64_t timerlistgroup_timers_fired(QEMUTimerListGroup *tlg);
+
+/**
+ * qemu_timer_set_slack_ns:
+ * @slack: the timer slack in nanoseconds
+ *
+ * Allow the wakeups computed by timerlistgroup_deadline_ns() to be up
+ * to @slack nanoseconds late, so that timers expiring close to each
+ * other are run together after a single wakeup.  Timers never run
+ * early.  The slack is also passed to the host kernel where supported.
+ * The default of 0 wakes up for every deadline.
+ */
+void qemu_timer_set_slack_ns(int64_t slack);
+
+/**
+ * qemu_timer_get_slack_ns:
+ *
+ * Returns: the timer slack set with qemu_timer_set_slack_ns()
+ */
+int64_t qemu_timer_get_slack_ns(void);
+
 /*
  * QEMUTimer
  */
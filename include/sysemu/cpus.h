@@ -13,6 +13,26 @@ void cpu_synchronize_all_post_init(void);
 
 void qtest_clock_warp(int64_t dest);
 
+#ifndef CONFIG_USER_ONLY
+/* Multi-threaded TCG (-tcg-threads multi) */
+extern bool mttcg_enabled;
+
+/* Drop/retake the global mutex around translated code.  exec_start
+ * returns false, with the mutex still held, if an exclusive section
+ * ran while waiting; the caller must then look up its TB again.  */
+bool qemu_tcg_exec_start(struct CPUState *cpu);
+void qemu_tcg_exec_end(struct CPUState *cpu);
+
+/* Run with every other vCPU outside of translated code.  Must be called
+ * with the global mutex held.  */
+void tcg_start_exclusive(void);
+void tcg_end_exclusive(void);
+
+/* End the exclusive section that cpu started, if a guest fault took it
+ * back to cpu_exec before tcg_end_exclusive.  */
+void tcg_cancel_exclusive(struct CPUState *cpu);
+#endif
+
 #ifndef CONFIG_USER_ONLY
 /* vl.c */
 extern int smp_cores;
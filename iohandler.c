@@ -46,6 +46,30 @@ typedef struct IOHandlerRecord {
 static QLIST_HEAD(, IOHandlerRecord) io_handlers =
     QLIST_HEAD_INITIALIZER(io_handlers);
 
+#ifdef CONFIG_EPOLL_CREATE1
+/* Handlers without fd_read_poll do not need to be looked at before every
+ * poll, so they live in an AioContext of their own whose GSource is
+ * attached to the main loop.  With many of them it switches to epoll
+ * and a main loop iteration only touches the descriptors that are ready.
+ * It is not qemu_aio_context, so that qemu_aio_wait() and bdrv_drain_all()
+ * still do not run them.
+ */
+static AioContext *iohandler_ctx;
+
+static AioContext *iohandler_get_aio_context(void)
+{
+    if (!iohandler_ctx && qemu_get_aio_context()) {
+        GSource *src;
+
+        iohandler_ctx = aio_context_new();
+        src = aio_get_g_source(iohandler_ctx);
+        g_source_attach(src, NULL);
+        g_source_unref(src);
+    }
+    return iohandler_ctx;
+}
+#endif
+
 
 /* XXX: fd_read_poll should be suppressed, but an API change is
    necessary in the character devices to suppress fd_can_read(). */
@@ -59,6 +83,24 @@ int qemu_set_fd_handler2(int fd,
 
     assert(fd >= 0);
 
+#ifdef CONFIG_EPOLL_CREATE1
+    if (!fd_read_poll && (fd_read || fd_write) &&
+        iohandler_get_aio_context()) {
+        QLIST_FOREACH(ioh, &io_handlers, next) {
+            if (ioh->fd == fd) {
+                ioh->deleted = 1;
+                break;
+            }
+        }
+        aio_set_fd_handler(iohandler_ctx, fd, fd_read, fd_write, opaque);
+        qemu_notify_event();
+        return 0;
+    }
+    if (iohandler_ctx) {
+        aio_set_fd_handler(iohandler_ctx, fd, NULL, NULL, NULL);
+    }
+#endif
+
     if (!fd_read && !fd_write) {
         QLIST_FOREACH(ioh, &io_handlers, next) {
             if (ioh->fd == fd) {
@@ -4,6 +4,7 @@
 
 #include <stdio.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
@@ -14,6 +15,7 @@
 #include <time.h>
 
 #include "qemu.h"
+#include "qemu/atomic.h"
 #include "disas/disas.h"
 
 #ifdef _ARCH_PPC64
@@ -1245,7 +1247,8 @@ static abi_ulong setup_arg_pages(abi_ulong p, struct linux_binprm *bprm,
     }
 
     error = target_mmap(0, size + guard, PROT_READ | PROT_WRITE,
-                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                        MAP_PRIVATE | MAP_ANONYMOUS |
+                        (mmap_prefault ? MAP_POPULATE : 0), -1, 0);
     if (error == -1) {
         perror("mmap stack");
         exit(-1);
@@ -1553,7 +1556,82 @@ unsigned long init_guest_space(unsigned long host_start,
     return real_start;
 }
 
-static void probe_guest_base(const char *image_name,
+#if defined(CONFIG_USE_GUEST_BASE)
+/* The guest_base cache remembers, for each main executable, the host
+ * address init_guest_space() settled on the last time it was run.
+ * Starting the probe from that address lets the first mmap() succeed
+ * instead of walking the host address space page by page.  Entries
+ * are single appended lines "dev ino size mtime loaddr hiaddr start"
+ * and the last matching one wins.  */
+const char *guest_base_cache;
+
+static unsigned long guest_base_cache_lookup(int image_fd, abi_ulong loaddr,
+                                             abi_ulong hiaddr)
+{
+    unsigned long long dev, ino, size, mtime, lo, hi, start;
+    unsigned long result = 0;
+    struct stat st;
+    char line[256];
+    FILE *fp;
+
+    if (fstat(image_fd, &st) < 0) {
+        return 0;
+    }
+
+    fp = fopen(guest_base_cache, "r");
+    if (fp == NULL) {
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "%llx %llx %llx %llx %llx %llx %llx",
+                   &dev, &ino, &size, &mtime, &lo, &hi, &start) != 7) {
+            continue;
+        }
+        if (dev == st.st_dev && ino == st.st_ino && size == st.st_size
+            && mtime == st.st_mtime && lo == loaddr && hi == hiaddr
+            && !(start & ~qemu_host_page_mask)) {
+            result = start;
+        }
+    }
+
+    fclose(fp);
+    return result;
+}
+
+static void guest_base_cache_store(int image_fd, abi_ulong loaddr,
+                                   abi_ulong hiaddr, unsigned long start)
+{
+    struct stat st;
+    char line[256];
+    int fd, len;
+
+    if (fstat(image_fd, &st) < 0) {
+        return;
+    }
+
+    fd = open(guest_base_cache, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd < 0) {
+        return;
+    }
+
+    /* A single short write to an O_APPEND file, so concurrent QEMUs
+     * never interleave their entries.  */
+    len = snprintf(line, sizeof(line), "%llx %llx %llx %llx %llx %llx %lx\n",
+                   (unsigned long long)st.st_dev,
+                   (unsigned long long)st.st_ino,
+                   (unsigned long long)st.st_size,
+                   (unsigned long long)st.st_mtime,
+                   (unsigned long long)loaddr,
+                   (unsigned long long)hiaddr, start);
+    if (write(fd, line, len) != len) {
+        qemu_log("Unable to update guest_base cache %s\n", guest_base_cache);
+    }
+    close(fd);
+}
+#endif
+
+static void probe_guest_base(const char *image_name, int image_fd,
                              abi_ulong loaddr, abi_ulong hiaddr)
 {
     /* Probe for a suitable guest base address, if the user has not set
@@ -1563,7 +1641,7 @@ static void probe_guest_base(const char *image_name,
 #if defined(CONFIG_USE_GUEST_BASE)
     const char *errmsg;
     if (!have_guest_base && !reserved_va) {
-        unsigned long host_start, real_start, host_size;
+        unsigned long host_start, real_start, host_size, cached_start = 0;
 
         /* Round addresses to page boundaries.  */
         loaddr &= qemu_host_page_mask;
@@ -1580,6 +1658,13 @@ static void probe_guest_base(const char *image_name,
         }
         host_size = hiaddr - loaddr;
 
+        if (guest_base_cache) {
+            cached_start = guest_base_cache_lookup(image_fd, loaddr, hiaddr);
+            if (cached_start) {
+                host_start = cached_start;
+            }
+        }
+
         /* Setup the initial guest memory space with ranges gleaned from
          * the ELF image that is being loaded.
          */
@@ -1590,6 +1675,10 @@ static void probe_guest_base(const char *image_name,
         }
         guest_base = real_start - loaddr;
 
+        if (guest_base_cache && real_start != cached_start) {
+            guest_base_cache_store(image_fd, loaddr, hiaddr, real_start);
+        }
+
         qemu_log("Relocating guest address space from 0x"
                  TARGET_ABI_FMT_lx " to 0x%lx\n",
                  loaddr, real_start);
@@ -1688,7 +1777,8 @@ static void load_elf_image(const char *image_name, int image_fd,
         /* This is the main executable.  Make sure that the low
            address does not conflict with MMAP_MIN_ADDR or the
            QEMU application itself.  */
-        probe_guest_base(image_name, loaddr, hiaddr);
+        probe_guest_base(image_name, image_fd, loaddr, hiaddr);
+        startup_profile_mark("guest_base probing");
     }
     load_bias = load_addr - loaddr;
 
@@ -1891,13 +1981,13 @@ static int symcmp(const void *s0, const void *s1)
         : ((sym0->st_value > sym1->st_value) ? 1 : 0);
 }
 
-/* Best attempt to load symbols from this ELF object. */
-static void load_symbols_(struct elfhdr *hdr, int fd, const char *filename, abi_ulong load_bias)
+/* Best attempt to load symbols from this ELF object into S. */
+static void load_symbols_(struct elfhdr *hdr, int fd, struct syminfo *s,
+                          abi_ulong load_bias)
 {
     int i, shnum, nsyms, sym_idx = 0, str_idx = 0;
     struct elf_shdr *shdr;
     char *strings = NULL;
-    struct syminfo *s = NULL;
     struct elf_sym *new_syms, *syms = NULL;
 
     shnum = hdr->e_shnum;
@@ -1921,13 +2011,8 @@ static void load_symbols_(struct elfhdr *hdr, int fd, const char *filename, abi_
 
  found:
     /* Now know where the strtab and symtab are.  Snarf them.  */
-    s = malloc(sizeof(*s));
-    if (!s) {
-        goto give_up;
-    }
-
     i = shdr[str_idx].sh_size;
-    s->disas_strtab = strings = malloc(i);
+    strings = malloc(i);
     if (!strings || pread(fd, strings, i, shdr[str_idx].sh_offset) != i) {
         goto give_up;
     }
@@ -1975,33 +2060,89 @@ static void load_symbols_(struct elfhdr *hdr, int fd, const char *filename, abi_
 
     qsort(syms, nsyms, sizeof(*syms), symcmp);
 
+    s->disas_strtab = strings;
     s->disas_num_syms = nsyms;
 #if ELF_CLASS == ELFCLASS32
     s->disas_symtab.elf32 = syms;
 #else
     s->disas_symtab.elf64 = syms;
 #endif
-    s->lookup_symbol = lookup_symbolxx;
-    s->next = syminfos;
-    s->filename = g_strdup(filename);
-    syminfos = s;
 
     return;
 
 give_up:
-    free(s);
     free(strings);
     free(syms);
 }
 
-/* Load the symbols of the object ``fd`` dynamic loaded at the address
- * ``load_bias``.  */
+/* Symbol tables are only needed when something actually asks for a
+ * symbol (a TCG plugin or the "-d in_asm" log), which most runs never
+ * do.  Reading and sorting them is a significant part of the start-up
+ * time for short-lived guest programs, so only the location of the
+ * object is recorded at mmap time and the table itself is loaded on
+ * the first lookup.  The path may name another file by then, so the
+ * reopened file must match the identity recorded at mmap time.  */
+struct lazy_syminfo {
+    struct syminfo s;
+    abi_ulong load_bias;
+    struct stat st;
+    bool loaded;
+};
+
+static bool lazy_syminfo_same_file(struct lazy_syminfo *ls, int fd)
+{
+    struct stat st;
+
+    return fstat(fd, &st) == 0 &&
+           st.st_dev == ls->st.st_dev && st.st_ino == ls->st.st_ino &&
+           st.st_size == ls->st.st_size && st.st_mtime == ls->st.st_mtime;
+}
+
+static const char *lookup_symbol_lazy(struct syminfo *s, target_ulong orig_addr)
+{
+    static pthread_mutex_t lazy_syminfo_lock = PTHREAD_MUTEX_INITIALIZER;
+    struct lazy_syminfo *ls = container_of(s, struct lazy_syminfo, s);
+    struct elfhdr ehdr;
+    int fd;
+
+    if (!atomic_read(&ls->loaded)) {
+        pthread_mutex_lock(&lazy_syminfo_lock);
+        if (!ls->loaded) {
+            fd = open(s->filename, O_RDONLY);
+            if (fd >= 0) {
+                if (lazy_syminfo_same_file(ls, fd)
+                    && pread(fd, &ehdr, sizeof(ehdr), 0) == sizeof(ehdr)
+                    && elf_check_ident(&ehdr)) {
+                    bswap_ehdr(&ehdr);
+                    if (elf_check_ehdr(&ehdr)) {
+                        load_symbols_(&ehdr, fd, s, ehdr.e_type == ET_EXEC
+                                      ? 0 : ls->load_bias);
+                    }
+                }
+                close(fd);
+            }
+            smp_wmb();
+            ls->loaded = true;
+        }
+        pthread_mutex_unlock(&lazy_syminfo_lock);
+    }
+    smp_rmb();
+
+    if (s->disas_num_syms == 0) {
+        return "";
+    }
+
+    return lookup_symbolxx(s, orig_addr);
+}
+
+/* Register the symbols of the object ``fd`` dynamic loaded at the
+ * address ``load_bias``; they are actually read on first use.  */
 void load_symbols(int fd, abi_ulong load_bias)
 {
     char path[PATH_MAX];
     char proc_fd[PATH_MAX];
     ssize_t status;
-    struct elfhdr ehdr;
+    struct lazy_syminfo *ls;
 
     status = snprintf(proc_fd, PATH_MAX, "/proc/self/fd/%d", fd);
     if (status < 0 || status >= PATH_MAX) {
@@ -2014,20 +2155,16 @@ void load_symbols(int fd, abi_ulong load_bias)
     }
     path[status] = '\0';
 
-    status = pread(fd, &ehdr, sizeof(struct elfhdr), 0);
-    if (status < 0) {
-        return;
-    }
-
-    if (!elf_check_ident(&ehdr)) {
+    ls = g_malloc0(sizeof(*ls));
+    if (fstat(fd, &ls->st) < 0) {
+        g_free(ls);
         return;
     }
-    bswap_ehdr(&ehdr);
-    if (!elf_check_ehdr(&ehdr)) {
-        return;
-    }
-
-    load_symbols_(&ehdr, fd, path, ehdr.e_type == ET_EXEC ? 0 : load_bias);
+    ls->load_bias = load_bias;
+    ls->s.lookup_symbol = lookup_symbol_lazy;
+    ls->s.filename = g_strdup(path);
+    ls->s.next = syminfos;
+    syminfos = &ls->s;
 }
 
 int load_elf_binary(struct linux_binprm * bprm, struct target_pt_regs * regs,
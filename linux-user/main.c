@@ -3317,6 +3317,23 @@ CPUArchState *cpu_copy(CPUArchState *env)
     return new_env;
 }
 
+static int startup_profile;
+static int64_t startup_profile_last;
+
+void startup_profile_mark(const char *phase)
+{
+    int64_t now;
+
+    if (!startup_profile) {
+        return;
+    }
+
+    now = get_clock();
+    fprintf(stderr, "qemu: startup: %-20s %8" PRId64 " us\n", phase,
+            (now - startup_profile_last) / 1000);
+    startup_profile_last = now;
+}
+
 static void handle_arg_help(const char *arg)
 {
     usage();
@@ -3445,6 +3462,11 @@ static void handle_arg_guest_base(const char *arg)
     have_guest_base = 1;
 }
 
+static void handle_arg_guest_base_cache(const char *arg)
+{
+    guest_base_cache = strdup(arg);
+}
+
 static void handle_arg_reserved_va(const char *arg)
 {
     char *p;
@@ -3482,6 +3504,16 @@ static void handle_arg_reserved_va(const char *arg)
 }
 #endif
 
+static void handle_arg_huge_pages(const char *arg)
+{
+    mmap_huge_pages = 1;
+}
+
+static void handle_arg_prefault(const char *arg)
+{
+    mmap_prefault = 1;
+}
+
 static void handle_arg_singlestep(const char *arg)
 {
     singlestep = 1;
@@ -3492,6 +3524,17 @@ static void handle_arg_strace(const char *arg)
     do_strace = 1;
 }
 
+static void handle_arg_strace_summary(const char *arg)
+{
+    do_strace_summary = 1;
+}
+
+static void handle_arg_startup_profile(const char *arg)
+{
+    startup_profile = 1;
+    startup_profile_last = get_clock();
+}
+
 static void handle_arg_version(const char *arg)
 {
     printf("qemu-" TARGET_NAME " version " QEMU_VERSION QEMU_PKGVERSION
@@ -3540,7 +3583,14 @@ static const struct qemu_argument arg_table[] = {
      "address",    "set guest_base address to 'address'"},
     {"R",          "QEMU_RESERVED_VA", true,  handle_arg_reserved_va,
      "size",       "reserve 'size' bytes for guest virtual address space"},
+    {"guest-base-cache", "QEMU_GUEST_BASE_CACHE", true,
+     handle_arg_guest_base_cache,
+     "file",       "remember the guest_base chosen per binary in 'file'"},
 #endif
+    {"huge-pages", "QEMU_HUGE_PAGES",  false, handle_arg_huge_pages,
+     "",           "use transparent huge pages for large anonymous mappings"},
+    {"prefault",   "QEMU_PREFAULT",    false, handle_arg_prefault,
+     "",           "populate the stack and heap when they are mapped"},
     {"d",          "QEMU_LOG",         true,  handle_arg_log,
      "item[,...]", "enable logging of specified items "
      "(use '-d help' for a list of items)"},
@@ -3552,6 +3602,12 @@ static const struct qemu_argument arg_table[] = {
      "",           "run in singlestep mode"},
     {"strace",     "QEMU_STRACE",      false, handle_arg_strace,
      "",           "log system calls"},
+    {"strace-summary", "QEMU_STRACE_SUMMARY", false,
+     handle_arg_strace_summary,
+     "",           "report system call counts and times at exit"},
+    {"startup-profile", "QEMU_STARTUP_PROFILE", false,
+     handle_arg_startup_profile,
+     "",           "report the time spent in each start-up phase"},
     {"version",    "QEMU_VERSION",     false, handle_arg_version,
      "",           "display version information and exit"},
     {NULL, NULL, false, NULL, NULL, NULL}
@@ -3821,6 +3877,7 @@ int main(int argc, char **argv, char **envp)
     cpu_reset(cpu);
 
     thread_cpu = cpu;
+    startup_profile_mark("cpu init");
 
     if (getenv("QEMU_STRACE")) {
         do_strace = 1;
@@ -3850,6 +3907,7 @@ int main(int argc, char **argv, char **envp)
         if (reserved_va) {
             mmap_next_start = reserved_va;
         }
+        startup_profile_mark("guest space reserve");
     }
 #endif /* CONFIG_USE_GUEST_BASE */
 
@@ -3917,6 +3975,7 @@ int main(int argc, char **argv, char **envp)
         printf("Error while loading %s: %s\n", filename, strerror(-ret));
         _exit(1);
     }
+    startup_profile_mark("image loading");
 
     for (wrk = target_environ; *wrk; wrk++) {
         free(*wrk);
@@ -4282,6 +4341,7 @@ int main(int argc, char **argv, char **envp)
         }
         gdb_handlesig(cpu, 0);
     }
+    startup_profile_mark("cpu setup");
     cpu_loop(env);
     /* never exits */
     return 0;
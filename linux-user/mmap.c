@@ -25,6 +25,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <linux/mman.h>
 #include <linux/unistd.h>
 
@@ -34,6 +35,23 @@
 
 //#define DEBUG_MMAP
 
+/* Anonymous private guest mappings at least this large are advised as
+ * transparent huge page candidates (-huge-pages) and are listed in the
+ * -strace-summary report.  */
+#define LARGE_MAPPING_SIZE (2 * 1024 * 1024)
+
+int mmap_huge_pages;
+int mmap_prefault;
+
+typedef struct LargeMapping {
+    abi_ulong start;
+    abi_ulong len;
+    QTAILQ_ENTRY(LargeMapping) entry;
+} LargeMapping;
+
+static QTAILQ_HEAD(, LargeMapping) large_mappings =
+    QTAILQ_HEAD_INITIALIZER(large_mappings);
+
 static pthread_mutex_t mmap_mutex = PTHREAD_MUTEX_INITIALIZER;
 static __thread int mmap_lock_count;
 
@@ -367,6 +385,80 @@ abi_ulong mmap_find_vma(abi_ulong start, abi_ulong size)
     }
 }
 
+/* Called with mmap_lock held.  */
+static void large_mapping_add(abi_ulong start, abi_ulong len)
+{
+    abi_ulong host_start, host_end;
+    LargeMapping *lm;
+
+    /* Only advise the host pages that belong entirely to this mapping;
+     * partial host pages may be shared with guest pages that have
+     * other attributes.  */
+    host_start = HOST_PAGE_ALIGN(start);
+    host_end = (start + len) & qemu_host_page_mask;
+    if (mmap_huge_pages && host_start < host_end) {
+        qemu_madvise(g2h(host_start), host_end - host_start,
+                     QEMU_MADV_HUGEPAGE);
+    }
+
+    if (do_strace_summary) {
+        lm = g_malloc(sizeof(*lm));
+        lm->start = start;
+        lm->len = len;
+        QTAILQ_INSERT_TAIL(&large_mappings, lm, entry);
+    }
+}
+
+/* Called with mmap_lock held.  */
+static void large_mapping_remove(abi_ulong start, abi_ulong len)
+{
+    LargeMapping *lm, *next;
+
+    QTAILQ_FOREACH_SAFE(lm, &large_mappings, entry, next) {
+        if (lm->start < start + len && start < lm->start + lm->len) {
+            QTAILQ_REMOVE(&large_mappings, lm, entry);
+            g_free(lm);
+        }
+    }
+}
+
+/* Host faults cannot be attributed to a given mapping, so report the
+ * number of host pages each large mapping made resident, which is the
+ * number of first-touch faults it took, along with the process totals.  */
+void print_mmap_summary(void)
+{
+    unsigned long i, pages, resident;
+    struct rusage usage;
+    unsigned char *vec;
+    abi_ulong start, end;
+    LargeMapping *lm;
+
+    mmap_lock();
+    QTAILQ_FOREACH(lm, &large_mappings, entry) {
+        start = lm->start & ~(qemu_real_host_page_size - 1);
+        end = (lm->start + lm->len + qemu_real_host_page_size - 1)
+              & ~(qemu_real_host_page_size - 1);
+        pages = (end - start) / qemu_real_host_page_size;
+        vec = g_malloc(pages);
+        resident = 0;
+        if (mincore(g2h(start), end - start, vec) == 0) {
+            for (i = 0; i < pages; i++) {
+                resident += vec[i] & 1;
+            }
+        }
+        g_free(vec);
+        gemu_log("mapping 0x" TARGET_ABI_FMT_lx "-0x" TARGET_ABI_FMT_lx
+                 ": %lu/%lu host pages faulted in\n",
+                 lm->start, lm->start + lm->len, resident, pages);
+    }
+    mmap_unlock();
+
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        gemu_log("host page faults: %ld minor, %ld major\n",
+                 usage.ru_minflt, usage.ru_majflt);
+    }
+}
+
 /* NOTE: all the constants are the HOST ones */
 abi_long target_mmap(abi_ulong start, abi_ulong len, int prot,
                      int flags, int fd, abi_ulong offset)
@@ -569,6 +661,11 @@ abi_long target_mmap(abi_ulong start, abi_ulong len, int prot,
     }
  the_end1:
     page_set_flags(start, start + len, prot | PAGE_VALID);
+    if ((mmap_huge_pages || do_strace_summary)
+        && (flags & MAP_ANONYMOUS) && (flags & MAP_TYPE) == MAP_PRIVATE
+        && len >= LARGE_MAPPING_SIZE) {
+        large_mapping_add(start, len);
+    }
  the_end:
 #ifdef DEBUG_MMAP
     printf("ret=0x" TARGET_ABI_FMT_lx "\n", start);
@@ -684,6 +781,7 @@ int target_munmap(abi_ulong start, abi_ulong len)
     if (ret == 0) {
         page_set_flags(start, start + len, 0);
         tb_invalidate_phys_range(start, start + len, 0);
+        large_mapping_remove(start, len);
     }
     mmap_unlock();
     return ret;
@@ -761,6 +859,7 @@ abi_long target_mremap(abi_ulong old_addr, abi_ulong old_size,
         prot = page_get_flags(old_addr);
         page_set_flags(old_addr, old_addr + old_size, 0);
         page_set_flags(new_addr, new_addr + new_size, prot | PAGE_VALID);
+        large_mapping_remove(old_addr, old_size);
     }
     tb_invalidate_phys_range(new_addr, new_addr + new_size, 0);
     mmap_unlock();
@@ -18,6 +18,7 @@
 #include "syscall.h"
 #include "exec/gdbstub.h"
 #include "qemu/queue.h"
+#include "qemu/bitops.h"
 
 #define THREAD __thread
 
@@ -84,6 +85,7 @@ struct vm86_saved_state {
 struct sigqueue {
     struct sigqueue *next;
     target_siginfo_t info;
+    int64_t queued_ns; /* host time at which the signal was queued */
 };
 
 struct emulated_sigtable {
@@ -130,6 +132,9 @@ typedef struct TaskState {
     struct linux_binprm *bprm;
 
     struct emulated_sigtable sigtab[TARGET_NSIG];
+    /* bit N set when sigtab[N] is pending, so that the lowest pending
+       signal is found without scanning the whole table */
+    unsigned long sigtab_pending[BITS_TO_LONGS(TARGET_NSIG)];
     struct sigqueue sigqueue_table[MAX_SIGQUEUE_SIZE]; /* siginfo queue */
     struct sigqueue *first_free; /* first free siginfo queue entry */
     int signal_pending; /* non zero if a signal may be pending */
@@ -215,6 +220,14 @@ unsigned long init_guest_space(unsigned long host_start,
                                unsigned long guest_start,
                                bool fixed);
 
+/* File in which the guest_base chosen for each main executable is
+ * remembered across runs, or NULL.  */
+extern const char *guest_base_cache;
+
+/* Report the time spent since the previous mark when the start-up
+ * profile is enabled.  */
+void startup_profile_mark(const char *phase);
+
 #include "qemu/log.h"
 
 /* syscall.c */
@@ -227,6 +240,9 @@ void print_syscall(int num,
                    abi_long arg4, abi_long arg5, abi_long arg6);
 void print_syscall_ret(int num, abi_long arg1);
 extern int do_strace;
+void record_syscall_stat(int num, abi_long ret, int64_t ns);
+void print_syscall_summary(void);
+extern int do_strace_summary;
 
 /* signal.c */
 void process_pending_signals(CPUArchState *cpu_env);
@@ -239,6 +255,7 @@ int host_to_target_signal(int sig);
 long do_sigreturn(CPUArchState *env);
 long do_rt_sigreturn(CPUArchState *env);
 abi_long do_sigaltstack(abi_ulong uss_addr, abi_ulong uoss_addr, abi_ulong sp);
+void print_signal_summary(void);
 
 #ifdef TARGET_I386
 /* vm86.c */
@@ -262,6 +279,9 @@ abi_long target_mremap(abi_ulong old_addr, abi_ulong old_size,
 int target_msync(abi_ulong start, abi_ulong len, int flags);
 extern unsigned long last_brk;
 extern abi_ulong mmap_next_start;
+extern int mmap_huge_pages;
+extern int mmap_prefault;
+void print_mmap_summary(void);
 void mmap_lock(void);
 void mmap_unlock(void);
 abi_ulong mmap_find_vma(abi_ulong, abi_ulong);
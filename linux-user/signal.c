@@ -28,6 +28,8 @@
 
 #include "qemu.h"
 #include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/timer.h"
 #include "target_signal.h"
 
 //#define DEBUG_SIGNAL
@@ -435,6 +437,43 @@ static void QEMU_NORETURN force_sig(int target_sig)
     abort();
 }
 
+/* Delivery latency of each guest signal, from the moment it is queued
+   to the moment its frame is set up, reported with -strace-summary.  */
+static struct {
+    uint64_t count;
+    int64_t total_ns;
+    int64_t max_ns;
+} signal_latency[TARGET_NSIG];
+
+static void record_signal_latency(int sig, int64_t ns)
+{
+    int64_t max;
+
+    atomic_inc(&signal_latency[sig - 1].count);
+    atomic_add(&signal_latency[sig - 1].total_ns, ns);
+    do {
+        max = signal_latency[sig - 1].max_ns;
+    } while (ns > max &&
+             atomic_cmpxchg(&signal_latency[sig - 1].max_ns, max, ns) != max);
+}
+
+void print_signal_summary(void)
+{
+    int sig;
+
+    for (sig = 1; sig <= TARGET_NSIG; sig++) {
+        if (signal_latency[sig - 1].count == 0) {
+            continue;
+        }
+        gemu_log("signal %d: delivered %" PRIu64 ", usecs/delivery %" PRId64
+                 ", max usecs %" PRId64 "\n", sig,
+                 signal_latency[sig - 1].count,
+                 signal_latency[sig - 1].total_ns /
+                 (int64_t)signal_latency[sig - 1].count / 1000,
+                 signal_latency[sig - 1].max_ns / 1000);
+    }
+}
+
 /* queue a signal so that it will be send to the virtual CPU as soon
    as possible */
 int queue_signal(CPUArchState *env, int sig, target_siginfo_t *info)
@@ -494,7 +533,9 @@ int queue_signal(CPUArchState *env, int sig, target_siginfo_t *info)
         *pq = q;
         q->info = *info;
         q->next = NULL;
+        q->queued_ns = do_strace_summary ? get_clock() : 0;
         k->pending = 1;
+        set_bit(sig - 1, ts->sigtab_pending);
         /* signal that a new signal is pending */
         ts->signal_pending = 1;
         return 1; /* indicates that the signal was queued */
@@ -5663,26 +5704,35 @@ void process_pending_signals(CPUArchState *cpu_env)
     if (!ts->signal_pending)
         return;
 
-    /* FIXME: This is not threadsafe.  */
-    k = ts->sigtab;
-    for(sig = 1; sig <= TARGET_NSIG; sig++) {
-        if (k->pending)
-            goto handle_signal;
-        k++;
+    /* host_signal_handler queues signals into the same table with plain
+       read-modify-writes, so keep it out until the signal is dequeued.
+       FIXME: This is still not threadsafe.  */
+    sigfillset(&set);
+    sigprocmask(SIG_SETMASK, &set, &old_set);
+    sig = find_first_bit(ts->sigtab_pending, TARGET_NSIG) + 1;
+    if (sig > TARGET_NSIG) {
+        /* if no signal is pending, just return */
+        ts->signal_pending = 0;
+        sigprocmask(SIG_SETMASK, &old_set, NULL);
+        return;
     }
-    /* if no signal is pending, just return */
-    ts->signal_pending = 0;
-    return;
+    k = &ts->sigtab[sig - 1];
 
- handle_signal:
 #ifdef DEBUG_SIGNAL
     fprintf(stderr, "qemu: process signal %d\n", sig);
 #endif
     /* dequeue signal */
     q = k->first;
     k->first = q->next;
-    if (!k->first)
+    if (!k->first) {
         k->pending = 0;
+        clear_bit(sig - 1, ts->sigtab_pending);
+    }
+    sigprocmask(SIG_SETMASK, &old_set, NULL);
+
+    if (do_strace_summary) {
+        record_signal_latency(sig, get_clock() - q->queued_ns);
+    }
 
     sig = gdb_handlesig(cpu, sig);
     if (!sig) {
@@ -10,6 +10,7 @@
 #include <unistd.h>
 #include <sched.h>
 #include "qemu.h"
+#include "qemu/host-utils.h"
 
 int do_strace=0;
 
@@ -1626,3 +1627,182 @@ print_syscall_ret(int num, abi_long ret)
             break;
         }
 }
+
+/*
+ * Syscall summary (-strace-summary): per-thread counters updated on the
+ * syscall path without any formatting, and reported once at exit in the
+ * fashion of "strace -c".
+ */
+
+int do_strace_summary;
+
+#define SYSCALL_STATS_SIZE      1024    /* must be a power of 2 */
+#define SYSCALL_STATS_BUCKETS   32      /* log2(ns) latency histogram */
+
+struct syscall_stat {
+    int num;
+    uint64_t count;
+    uint64_t errors;
+    int64_t total_ns;
+    int64_t max_ns;
+    uint64_t histogram[SYSCALL_STATS_BUCKETS];
+};
+
+struct syscall_stats {
+    struct syscall_stat stats[SYSCALL_STATS_SIZE];
+    QLIST_ENTRY(syscall_stats) next;
+};
+
+static QLIST_HEAD(, syscall_stats) syscall_stats_list =
+    QLIST_HEAD_INITIALIZER(syscall_stats_list);
+static pthread_mutex_t syscall_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static THREAD struct syscall_stats *thread_syscall_stats;
+
+static struct syscall_stat *syscall_stat_slot(struct syscall_stats *stats,
+                                              int num)
+{
+    unsigned int i, index = num & (SYSCALL_STATS_SIZE - 1);
+
+    for (i = 0; i < SYSCALL_STATS_SIZE; i++) {
+        struct syscall_stat *stat = &stats->stats[index];
+
+        if (stat->num == num || stat->count == 0) {
+            stat->num = num;
+            return stat;
+        }
+        index = (index + 1) & (SYSCALL_STATS_SIZE - 1);
+    }
+
+    return NULL;
+}
+
+void record_syscall_stat(int num, abi_long ret, int64_t ns)
+{
+    struct syscall_stats *stats = thread_syscall_stats;
+    struct syscall_stat *stat;
+
+    if (stats == NULL) {
+        stats = g_malloc0(sizeof(*stats));
+        pthread_mutex_lock(&syscall_stats_lock);
+        QLIST_INSERT_HEAD(&syscall_stats_list, stats, next);
+        pthread_mutex_unlock(&syscall_stats_lock);
+        thread_syscall_stats = stats;
+    }
+
+    stat = syscall_stat_slot(stats, num);
+    if (stat == NULL) {
+        return;
+    }
+
+    stat->count++;
+    if ((abi_ulong)ret >= (abi_ulong)-4096) {
+        stat->errors++;
+    }
+    stat->total_ns += ns;
+    if (ns > stat->max_ns) {
+        stat->max_ns = ns;
+    }
+    stat->histogram[MIN(64 - clz64(ns | 1) - 1, SYSCALL_STATS_BUCKETS - 1)]++;
+}
+
+static int syscall_stat_cmp(const void *a, const void *b)
+{
+    const struct syscall_stat *sa = a, *sb = b;
+
+    if (sa->total_ns != sb->total_ns) {
+        return sa->total_ns < sb->total_ns ? 1 : -1;
+    }
+    return sa->num - sb->num;
+}
+
+void print_syscall_summary(void)
+{
+    struct syscall_stats *stats, *total;
+    struct syscall_stat *stat, *sum;
+    uint64_t calls = 0, errors = 0;
+    int64_t total_ns = 0;
+    int i, j, n = 0;
+
+    total = g_malloc0(sizeof(*total));
+
+    /* Threads still running may keep updating their own counters; the
+     * summary is only meant to be exact at process exit.  */
+    pthread_mutex_lock(&syscall_stats_lock);
+    QLIST_FOREACH(stats, &syscall_stats_list, next) {
+        for (i = 0; i < SYSCALL_STATS_SIZE; i++) {
+            stat = &stats->stats[i];
+            if (stat->count == 0) {
+                continue;
+            }
+            sum = syscall_stat_slot(total, stat->num);
+            if (sum == NULL) {
+                continue;
+            }
+            sum->count += stat->count;
+            sum->errors += stat->errors;
+            sum->total_ns += stat->total_ns;
+            sum->max_ns = MAX(sum->max_ns, stat->max_ns);
+            for (j = 0; j < SYSCALL_STATS_BUCKETS; j++) {
+                sum->histogram[j] += stat->histogram[j];
+            }
+        }
+    }
+    pthread_mutex_unlock(&syscall_stats_lock);
+
+    for (i = 0; i < SYSCALL_STATS_SIZE; i++) {
+        if (total->stats[i].count != 0) {
+            total->stats[n++] = total->stats[i];
+            total_ns += total->stats[i].total_ns;
+        }
+    }
+    qsort(total->stats, n, sizeof(total->stats[0]), syscall_stat_cmp);
+
+    gemu_log("%6s %11s %11s %11s %9s %9s %s\n", "% time", "seconds",
+             "usecs/call", "max usecs", "calls", "errors", "syscall");
+    for (i = 0; i < n; i++) {
+        const char *name;
+
+        stat = &total->stats[i];
+        name = get_syscall_name(stat->num);
+        gemu_log("%6.2f %11.6f %11" PRId64 " %11" PRId64 " %9" PRIu64
+                 " %9" PRIu64 " ",
+                 total_ns ? 100.0 * stat->total_ns / total_ns : 0.0,
+                 stat->total_ns / 1e9,
+                 stat->total_ns / (int64_t)stat->count / 1000,
+                 stat->max_ns / 1000, stat->count, stat->errors);
+        if (name) {
+            gemu_log("%s\n", name);
+        } else {
+            gemu_log("syscall_%d\n", stat->num);
+        }
+        calls += stat->count;
+        errors += stat->errors;
+    }
+    gemu_log("%6s %11.6f %11s %11s %9" PRIu64 " %9" PRIu64 " total\n",
+             "100.00", total_ns / 1e9, "", "", calls, errors);
+
+    /* Latency histograms: bucket N counts the calls that took between
+     * 2^N and 2^(N+1) nanoseconds.  */
+    for (i = 0; i < n; i++) {
+        const char *name;
+
+        stat = &total->stats[i];
+        name = get_syscall_name(stat->num);
+        if (name) {
+            gemu_log("%s:", name);
+        } else {
+            gemu_log("syscall_%d:", stat->num);
+        }
+        for (j = 0; j < SYSCALL_STATS_BUCKETS; j++) {
+            if (stat->histogram[j] != 0) {
+                gemu_log(" 2^%d:%" PRIu64, j, stat->histogram[j]);
+            }
+        }
+        gemu_log("\n");
+    }
+
+    g_free(total);
+
+    print_signal_summary();
+    print_mmap_summary();
+}
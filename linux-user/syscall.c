@@ -111,6 +111,7 @@ int __clone2(int (*fn)(void *), void *child_stack_base,
 #include "cpu-uname.h"
 
 #include "qemu.h"
+#include "qemu/timer.h"
 
 /* Enable syscall forward compatibility if requested. */
 #include "syscall_fwd_compat.h"
@@ -654,7 +655,9 @@ abi_long do_brk(abi_ulong new_brk)
     new_alloc_size = HOST_PAGE_ALIGN(new_brk - brk_page);
     mapped_addr = get_errno(target_mmap(brk_page, new_alloc_size,
                                         PROT_READ|PROT_WRITE,
-                                        MAP_ANON|MAP_PRIVATE, 0, 0));
+                                        MAP_ANON|MAP_PRIVATE|
+                                        (mmap_prefault ? MAP_POPULATE : 0),
+                                        0, 0));
 
     if (mapped_addr == brk_page) {
         /* Heap contents are initialized to zero, as for anonymous
@@ -692,11 +695,33 @@ abi_long do_brk(abi_ulong new_brk)
     return target_brk;
 }
 
+/* Per-thread scratch buffer for the event syscalls (poll, epoll_wait)
+ * which need a host copy of a guest array: it is grown on demand and
+ * reused, rather than allocated on every call.  */
+static THREAD void *syscall_scratch;
+static THREAD size_t syscall_scratch_size;
+
+static void *get_syscall_scratch(size_t size)
+{
+    if (size > syscall_scratch_size) {
+        syscall_scratch = g_realloc(syscall_scratch, size);
+        syscall_scratch_size = size;
+    }
+    return syscall_scratch;
+}
+
+/* fd_set is an array of longs on Linux hosts; when the guest uses the
+ * same word size and byte order the bitmap is copied as is, otherwise
+ * only the set bits are converted.  */
+#if TARGET_ABI_BITS == HOST_LONG_BITS && !defined(BSWAP_NEEDED)
+#define FDSET_SAME_LAYOUT
+#endif
+
 static inline abi_long copy_from_user_fdset(fd_set *fds,
                                             abi_ulong target_fds_addr,
                                             int n)
 {
-    int i, nw, j, k;
+    int i, nw;
     abi_ulong b, *target_fds;
 
     nw = (n + TARGET_ABI_BITS - 1) / TARGET_ABI_BITS;
@@ -707,15 +732,24 @@ static inline abi_long copy_from_user_fdset(fd_set *fds,
         return -TARGET_EFAULT;
 
     FD_ZERO(fds);
-    k = 0;
+#ifdef FDSET_SAME_LAYOUT
+    if (nw * sizeof(abi_ulong) <= sizeof(*fds)) {
+        memcpy(fds, target_fds, nw * sizeof(abi_ulong));
+        unlock_user(target_fds, target_fds_addr, 0);
+        return 0;
+    }
+#endif
     for (i = 0; i < nw; i++) {
         /* grab the abi_ulong */
         __get_user(b, &target_fds[i]);
-        for (j = 0; j < TARGET_ABI_BITS; j++) {
-            /* check the bit inside the abi_ulong */
-            if ((b >> j) & 1)
-                FD_SET(k, fds);
-            k++;
+        while (b) {
+            /* check the bits set inside the abi_ulong */
+            int k = i * TARGET_ABI_BITS + ctz64(b);
+            if (k >= n) {
+                break;
+            }
+            FD_SET(k, fds);
+            b &= b - 1;
         }
     }
 
@@ -742,9 +776,10 @@ static inline abi_long copy_to_user_fdset(abi_ulong target_fds_addr,
                                           const fd_set *fds,
                                           int n)
 {
-    int i, nw, j, k;
-    abi_long v;
+    int i, nw, k;
     abi_ulong *target_fds;
+    unsigned long b;
+    const unsigned long *host_fds = (const unsigned long *)fds;
 
     nw = (n + TARGET_ABI_BITS - 1) / TARGET_ABI_BITS;
     if (!(target_fds = lock_user(VERIFY_WRITE,
@@ -753,14 +788,27 @@ static inline abi_long copy_to_user_fdset(abi_ulong target_fds_addr,
                                  0)))
         return -TARGET_EFAULT;
 
-    k = 0;
-    for (i = 0; i < nw; i++) {
-        v = 0;
-        for (j = 0; j < TARGET_ABI_BITS; j++) {
-            v |= ((abi_ulong)(FD_ISSET(k, fds) != 0) << j);
-            k++;
+#ifdef FDSET_SAME_LAYOUT
+    if (nw * sizeof(abi_ulong) <= sizeof(*fds)) {
+        memcpy(target_fds, fds, nw * sizeof(abi_ulong));
+        unlock_user(target_fds, target_fds_addr, sizeof(abi_ulong) * nw);
+        return 0;
+    }
+#endif
+    memset(target_fds, 0, sizeof(abi_ulong) * nw);
+    for (i = 0; i * HOST_LONG_BITS < n
+                && i < sizeof(*fds) / sizeof(unsigned long); i++) {
+        b = host_fds[i];
+        while (b) {
+            /* set the guest bit of each host bit set */
+            k = i * HOST_LONG_BITS + ctz64(b);
+            if (k >= n) {
+                break;
+            }
+            target_fds[k / TARGET_ABI_BITS] |=
+                tswapal((abi_ulong)1 << (k % TARGET_ABI_BITS));
+            b &= b - 1;
         }
-        __put_user(v, &target_fds[i]);
     }
 
     unlock_user(target_fds, target_fds_addr, sizeof(abi_ulong) * nw);
@@ -5289,12 +5337,16 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
     struct stat st;
     struct statfs stfs;
     void *p;
+    int64_t start_ns = 0;
 
 #ifdef DEBUG
     gemu_log("syscall %d", num);
 #endif
     if(do_strace)
         print_syscall(num, arg1, arg2, arg3, arg4, arg5, arg6);
+    if (do_strace_summary) {
+        start_ns = get_clock();
+    }
 
     switch(num) {
     case TARGET_NR_exit:
@@ -5320,11 +5372,15 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
             thread_cpu = NULL;
             object_unref(OBJECT(ENV_GET_CPU(cpu_env)));
             g_free(ts);
+            g_free(syscall_scratch);
             pthread_exit(NULL);
         }
 #ifdef TARGET_GPROF
         _mcleanup();
 #endif
+        if (do_strace_summary) {
+            print_syscall_summary();
+        }
         gdb_exit(cpu_env, arg1);
         _exit(arg1);
         ret = 0; /* avoid warning */
@@ -7140,6 +7196,9 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
 #ifdef TARGET_GPROF
         _mcleanup();
 #endif
+        if (do_strace_summary) {
+            print_syscall_summary();
+        }
         gdb_exit(cpu_env, arg1);
         ret = get_errno(exit_group(arg1));
         break;
@@ -7411,15 +7470,29 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
             int timeout = arg3;
             struct pollfd *pfd;
             unsigned int i;
+            bool same_layout;
 
             target_pfd = lock_user(VERIFY_WRITE, arg1, sizeof(struct target_pollfd) * nfds, 1);
             if (!target_pfd)
                 goto efault;
 
-            pfd = alloca(sizeof(struct pollfd) * nfds);
-            for(i = 0; i < nfds; i++) {
-                pfd[i].fd = tswap32(target_pfd[i].fd);
-                pfd[i].events = tswap16(target_pfd[i].events);
+            /* Without byte swapping the guest array is a valid host
+               one, and the host fills the revents fields in place.  */
+#ifdef BSWAP_NEEDED
+            same_layout = false;
+#else
+            same_layout = sizeof(struct target_pollfd) == sizeof(struct pollfd)
+                && offsetof(struct target_pollfd, revents)
+                   == offsetof(struct pollfd, revents);
+#endif
+            if (same_layout) {
+                pfd = (struct pollfd *)target_pfd;
+            } else {
+                pfd = get_syscall_scratch(sizeof(struct pollfd) * nfds);
+                for(i = 0; i < nfds; i++) {
+                    pfd[i].fd = tswap32(target_pfd[i].fd);
+                    pfd[i].events = tswap16(target_pfd[i].events);
+                }
             }
 
 # ifdef TARGET_NR_ppoll
@@ -7460,7 +7533,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
 # endif
                 ret = get_errno(poll(pfd, nfds, timeout));
 
-            if (!is_error(ret)) {
+            if (!is_error(ret) && !same_layout) {
                 for(i = 0; i < nfds; i++) {
                     target_pfd[i].revents = tswap16(pfd[i].revents);
                 }
@@ -9118,6 +9191,13 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         int epfd = arg1;
         int maxevents = arg3;
         int timeout = arg4;
+        bool same_layout;
+
+        if (maxevents <= 0 ||
+            maxevents > INT_MAX / sizeof(struct target_epoll_event)) {
+            ret = -TARGET_EINVAL;
+            break;
+        }
 
         target_ep = lock_user(VERIFY_WRITE, arg2,
                               maxevents * sizeof(struct target_epoll_event), 1);
@@ -9125,7 +9205,21 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
             goto efault;
         }
 
-        ep = alloca(maxevents * sizeof(struct epoll_event));
+        /* The events are written straight into the guest array when
+           the guest and host structures are identical.  */
+#ifdef BSWAP_NEEDED
+        same_layout = false;
+#else
+        same_layout = sizeof(struct target_epoll_event)
+                      == sizeof(struct epoll_event)
+            && offsetof(struct target_epoll_event, data)
+               == offsetof(struct epoll_event, data);
+#endif
+        if (same_layout) {
+            ep = (struct epoll_event *)target_ep;
+        } else {
+            ep = get_syscall_scratch(maxevents * sizeof(struct epoll_event));
+        }
 
         switch (num) {
 #if defined(IMPLEMENT_EPOLL_PWAIT)
@@ -9159,14 +9253,15 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         default:
             ret = -TARGET_ENOSYS;
         }
-        if (!is_error(ret)) {
+        if (!is_error(ret) && !same_layout) {
             int i;
             for (i = 0; i < ret; i++) {
                 target_ep[i].events = tswap32(ep[i].events);
                 target_ep[i].data.u64 = tswap64(ep[i].data.u64);
             }
         }
-        unlock_user(target_ep, arg2, ret * sizeof(struct target_epoll_event));
+        unlock_user(target_ep, arg2,
+                    is_error(ret) ? 0 : ret * sizeof(struct target_epoll_event));
         break;
     }
 #endif
@@ -9256,6 +9351,9 @@ fail:
 #endif
     if(do_strace)
         print_syscall_ret(num, ret);
+    if (do_strace_summary) {
+        record_syscall_stat(num, ret, get_clock() - start_ns);
+    }
     return ret;
 efault:
     ret = -TARGET_EFAULT;
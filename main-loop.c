@@ -452,6 +452,18 @@ static int os_host_main_loop_wait(int64_t timeout)
 }
 #endif
 
+/* Number of times main_loop_wait returned from polling */
+static uint64_t main_loop_wakeups;
+
+void qemu_main_loop_get_stats(uint64_t *wakeups, uint64_t *bh_runs,
+                              uint64_t *timers_fired)
+{
+    *wakeups = main_loop_wakeups;
+    *bh_runs = qemu_aio_context->bh_runs;
+    *timers_fired = timerlistgroup_timers_fired(&main_loop_tlg) +
+                    timerlistgroup_timers_fired(&qemu_aio_context->tlg);
+}
+
 int main_loop_wait(int nonblocking)
 {
     int ret;
@@ -481,6 +493,7 @@ int main_loop_wait(int nonblocking)
                                           &main_loop_tlg));
 
     ret = os_host_main_loop_wait(timeout_ns);
+    main_loop_wakeups++;
     qemu_iohandler_poll(gpollfds, ret);
 #ifdef CONFIG_SLIRP
     slirp_pollfds_poll(gpollfds, (ret < 0));
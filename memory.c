@@ -18,6 +18,7 @@
 #include "exec/ioport.h"
 #include "qemu/bitops.h"
 #include "qom/object.h"
+#include "qemu/main-loop.h"
 #include "trace.h"
 #include <assert.h>
 
@@ -598,6 +599,138 @@ static FlatView *generate_memory_topology(MemoryRegion *mr)
     return view;
 }
 
+/* Render again the part @clip of an address space, reusing the ranges of
+ * @old outside of it.  render_memory_region() is quadratic in the number
+ * of ranges it produces, so only the changed part goes through it.
+ */
+static FlatView *regenerate_memory_topology(MemoryRegion *mr, FlatView *old,
+                                            AddrRange clip)
+{
+    FlatView *view, *mid;
+    FlatRange *fr, tmp;
+    Int128 end = addrrange_end(clip);
+    Int128 delta;
+    unsigned i;
+
+    view = g_new(FlatView, 1);
+    flatview_init(view);
+
+    /* Ranges before the clip, truncated at its start.  */
+    FOR_EACH_FLAT_RANGE(fr, old) {
+        if (int128_ge(fr->addr.start, clip.start)) {
+            break;
+        }
+        tmp = *fr;
+        if (int128_gt(addrrange_end(tmp.addr), clip.start)) {
+            tmp.addr.size = int128_sub(clip.start, tmp.addr.start);
+        }
+        flatview_insert(view, view->nr, &tmp);
+    }
+
+    mid = g_new(FlatView, 1);
+    flatview_init(mid);
+    if (mr) {
+        render_memory_region(mid, mr, int128_zero(), clip, false);
+    }
+    for (i = 0; i < mid->nr; i++) {
+        flatview_insert(view, view->nr, &mid->ranges[i]);
+    }
+    flatview_unref(mid);
+
+    /* Ranges after the clip, with their start moved to its end.  */
+    FOR_EACH_FLAT_RANGE(fr, old) {
+        if (int128_le(addrrange_end(fr->addr), end)) {
+            continue;
+        }
+        tmp = *fr;
+        if (int128_lt(tmp.addr.start, end)) {
+            delta = int128_sub(end, tmp.addr.start);
+            tmp.offset_in_region += int128_get64(delta);
+            tmp.addr = addrrange_make(end, int128_sub(tmp.addr.size, delta));
+        }
+        flatview_insert(view, view->nr, &tmp);
+    }
+
+    flatview_simplify(view);
+
+    return view;
+}
+
+static void address_space_mark_update(AddressSpace *as, AddrRange range)
+{
+    Int128 end = addrrange_end(range);
+
+    if (!as->update_pending) {
+        as->update_pending = true;
+        as->update_start = range.start;
+        as->update_end = end;
+    } else {
+        as->update_start = int128_min(as->update_start, range.start);
+        as->update_end = int128_max(as->update_end, end);
+    }
+}
+
+/* Record that [@start, @start + @size) of @mr, in the region's own
+ * coordinates, changed.  The range is propagated to every address space
+ * where it is visible, through parents as well as aliases.
+ */
+static void memory_region_mark_update(MemoryRegion *mr, Int128 start,
+                                      Int128 size)
+{
+    AddrRange range = addrrange_make(start, size);
+    AddrRange window;
+    MemoryRegion *alias;
+    AddressSpace *as;
+
+    if (!mr->enabled || !int128_nz(size)) {
+        return;
+    }
+    window = addrrange_make(int128_zero(), mr->size);
+    if (!addrrange_intersects(range, window)) {
+        return;
+    }
+    range = addrrange_intersection(range, window);
+
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        if (as->root == mr) {
+            address_space_mark_update(as, range);
+        }
+    }
+
+    QTAILQ_FOREACH(alias, &mr->aliases, aliases_link) {
+        window = addrrange_make(int128_make64(alias->alias_offset),
+                                alias->size);
+        if (addrrange_intersects(range, window)) {
+            window = addrrange_intersection(range, window);
+            memory_region_mark_update(alias,
+                                      int128_sub(window.start,
+                                          int128_make64(alias->alias_offset)),
+                                      window.size);
+        }
+    }
+
+    if (mr->parent) {
+        memory_region_mark_update(mr->parent,
+                                  int128_add(range.start,
+                                             int128_make64(mr->addr)),
+                                  range.size);
+    }
+}
+
+/* A change of @mr's attributes: all of it must be rendered again.  */
+static void memory_region_mark_update_all(MemoryRegion *mr)
+{
+    memory_region_mark_update(mr, int128_zero(), mr->size);
+}
+
+/* @subregion was added to, removed from or enabled/disabled in @mr.  */
+static void memory_region_mark_update_subregion(MemoryRegion *mr,
+                                                MemoryRegion *subregion)
+{
+    memory_region_mark_update(mr, int128_make64(subregion->addr),
+                              subregion->size);
+}
+
 static void address_space_add_del_ioeventfds(AddressSpace *as,
                                              MemoryRegionIoeventfd *fds_new,
                                              unsigned fds_new_nb,
@@ -758,7 +891,22 @@ static void address_space_update_topology_pass(AddressSpace *as,
 static void address_space_update_topology(AddressSpace *as)
 {
     FlatView *old_view = address_space_get_flatview(as);
-    FlatView *new_view = generate_memory_topology(as->root);
+    FlatView *new_view;
+
+    if (!as->update_pending) {
+        /* Listeners still expect region_nop for every range.  */
+        new_view = old_view;
+        flatview_ref(new_view);
+    } else if (int128_eq(as->update_start, int128_zero())
+               && int128_ge(as->update_end, int128_2_64())) {
+        new_view = generate_memory_topology(as->root);
+    } else {
+        AddrRange clip = addrrange_make(as->update_start,
+                                        int128_sub(as->update_end,
+                                                   as->update_start));
+        new_view = regenerate_memory_topology(as->root, old_view, clip);
+    }
+    as->update_pending = false;
 
     address_space_update_topology_pass(as, old_view, new_view, false);
     address_space_update_topology_pass(as, old_view, new_view, true);
@@ -814,6 +962,7 @@ static void memory_region_destructor_ram(MemoryRegion *mr)
 
 static void memory_region_destructor_alias(MemoryRegion *mr)
 {
+    QTAILQ_REMOVE(&mr->alias->aliases, mr, aliases_link);
     memory_region_unref(mr->alias);
 }
 
@@ -853,6 +1002,7 @@ void memory_region_init(MemoryRegion *mr,
     mr->priority = 0;
     mr->may_overlap = false;
     mr->alias = NULL;
+    QTAILQ_INIT(&mr->aliases);
     QTAILQ_INIT(&mr->subregions);
     memset(&mr->subregions_link, 0, sizeof mr->subregions_link);
     QTAILQ_INIT(&mr->coalesced);
@@ -861,6 +1011,8 @@ void memory_region_init(MemoryRegion *mr,
     mr->ioeventfd_nb = 0;
     mr->ioeventfds = NULL;
     mr->flush_coalesced_mmio = false;
+    mr->mmio_reads = 0;
+    mr->mmio_writes = 0;
 }
 
 static uint64_t unassigned_mem_read(void *opaque, hwaddr addr,
@@ -1043,6 +1195,7 @@ void memory_region_init_alias(MemoryRegion *mr,
     mr->destructor = memory_region_destructor_alias;
     mr->alias = orig;
     mr->alias_offset = offset;
+    QTAILQ_INSERT_TAIL(&orig->aliases, mr, aliases_link);
 }
 
 void memory_region_init_rom_device(MemoryRegion *mr,
@@ -1166,6 +1319,7 @@ void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client)
 
     memory_region_transaction_begin();
     mr->dirty_log_mask = (mr->dirty_log_mask & ~mask) | (log * mask);
+    memory_region_mark_update_all(mr);
     memory_region_update_pending |= mr->enabled;
     memory_region_transaction_commit();
 }
@@ -1174,15 +1328,33 @@ bool memory_region_get_dirty(MemoryRegion *mr, hwaddr addr,
                              hwaddr size, unsigned client)
 {
     assert(mr->terminates);
-    return cpu_physical_memory_get_dirty(mr->ram_addr + addr, size,
-                                         1 << client);
+    return cpu_physical_memory_get_dirty(mr->ram_addr + addr, size, client);
 }
 
 void memory_region_set_dirty(MemoryRegion *mr, hwaddr addr,
                              hwaddr size)
 {
     assert(mr->terminates);
-    return cpu_physical_memory_set_dirty_range(mr->ram_addr + addr, size, -1);
+    cpu_physical_memory_set_dirty_range(mr->ram_addr + addr, size);
+}
+
+void memory_region_set_dirty_lebitmap(MemoryRegion *mr, hwaddr addr,
+                                      const unsigned long *bitmap,
+                                      uint64_t nr_bits, hwaddr bit_size)
+{
+    assert(mr->terminates);
+    cpu_physical_memory_set_dirty_lebitmap(bitmap, mr->ram_addr + addr,
+                                           nr_bits, bit_size);
+}
+
+hwaddr memory_region_find_dirty(MemoryRegion *mr, hwaddr addr,
+                                hwaddr size, unsigned client)
+{
+    ram_addr_t start = mr->ram_addr + addr;
+    ram_addr_t end = start + size;
+
+    assert(mr->terminates);
+    return cpu_physical_memory_find_dirty(start, end, client) - mr->ram_addr;
 }
 
 bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
@@ -1190,12 +1362,11 @@ bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
 {
     bool ret;
     assert(mr->terminates);
-    ret = cpu_physical_memory_get_dirty(mr->ram_addr + addr, size,
-                                        1 << client);
+    ret = cpu_physical_memory_get_dirty(mr->ram_addr + addr, size, client);
     if (ret) {
         cpu_physical_memory_reset_dirty(mr->ram_addr + addr,
                                         mr->ram_addr + addr + size,
-                                        1 << client);
+                                        client);
     }
     return ret;
 }
@@ -1222,6 +1393,7 @@ void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
     if (mr->readonly != readonly) {
         memory_region_transaction_begin();
         mr->readonly = readonly;
+        memory_region_mark_update_all(mr);
         memory_region_update_pending |= mr->enabled;
         memory_region_transaction_commit();
     }
@@ -1232,6 +1404,7 @@ void memory_region_rom_device_set_romd(MemoryRegion *mr, bool romd_mode)
     if (mr->romd_mode != romd_mode) {
         memory_region_transaction_begin();
         mr->romd_mode = romd_mode;
+        memory_region_mark_update_all(mr);
         memory_region_update_pending |= mr->enabled;
         memory_region_transaction_commit();
     }
@@ -1243,7 +1416,7 @@ void memory_region_reset_dirty(MemoryRegion *mr, hwaddr addr,
     assert(mr->terminates);
     cpu_physical_memory_reset_dirty(mr->ram_addr + addr,
                                     mr->ram_addr + addr + size,
-                                    1 << client);
+                                    client);
 }
 
 void *memory_region_get_ram_ptr(MemoryRegion *mr)
@@ -1456,6 +1629,9 @@ static void memory_region_add_subregion_common(MemoryRegion *mr,
     }
     QTAILQ_INSERT_TAIL(&mr->subregions, subregion, subregions_link);
 done:
+    if (subregion->enabled) {
+        memory_region_mark_update_subregion(mr, subregion);
+    }
     memory_region_update_pending |= mr->enabled && subregion->enabled;
     memory_region_transaction_commit();
 }
@@ -1487,6 +1663,9 @@ void memory_region_del_subregion(MemoryRegion *mr,
     assert(subregion->parent == mr);
     subregion->parent = NULL;
     QTAILQ_REMOVE(&mr->subregions, subregion, subregions_link);
+    if (subregion->enabled) {
+        memory_region_mark_update_subregion(mr, subregion);
+    }
     memory_region_unref(subregion);
     memory_region_update_pending |= mr->enabled && subregion->enabled;
     memory_region_transaction_commit();
@@ -1498,7 +1677,15 @@ void memory_region_set_enabled(MemoryRegion *mr, bool enabled)
         return;
     }
     memory_region_transaction_begin();
-    mr->enabled = enabled;
+    if (mr->parent) {
+        mr->enabled = enabled;
+        memory_region_mark_update_subregion(mr->parent, mr);
+    } else {
+        /* Only an enabled region propagates the update.  */
+        mr->enabled = true;
+        memory_region_mark_update_all(mr);
+        mr->enabled = enabled;
+    }
     memory_region_update_pending = true;
     memory_region_transaction_commit();
 }
@@ -1536,6 +1723,7 @@ void memory_region_set_alias_offset(MemoryRegion *mr, hwaddr offset)
 
     memory_region_transaction_begin();
     mr->alias_offset = offset;
+    memory_region_mark_update_all(mr);
     memory_region_update_pending |= mr->enabled;
     memory_region_transaction_commit();
 }
@@ -1717,6 +1905,9 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
     flatview_init(as->current_map);
     as->ioeventfd_nb = 0;
     as->ioeventfds = NULL;
+    as->update_pending = true;
+    as->update_start = int128_zero();
+    as->update_end = int128_2_64();
     QTAILQ_INSERT_TAIL(&address_spaces, as, address_spaces_link);
     as->name = g_strdup(name ? name : "anonymous");
     address_space_init_dispatch(as);
@@ -1729,6 +1920,9 @@ void address_space_destroy(AddressSpace *as)
     /* Flush out anything from MemoryListeners listening in on this */
     memory_region_transaction_begin();
     as->root = NULL;
+    as->update_pending = true;
+    as->update_start = int128_zero();
+    as->update_end = int128_2_64();
     memory_region_transaction_commit();
     QTAILQ_REMOVE(&address_spaces, as, address_spaces_link);
     address_space_destroy_dispatch(as);
@@ -1739,13 +1933,92 @@ void address_space_destroy(AddressSpace *as)
 
 bool io_mem_read(MemoryRegion *mr, hwaddr addr, uint64_t *pval, unsigned size)
 {
-    return memory_region_dispatch_read(mr, addr, pval, size);
+    bool locked = qemu_tcg_lock_iothread();
+    bool ret;
+
+    mr->mmio_reads++;
+    ret = memory_region_dispatch_read(mr, addr, pval, size);
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+    return ret;
 }
 
 bool io_mem_write(MemoryRegion *mr, hwaddr addr,
                   uint64_t val, unsigned size)
 {
-    return memory_region_dispatch_write(mr, addr, val, size);
+    bool locked = qemu_tcg_lock_iothread();
+    bool ret;
+
+    mr->mmio_writes++;
+    ret = memory_region_dispatch_write(mr, addr, val, size);
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+    return ret;
+}
+
+/* Return the mask of access sizes (1, 2, 4, 8) for which calling the
+ * region's read or write callback directly is equivalent to going
+ * through memory_region_dispatch_read/write: no validation callback,
+ * no splitting into smaller accesses and no byte swapping.  Aligned
+ * accesses of those sizes may use io_mem_read/write_direct().
+ */
+unsigned memory_region_direct_sizes(MemoryRegion *mr, bool is_write)
+{
+    const MemoryRegionOps *ops = mr->ops;
+    unsigned min, max, size, sizes = 0;
+
+    if (!ops || ops->valid.accepts || (is_write ? !ops->write : !ops->read)) {
+        return 0;
+    }
+
+    min = ops->impl.min_access_size ? ops->impl.min_access_size : 1;
+    max = ops->impl.max_access_size ? ops->impl.max_access_size : 4;
+    for (size = 1; size <= 8; size <<= 1) {
+        if (size < min || size > max) {
+            continue;
+        }
+        if (size > 1 && memory_region_wrong_endianness(mr)) {
+            continue;
+        }
+        sizes |= size;
+    }
+    return sizes;
+}
+
+uint64_t io_mem_read_direct(MemoryRegion *mr, hwaddr addr, unsigned size)
+{
+    bool locked = qemu_tcg_lock_iothread();
+    uint64_t val;
+
+    mr->mmio_reads++;
+    if (mr->flush_coalesced_mmio) {
+        qemu_flush_coalesced_mmio_buffer();
+    }
+    val = mr->ops->read(mr->opaque, addr, size) & (-1ULL >> (64 - size * 8));
+    trace_memory_region_ops_read(mr, addr, val, size);
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+    return val;
+}
+
+void io_mem_write_direct(MemoryRegion *mr, hwaddr addr,
+                         uint64_t val, unsigned size)
+{
+    bool locked = qemu_tcg_lock_iothread();
+
+    mr->mmio_writes++;
+    if (mr->flush_coalesced_mmio) {
+        qemu_flush_coalesced_mmio_buffer();
+    }
+    val &= -1ULL >> (64 - size * 8);
+    trace_memory_region_ops_write(mr, addr, val, size);
+    mr->ops->write(mr->opaque, addr, val, size);
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
 }
 
 typedef struct MemoryRegionList MemoryRegionList;
@@ -1814,7 +2087,7 @@ static void mtree_print_mr(fprintf_function mon_printf, void *f,
                                                       int128_one())) : 0));
     } else {
         mon_printf(f,
-                   TARGET_FMT_plx "-" TARGET_FMT_plx " (prio %d, %c%c): %s\n",
+                   TARGET_FMT_plx "-" TARGET_FMT_plx " (prio %d, %c%c): %s",
                    base + mr->addr,
                    base + mr->addr
                    + (int128_nz(mr->size) ?
@@ -1825,6 +2098,11 @@ static void mtree_print_mr(fprintf_function mon_printf, void *f,
                    !mr->readonly && !(mr->rom_device && mr->romd_mode) ? 'W'
                                                                        : '-',
                    mr->name);
+        if (mr->mmio_reads || mr->mmio_writes) {
+            mon_printf(f, " [%" PRIu64 " reads, %" PRIu64 " writes]",
+                       mr->mmio_reads, mr->mmio_writes);
+        }
+        mon_printf(f, "\n");
     }
 
     QTAILQ_INIT(&submr_print_queue);
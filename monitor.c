@@ -1989,6 +1989,11 @@ static void do_info_mtree(Monitor *mon, const QDict *qdict)
     mtree_info((fprintf_function)monitor_printf, mon);
 }
 
+static void do_info_ramblock(Monitor *mon, const QDict *qdict)
+{
+    dump_ram_blocks((FILE *)mon, monitor_fprintf);
+}
+
 static void do_info_numa(Monitor *mon, const QDict *qdict)
 {
     int i;
@@ -2753,9 +2758,16 @@ static mon_cmd_t info_cmds[] = {
         .name       = "mtree",
         .args_type  = "",
         .params     = "",
-        .help       = "show memory tree",
+        .help       = "show memory tree and MMIO access counts",
         .mhandler.cmd = do_info_mtree,
     },
+    {
+        .name       = "ramblock",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show RAM blocks and lookup statistics",
+        .mhandler.cmd = do_info_ramblock,
+    },
     {
         .name       = "jit",
         .args_type  = "",
@@ -106,6 +106,11 @@ static void help(void)
            "  '-n' skips the target volume creation (useful if the volume is created\n"
            "       prior to running qemu-img)\n"
            "\n"
+           "Parameters to convert subcommand:\n"
+           "  '-m' specifies how many coroutines work in parallel during the convert\n"
+           "       process (defaults to 8)\n"
+           "  '-W' allow to write to the target out of order rather than sequential\n"
+           "\n"
            "Parameters to check subcommand:\n"
            "  '-r' tries to repair any inconsistencies that are found during the check.\n"
            "       '-r leaks' repairs only cluster leaks, whereas '-r all' fixes all\n"
@@ -515,6 +520,12 @@ static int collect_image_check(BlockDriverState *bs,
     check->has_fragmented_clusters  = result.bfi.fragmented_clusters != 0;
     check->compressed_clusters      = result.bfi.compressed_clusters;
     check->has_compressed_clusters  = result.bfi.compressed_clusters != 0;
+    check->free_clusters            = result.bfi.free_clusters;
+    check->has_free_clusters        = result.bfi.free_clusters != 0;
+    check->free_extents             = result.bfi.free_extents;
+    check->has_free_extents         = result.bfi.free_extents != 0;
+    check->largest_free_extent      = result.bfi.largest_free_extent;
+    check->has_largest_free_extent  = result.bfi.largest_free_extent != 0;
 
     return 0;
 }
@@ -744,20 +755,13 @@ static int img_commit(int argc, char **argv)
 static int is_allocated_sectors(const uint8_t *buf, int n, int *pnum)
 {
     bool is_zero;
-    int i;
 
     if (n <= 0) {
         *pnum = 0;
         return 0;
     }
-    is_zero = buffer_is_zero(buf, 512);
-    for(i = 1; i < n; i++) {
-        buf += 512;
-        if (is_zero != buffer_is_zero(buf, 512)) {
-            break;
-        }
-    }
-    *pnum = i;
+    *pnum = buffer_zero_run(buf, n * BDRV_SECTOR_SIZE, BDRV_SECTOR_SIZE,
+                            &is_zero) / BDRV_SECTOR_SIZE;
     return !is_zero;
 }
 
@@ -1119,27 +1123,397 @@ out3:
     return ret;
 }
 
+#define MAX_COROUTINES 16
+
+typedef enum ImgConvertBlockStatus {
+    BLK_DATA,
+    BLK_ZERO,
+    BLK_BACKING_FILE,
+} ImgConvertBlockStatus;
+
+/*
+ * State of a conversion.  Up to num_coroutines coroutines each take the next
+ * chunk of the input, read it and write it to the target, so that reads of
+ * one chunk overlap with writes of others.  Unless wr_in_order is false,
+ * the writes are still issued in the order of the sectors.
+ */
+typedef struct ImgConvertState {
+    BlockDriverState **src;
+    int64_t *src_sectors;
+    int src_num;
+    int64_t total_sectors;
+    BlockDriverState *target;
+    bool has_zero_init;
+    bool compressed;
+    bool target_has_backing;
+    int min_sparse;
+    int cluster_sectors;
+    int buf_sectors;
+
+    /* Next chunk to hand out, and the status of the input around it */
+    CoMutex lock;
+    int64_t sector_num;
+    ImgConvertBlockStatus status;
+    int64_t sector_next_status;
+
+    /* Sector up to which the target has been written, if wr_in_order */
+    bool wr_in_order;
+    int64_t wr_offs;
+
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_sector_num[MAX_COROUTINES];
+
+    int64_t sectors_done;
+    int64_t start_time;
+    int ret;
+} ImgConvertState;
+
+static void convert_select_part(ImgConvertState *s, int64_t sector_num,
+                                int *src_cur, int64_t *src_cur_offset)
+{
+    *src_cur = 0;
+    *src_cur_offset = 0;
+    while (sector_num - *src_cur_offset >= s->src_sectors[*src_cur]) {
+        *src_cur_offset += s->src_sectors[*src_cur];
+        (*src_cur)++;
+        assert(*src_cur < s->src_num);
+    }
+}
+
+/*
+ * Returns the number of sectors starting at sector_num that the next
+ * iteration handles, and updates s->status for them.  Called with s->lock
+ * held.
+ */
+static int coroutine_fn convert_iteration_sectors(ImgConvertState *s,
+                                                  int64_t sector_num)
+{
+    BlockDriverState *bs;
+    int64_t src_cur_offset, ret;
+    int src_cur, n;
+
+    convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+    bs = s->src[src_cur];
+
+    assert(s->total_sectors > sector_num);
+    n = MIN(s->src_sectors[src_cur] - (sector_num - src_cur_offset),
+            INT_MAX >> BDRV_SECTOR_BITS);
+
+    if (s->sector_next_status <= sector_num) {
+        ret = bdrv_get_block_status(bs, sector_num - src_cur_offset, n, &n);
+        if (ret < 0) {
+            return ret;
+        }
+
+        if (s->target_has_backing &&
+            !(ret & BDRV_BLOCK_DATA) &&
+            !((ret & BDRV_BLOCK_ZERO) && !bdrv_has_zero_init(bs))) {
+            /* Unallocated in the input, so the target's backing file
+             * provides the same data */
+            s->status = BLK_BACKING_FILE;
+        } else if (ret & BDRV_BLOCK_ZERO) {
+            s->status = BLK_ZERO;
+        } else {
+            /* Either data of this image or of its backing file */
+            s->status = BLK_DATA;
+        }
+        s->sector_next_status = sector_num + n;
+    }
+
+    n = MIN(n, s->sector_next_status - sector_num);
+    if (s->status == BLK_DATA) {
+        n = MIN(n, s->buf_sectors);
+    }
+
+    /* Compressed images are written a whole cluster at a time, so an
+     * unallocated area shorter than a cluster must be copied as data */
+    if (s->compressed) {
+        if (n < s->cluster_sectors) {
+            n = MIN(s->cluster_sectors, s->total_sectors - sector_num);
+            s->status = BLK_DATA;
+            s->sector_next_status = sector_num + n;
+        } else {
+            n = n - n % s->cluster_sectors;
+        }
+    }
+
+    return n;
+}
+
+static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
+                                        int nb_sectors, uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int64_t src_cur_offset;
+    int src_cur, n, ret;
+
+    assert(nb_sectors <= s->buf_sectors);
+    while (nb_sectors > 0) {
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        n = MIN(nb_sectors,
+                s->src_sectors[src_cur] - (sector_num - src_cur_offset));
+
+        iov.iov_base = buf;
+        iov.iov_len = n << BDRV_SECTOR_BITS;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = bdrv_co_readv(s->src[src_cur], sector_num - src_cur_offset,
+                            n, &qiov);
+        if (ret < 0) {
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n << BDRV_SECTOR_BITS;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
+                                         int nb_sectors, uint8_t *buf,
+                                         ImgConvertBlockStatus status)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int n, ret;
+
+    while (nb_sectors > 0) {
+        n = nb_sectors;
+        ret = 0;
+
+        switch (status) {
+        case BLK_BACKING_FILE:
+            /* Leave the target unallocated so that its backing file shows
+             * through */
+            assert(s->target_has_backing);
+            break;
+
+        case BLK_DATA:
+            iov.iov_base = buf;
+            iov.iov_len = n << BDRV_SECTOR_BITS;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+
+            if (s->compressed) {
+                if (!buffer_is_zero(buf, n << BDRV_SECTOR_BITS)) {
+                    ret = bdrv_co_write_compressed(s->target, sector_num, n,
+                                                   &qiov);
+                }
+                break;
+            }
+
+            /* NOTE: at the same time we convert, we do not write zero
+               sectors to have a chance to compress the image. */
+            if (!s->has_zero_init ||
+                is_allocated_sectors_min(buf, n, &n, s->min_sparse)) {
+                iov.iov_len = n << BDRV_SECTOR_BITS;
+                qemu_iovec_init_external(&qiov, &iov, 1);
+                ret = bdrv_co_writev(s->target, sector_num, n, &qiov);
+            }
+            break;
+
+        case BLK_ZERO:
+            if (!s->has_zero_init) {
+                ret = bdrv_co_write_zeroes(s->target, sector_num, n);
+            }
+            break;
+        }
+
+        if (ret < 0) {
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n << BDRV_SECTOR_BITS;
+    }
+
+    return 0;
+}
+
+static void convert_progress(ImgConvertState *s, int nb_sectors)
+{
+    int64_t elapsed;
+
+    s->sectors_done += nb_sectors;
+    elapsed = get_clock() - s->start_time;
+    if (elapsed > 0) {
+        qemu_progress_set_rate((double)(s->sectors_done << BDRV_SECTOR_BITS) *
+                               get_ticks_per_sec() / elapsed / (1 << 20));
+    }
+    qemu_progress_print(100.0 * s->sectors_done / s->total_sectors, 0);
+}
+
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    ImgConvertBlockStatus status;
+    uint8_t *buf;
+    int64_t sector_num;
+    int i, n, ret;
+    int index = -1;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    s->running_coroutines++;
+    buf = qemu_blockalign(s->target, s->buf_sectors << BDRV_SECTOR_BITS);
+
+    while (s->ret == -EINPROGRESS) {
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        n = convert_iteration_sectors(s, s->sector_num);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            error_report("error while reading block status of sector %"
+                         PRId64 ": %s", s->sector_num, strerror(-n));
+            ret = n;
+            goto fail;
+        }
+        /* Let the other coroutines go on with the following chunks while
+         * this one is being copied */
+        sector_num = s->sector_num;
+        status = s->status;
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (status == BLK_DATA) {
+            ret = convert_co_read(s, sector_num, n, buf);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64 ": %s",
+                             sector_num, strerror(-ret));
+                goto fail;
+            }
+        }
+
+        if (s->wr_in_order) {
+            while (s->wr_offs != sector_num) {
+                if (s->ret != -EINPROGRESS) {
+                    goto out;
+                }
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            s->wait_sector_num[index] = -1;
+        }
+
+        ret = convert_co_write(s, sector_num, n, buf, status);
+        if (ret < 0) {
+            error_report("error while writing sector %" PRId64 ": %s",
+                         sector_num, strerror(-ret));
+            goto fail;
+        }
+        convert_progress(s, n);
+
+        if (s->wr_in_order) {
+            /* Wake up the coroutine that waits to write the next chunk.  It
+             * cannot be one that entered this coroutine, because those are
+             * not waiting. */
+            s->wr_offs = sector_num + n;
+            for (i = 0; i < s->num_coroutines; i++) {
+                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+                    s->wait_sector_num[i] = -1;
+                    qemu_coroutine_enter(s->co[i], NULL);
+                    break;
+                }
+            }
+        }
+    }
+    goto out;
+
+fail:
+    if (s->ret == -EINPROGRESS) {
+        s->ret = ret;
+    }
+    /* Let the coroutines that wait for their turn to write see the error */
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->wait_sector_num[i] != -1) {
+            s->wait_sector_num[i] = -1;
+            qemu_coroutine_enter(s->co[i], NULL);
+        }
+    }
+out:
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
+        /* All chunks have been written */
+        s->ret = 0;
+    }
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    AioContext *aio_context = bdrv_get_aio_context(s->target);
+    int i;
+
+    s->sector_num = 0;
+    s->sector_next_status = 0;
+    s->wr_offs = 0;
+    s->sectors_done = 0;
+    s->start_time = get_clock();
+    s->ret = -EINPROGRESS;
+    qemu_co_mutex_init(&s->lock);
+
+    if (s->total_sectors == 0) {
+        s->ret = 0;
+    }
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->wait_sector_num[i] = -1;
+        s->co[i] = NULL;
+    }
+    for (i = 0; i < s->num_coroutines && s->ret == -EINPROGRESS; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+        qemu_coroutine_enter(s->co[i], s);
+    }
+
+    while (s->running_coroutines) {
+        aio_poll(aio_context, true);
+    }
+
+    if (s->ret == 0 && s->compressed) {
+        /* signal EOF to align */
+        s->ret = bdrv_write_compressed(s->target, 0, NULL, 0);
+    }
+
+    qemu_progress_set_rate(0);
+    return s->ret;
+}
+
 static int img_convert(int argc, char **argv)
 {
-    int c, ret = 0, n, n1, bs_n, bs_i, compress, cluster_size,
-        cluster_sectors, skip_create;
+    int c, ret = 0, bs_n, bs_i, compress, cluster_size, skip_create;
     int progress = 0, flags;
     const char *fmt, *out_fmt, *cache, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
     BlockDriverState **bs = NULL, *out_bs = NULL;
-    int64_t total_sectors, nb_sectors, sector_num, bs_offset;
-    uint64_t bs_sectors;
-    uint8_t * buf = NULL;
-    const uint8_t *buf1;
+    int64_t total_sectors;
+    int64_t *bs_sectors = NULL;
+    uint64_t sectors;
     BlockDriverInfo bdi;
     QEMUOptionParameter *param = NULL, *create_options = NULL;
     QEMUOptionParameter *out_baseimg_param;
     char *options = NULL;
     const char *snapshot_name = NULL;
-    float local_progress = 0;
     int min_sparse = 8; /* Need at least 4k of zeros for sparse detection */
+    int num_coroutines = 8;
+    bool wr_in_order = true;
     bool quiet = false;
     Error *local_err = NULL;
+    ImgConvertState state;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -1148,7 +1522,7 @@ static int img_convert(int argc, char **argv)
     compress = 0;
     skip_create = 0;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:qn");
+        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:qnm:W");
         if (c == -1) {
             break;
         }
@@ -1208,6 +1582,22 @@ static int img_convert(int argc, char **argv)
         case 'n':
             skip_create = 1;
             break;
+        case 'm':
+        {
+            char *end;
+            errno = 0;
+            num_coroutines = strtol(optarg, &end, 10);
+            if (errno || *end || num_coroutines < 1 ||
+                num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d", MAX_COROUTINES);
+                return 1;
+            }
+            break;
+        }
+        case 'W':
+            wr_in_order = false;
+            break;
         }
     }
 
@@ -1240,6 +1630,7 @@ static int img_convert(int argc, char **argv)
     qemu_progress_print(0, 100);
 
     bs = g_malloc0(bs_n * sizeof(BlockDriverState *));
+    bs_sectors = g_malloc0(bs_n * sizeof(int64_t));
 
     total_sectors = 0;
     for (bs_i = 0; bs_i < bs_n; bs_i++) {
@@ -1250,8 +1641,9 @@ static int img_convert(int argc, char **argv)
             ret = -1;
             goto out;
         }
-        bdrv_get_geometry(bs[bs_i], &bs_sectors);
-        total_sectors += bs_sectors;
+        bdrv_get_geometry(bs[bs_i], &sectors);
+        bs_sectors[bs_i] = sectors;
+        total_sectors += sectors;
     }
 
     if (snapshot_name != NULL) {
@@ -1317,7 +1709,7 @@ static int img_convert(int argc, char **argv)
         QEMUOptionParameter *preallocation =
             get_option_parameter(param, BLOCK_OPT_PREALLOC);
 
-        if (!drv->bdrv_write_compressed) {
+        if (!drv->bdrv_write_compressed && !drv->bdrv_co_write_compressed) {
             error_report("Compression not supported for this file format");
             ret = -1;
             goto out;
@@ -1364,11 +1756,6 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
-    bs_i = 0;
-    bs_offset = 0;
-    bdrv_get_geometry(bs[0], &bs_sectors);
-    buf = qemu_blockalign(out_bs, IO_BUF_SIZE);
-
     if (skip_create) {
         int64_t output_length = bdrv_getlength(out_bs);
         if (output_length < 0) {
@@ -1383,6 +1770,7 @@ static int img_convert(int argc, char **argv)
         }
     }
 
+    cluster_size = 0;
     if (compress) {
         ret = bdrv_get_info(out_bs, &bdi);
         if (ret < 0) {
@@ -1395,166 +1783,42 @@ static int img_convert(int argc, char **argv)
             ret = -1;
             goto out;
         }
-        cluster_sectors = cluster_size >> 9;
-        sector_num = 0;
-
-        nb_sectors = total_sectors;
-        if (nb_sectors != 0) {
-            local_progress = (float)100 /
-                (nb_sectors / MIN(nb_sectors, cluster_sectors));
-        }
-
-        for(;;) {
-            int64_t bs_num;
-            int remainder;
-            uint8_t *buf2;
-
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0)
-                break;
-            if (nb_sectors >= cluster_sectors)
-                n = cluster_sectors;
-            else
-                n = nb_sectors;
-
-            bs_num = sector_num - bs_offset;
-            assert (bs_num >= 0);
-            remainder = n;
-            buf2 = buf;
-            while (remainder > 0) {
-                int nlow;
-                while (bs_num == bs_sectors) {
-                    bs_i++;
-                    assert (bs_i < bs_n);
-                    bs_offset += bs_sectors;
-                    bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                    bs_num = 0;
-                    /* printf("changing part: sector_num=%" PRId64 ", "
-                       "bs_i=%d, bs_offset=%" PRId64 ", bs_sectors=%" PRId64
-                       "\n", sector_num, bs_i, bs_offset, bs_sectors); */
-                }
-                assert (bs_num < bs_sectors);
-
-                nlow = (remainder > bs_sectors - bs_num) ? bs_sectors - bs_num : remainder;
-
-                ret = bdrv_read(bs[bs_i], bs_num, buf2, nlow);
-                if (ret < 0) {
-                    error_report("error while reading sector %" PRId64 ": %s",
-                                 bs_num, strerror(-ret));
-                    goto out;
-                }
-
-                buf2 += nlow * 512;
-                bs_num += nlow;
-
-                remainder -= nlow;
-            }
-            assert (remainder == 0);
-
-            if (!buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)) {
-                ret = bdrv_write_compressed(out_bs, sector_num, buf, n);
-                if (ret != 0) {
-                    error_report("error while compressing sector %" PRId64
-                                 ": %s", sector_num, strerror(-ret));
-                    goto out;
-                }
-            }
-            sector_num += n;
-            qemu_progress_print(local_progress, 100);
-        }
-        /* signal EOF to align */
-        bdrv_write_compressed(out_bs, 0, NULL, 0);
-    } else {
-        int has_zero_init = bdrv_has_zero_init(out_bs);
-
-        sector_num = 0; // total number of sectors converted so far
-        nb_sectors = total_sectors - sector_num;
-        if (nb_sectors != 0) {
-            local_progress = (float)100 /
-                (nb_sectors / MIN(nb_sectors, IO_BUF_SIZE / 512));
-        }
-
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0) {
-                break;
-            }
-            if (nb_sectors >= (IO_BUF_SIZE / 512)) {
-                n = (IO_BUF_SIZE / 512);
-            } else {
-                n = nb_sectors;
-            }
 
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
-            }
-
-            if (n > bs_offset + bs_sectors - sector_num) {
-                n = bs_offset + bs_sectors - sector_num;
-            }
-
-            /* If the output image is being created as a copy on write image,
-               assume that sectors which are unallocated in the input image
-               are present in both the output's and input's base images (no
-               need to copy them). */
-            if (out_baseimg) {
-                ret = bdrv_is_allocated(bs[bs_i], sector_num - bs_offset,
-                                        n, &n1);
-                if (ret < 0) {
-                    error_report("error while reading metadata for sector "
-                                 "%" PRId64 ": %s",
-                                 sector_num - bs_offset, strerror(-ret));
-                    goto out;
-                }
-                if (!ret) {
-                    sector_num += n1;
-                    continue;
-                }
-                /* The next 'n1' sectors are allocated in the input image. Copy
-                   only those as they may be followed by unallocated sectors. */
-                n = n1;
-            } else {
-                n1 = n;
-            }
-
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error_report("error while reading sector %" PRId64 ": %s",
-                             sector_num - bs_offset, strerror(-ret));
+        /* The synchronous bdrv_write_compressed implementations are not
+         * reentrant, so only one cluster may be in flight for them */
+        if (!out_bs->drv->bdrv_co_write_compressed) {
+            if (!wr_in_order) {
+                error_report("Out-of-order compressed writes are not "
+                             "supported for file format '%s'", out_fmt);
+                ret = -1;
                 goto out;
             }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                if (!has_zero_init ||
-                    is_allocated_sectors_min(buf1, n, &n1, min_sparse)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error_report("error while writing sector %" PRId64
-                                     ": %s", sector_num, strerror(-ret));
-                        goto out;
-                    }
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
-            qemu_progress_print(local_progress, 100);
-        }
-    }
+            num_coroutines = 1;
+        }
+    }
+
+    state = (ImgConvertState) {
+        .src                = bs,
+        .src_sectors        = bs_sectors,
+        .src_num            = bs_n,
+        .total_sectors      = total_sectors,
+        .target             = out_bs,
+        .has_zero_init      = bdrv_has_zero_init(out_bs),
+        .compressed         = compress,
+        .target_has_backing = out_baseimg != NULL,
+        .min_sparse         = min_sparse,
+        .cluster_sectors    = cluster_size >> BDRV_SECTOR_BITS,
+        .buf_sectors        = compress ? cluster_size >> BDRV_SECTOR_BITS
+                                       : IO_BUF_SIZE >> BDRV_SECTOR_BITS,
+        .wr_in_order        = wr_in_order,
+        .num_coroutines     = num_coroutines,
+    };
+    ret = convert_do_copy(&state);
+
 out:
     qemu_progress_end();
     free_option_parameters(create_options);
     free_option_parameters(param);
-    qemu_vfree(buf);
     if (out_bs) {
         bdrv_unref(out_bs);
     }
@@ -1566,6 +1830,7 @@ out:
         }
         g_free(bs);
     }
+    g_free(bs_sectors);
     if (ret) {
         return 1;
     }
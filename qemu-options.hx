@@ -448,6 +448,12 @@ These options have the same definition as they have in @option{-hdachs}.
 @var{cache} is "none", "writeback", "unsafe", "directsync" or "writethrough" and controls how the host cache is used to access block data.
 @item aio=@var{aio}
 @var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+With native AIO, @option{file.aio-max-events} sets how many requests of the
+drive can be submitted to the host at a time (default 128); further requests
+are queued until earlier ones complete.  @option{file.aio-poll=on} reaps
+completions from the kernel's completion ring without system calls, also
+while an I/O thread busy-polls; it can lower the latency of fast devices.
+It needs Linux 3.16 or later and is ignored on older kernels.
 @item discard=@var{discard}
 @var{discard} is one of "ignore" (or "off") or "unmap" (or "on") and controls whether @dfn{discard} (also known as @dfn{trim} or @dfn{unmap}) requests are ignored or passed to the filesystem.  Some machine types may not support discard requests.
 @item format=@var{format}
@@ -2793,24 +2799,71 @@ many timer interrupts were not processed by the Windows guest and will
 re-inject them.
 ETEXI
 
+DEF("tcg-threads", HAS_ARG, QEMU_OPTION_tcg_threads, \
+    "-tcg-threads single|multi\n" \
+    "                run all TCG vCPUs on one host thread (default) or give\n" \
+    "                each vCPU its own host thread\n", QEMU_ARCH_ALL)
+STEXI
+@item -tcg-threads single|multi
+@findex -tcg-threads
+Select how TCG vCPUs are mapped to host threads.  With @code{single}, the
+default, one host thread executes every vCPU in turn.  With @code{multi},
+each vCPU runs on its own host thread and the global mutex is only taken
+for device accesses, translation and other work outside of translated
+code, so a multi-core guest can use several host cores.
+
+This mode is experimental and only available for ARM guests, whose store
+exclusive instructions stop every other vCPU while they compare and store.
+As in the user mode emulation, the store succeeds if the memory still holds
+the value that the load exclusive read, so a value that another vCPU changed
+and restored in between goes unnoticed.  Each store exclusive is much slower
+than in @code{single} mode.  The mode also requires a Linux host and cannot
+be combined with @option{-icount auto}.
+ETEXI
+
 DEF("icount", HAS_ARG, QEMU_OPTION_icount, \
-    "-icount [N|auto]\n" \
+    "-icount [N|auto][,quantum=Q]\n" \
     "                enable virtual instruction counter with 2^N clock ticks per\n" \
-    "                instruction\n", QEMU_ARCH_ALL)
+    "                instruction; with -tcg-threads multi, vCPUs synchronize\n" \
+    "                every Q instructions\n", QEMU_ARCH_ALL)
 STEXI
-@item -icount [@var{N}|auto]
+@item -icount [@var{N}|auto][,quantum=@var{Q}]
 @findex -icount
 Enable virtual instruction counter.  The virtual cpu will execute one
 instruction every 2^@var{N} ns of virtual time.  If @code{auto} is specified
 then the virtual cpu speed will be automatically adjusted to keep virtual
 time within a few seconds of real time.
 
+With @option{-tcg-threads multi}, each vCPU runs in its own host thread and
+executes at most @var{Q} instructions (10000 by default) before waiting for
+the other vCPUs to reach the same point in virtual time.  Quanta never cross
+a virtual timer deadline, so timers fire at the same instruction counts on
+every run.  Smaller quanta keep the vCPUs more tightly coupled at the cost
+of more synchronization.  @code{quantum} requires, and @code{auto} cannot be
+combined with, @option{-tcg-threads multi}.
+
 Note that while this option can give deterministic behavior, it does not
 provide cycle accurate emulation.  Modern CPUs contain superscalar out of
 order cores with complex cache hierarchies.  The number of instructions
 executed often has little or no correlation with actual performance.
 ETEXI
 
+DEF("timer-slack", HAS_ARG, QEMU_OPTION_timer_slack, \
+    "-timer-slack ns\n" \
+    "                let main loop wakeups be up to 'ns' nanoseconds late so\n" \
+    "                that nearby timer deadlines share one wakeup\n", QEMU_ARCH_ALL)
+STEXI
+@item -timer-slack @var{ns}
+@findex -timer-slack
+Allow the main loop and the I/O threads to wake up to @var{ns} nanoseconds
+after a timer deadline, so that every timer expiring within that window of
+the first one runs after a single wakeup.  Timers never fire early.  The
+default of 0 wakes up for each deadline; a slack of a few hundred
+microseconds noticeably lowers the host CPU usage of idle guests with many
+devices.  The activity of the main loop can be checked with the
+@code{query-main-loop} QMP command.
+ETEXI
+
 DEF("count-ifetch", 0, QEMU_OPTION_count_ifetch, \
     "-count-ifetch\n" \
     "                count the number of fetched instructions\n",
@@ -3172,6 +3225,19 @@ Create an new object of type @var{typename} setting properties
 in the order they are specified.  Note that the 'id'
 property must be set.  These objects are placed in the
 '/objects' path.
+
+@table @option
+
+@item -object iothread,id=@var{id}[,poll-max-ns=@var{ns}][,poll-grow=@var{factor}][,poll-shrink=@var{divisor}]
+
+Creates a dedicated event loop thread that devices can be assigned to,
+for example with @code{-device virtio-blk-pci,x-data-plane=on,x-iothread=@var{id}}.
+Several devices can share one IOThread; spreading disks over several of
+them lets their I/O use several host CPUs.  The @option{poll-*} properties
+control adaptive polling before the thread goes to sleep; the default
+maximum is 32 microseconds, and 0 disables polling.
+
+@end table
 ETEXI
 
 DEF("msg", HAS_ARG, QEMU_OPTION_msg,
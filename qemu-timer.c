@@ -58,6 +58,9 @@ typedef struct QEMUClock {
 QEMUTimerListGroup main_loop_tlg;
 QEMUClock qemu_clocks[QEMU_CLOCK_MAX];
 
+/* How late a wakeup may be so that it also covers the following timers */
+static int64_t timer_slack_ns;
+
 /* A QEMUTimerList is a list of timers attached to a clock. More
  * than one QEMUTimerList can be attached to each clock, for instance
  * used by different AioContexts / threads. Each clock also has
@@ -75,6 +78,9 @@ struct QEMUTimerList {
 
     /* lightweight method to mark the end of timerlist's running */
     QemuEvent timers_done_ev;
+
+    /* Number of timer callbacks run, only written by timerlist_run_timers */
+    uint64_t timers_fired;
 };
 
 /**
@@ -237,6 +243,46 @@ int64_t timerlist_deadline_ns(QEMUTimerList *timer_list)
     return delta;
 }
 
+/* As timerlist_deadline_ns, but push the deadline back to the last timer
+ * that expires within timer_slack_ns of the first one, so that a single
+ * wakeup runs all of them.
+ */
+static int64_t timerlist_deadline_slack_ns(QEMUTimerList *timer_list)
+{
+    QEMUTimer *ts;
+    int64_t expire_time, now;
+
+    if (!timer_slack_ns) {
+        return timerlist_deadline_ns(timer_list);
+    }
+    if (!timer_list->clock->enabled) {
+        return -1;
+    }
+
+    now = qemu_clock_get_ns(timer_list->clock->type);
+    qemu_mutex_lock(&timer_list->active_timers_lock);
+    ts = timer_list->active_timers;
+    if (!ts) {
+        qemu_mutex_unlock(&timer_list->active_timers_lock);
+        return -1;
+    }
+    if (ts->expire_time <= now) {
+        qemu_mutex_unlock(&timer_list->active_timers_lock);
+        return 0;
+    }
+    expire_time = ts->expire_time;
+    for (ts = ts->next; ts; ts = ts->next) {
+        if (ts->expire_time - timer_list->active_timers->expire_time
+            > timer_slack_ns) {
+            break;
+        }
+        expire_time = ts->expire_time;
+    }
+    qemu_mutex_unlock(&timer_list->active_timers_lock);
+
+    return expire_time - now;
+}
+
 /* Calculate the soonest deadline across all timerlists attached
  * to the clock. This is used for the icount timeout so we
  * ignore whether or not the clock should be used in deadline
@@ -486,6 +532,7 @@ bool timerlist_run_timers(QEMUTimerList *timer_list)
 
         /* run the callback (the timer list can be modified) */
         cb(opaque);
+        timer_list->timers_fired++;
         progress = true;
     }
 
@@ -533,13 +580,37 @@ int64_t timerlistgroup_deadline_ns(QEMUTimerListGroup *tlg)
     for (type = 0; type < QEMU_CLOCK_MAX; type++) {
         if (qemu_clock_use_for_deadline(tlg->tl[type]->clock->type)) {
             deadline = qemu_soonest_timeout(deadline,
-                                            timerlist_deadline_ns(
+                                            timerlist_deadline_slack_ns(
                                                 tlg->tl[type]));
         }
     }
     return deadline;
 }
 
+uint64_t timerlistgroup_timers_fired(QEMUTimerListGroup *tlg)
+{
+    QEMUClockType type;
+    uint64_t fired = 0;
+
+    for (type = 0; type < QEMU_CLOCK_MAX; type++) {
+        fired += tlg->tl[type]->timers_fired;
+    }
+    return fired;
+}
+
+void qemu_timer_set_slack_ns(int64_t slack)
+{
+    timer_slack_ns = slack;
+#ifdef CONFIG_PRCTL_PR_SET_TIMERSLACK
+    prctl(PR_SET_TIMERSLACK, MAX(slack, 1), 0, 0, 0);
+#endif
+}
+
+int64_t qemu_timer_get_slack_ns(void)
+{
+    return timer_slack_ns;
+}
+
 int64_t qemu_clock_get_ns(QEMUClockType type)
 {
     int64_t now, last;
@@ -587,7 +658,7 @@ void init_clocks(void)
     }
 
 #ifdef CONFIG_PRCTL_PR_SET_TIMERSLACK
-    prctl(PR_SET_TIMERSLACK, 1, 0, 0, 0);
+    prctl(PR_SET_TIMERSLACK, MAX(timer_slack_ns, 1), 0, 0, 0);
 #endif
 }
 
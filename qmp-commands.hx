@@ -917,7 +917,7 @@ EQMP
     {
         .name       = "drive-backup",
         .args_type  = "sync:s,device:B,target:s,speed:i?,mode:s?,format:s?,"
-                      "on-source-error:s?,on-target-error:s?",
+                      "bitmap:s?,on-source-error:s?,on-target-error:s?",
         .mhandler.cmd_new = qmp_marshal_input_drive_backup,
     },
 
@@ -944,11 +944,13 @@ Arguments:
             (json-string, optional)
 - "sync": what parts of the disk image should be copied to the destination;
   possibilities include "full" for all the disk, "top" for only the sectors
-  allocated in the topmost image, or "none" to only replicate new I/O
-  (MirrorSyncMode).
+  allocated in the topmost image, "none" to only replicate new I/O, or
+  "incremental" for the clusters marked in "bitmap" (MirrorSyncMode).
 - "mode": whether and how QEMU should create a new image
           (NewImageMode, optional, default 'absolute-paths')
 - "speed": the maximum speed, in bytes per second (json-int, optional)
+- "bitmap": the dirty bitmap to copy when "sync" is "incremental"; it is
+            cleared if the backup succeeds (json-string, optional)
 - "on-source-error": the action to take on an error on the source, default
                      'report'.  'stop' and 'enospc' can only be used
                      if the block device supports io-status.
@@ -963,6 +965,65 @@ Example:
                                                "sync": "full",
                                                "target": "backup.img" } }
 <- { "return": {} }
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-add",
+        .args_type  = "device:B,name:s,granularity:i?,persistent-file:s?",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_add,
+    },
+
+SQMP
+block-dirty-bitmap-add
+----------------------
+
+Start recording the writes to a block device in a named dirty bitmap.
+
+Arguments:
+
+- "device": the name of the block device (json-string)
+- "name": the name of the new bitmap (json-string)
+- "granularity": the size in bytes of the area that each bit stands for,
+                 default is the cluster size or 64k (json-int, optional)
+- "persistent-file": file where the bitmap is saved when the image is
+                     closed, and loaded from if it exists (json-string,
+                     optional)
+
+A persistent bitmap must be added again before the guest runs.  It marks the
+whole disk dirty if it was not saved, or if the image file changed size or
+modification time since the save.  The image must be a regular file.
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-add",
+     "arguments": { "device": "drive0", "name": "nightly",
+                    "persistent-file": "/var/lib/backup/drive0.bitmap" } }
+<- { "return": {} }
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-remove",
+        .args_type  = "device:B,name:s",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_remove,
+    },
+
+SQMP
+block-dirty-bitmap-remove
+-------------------------
+
+Stop recording writes in a dirty bitmap and delete it.  A persistent bitmap
+is saved to its file first.
+
+Arguments:
+
+- "device": the name of the block device (json-string)
+- "name": the name of the bitmap (json-string)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-remove",
+     "arguments": { "device": "drive0", "name": "nightly" } }
+<- { "return": {} }
 EQMP
 
     {
@@ -2023,6 +2084,16 @@ Each json-object contain the following:
     - "flush_total_time_ns": total time spend on cache flushes in nano-seconds (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+- "metadata-cache": Statistics of the image format's metadata caches, only
+                    present for formats that have them (json-object, optional)
+    - "l2-cache-size": size of the L2 table cache in bytes (json-int)
+    - "l2-hits": L2 table lookups served from the cache (json-int)
+    - "l2-misses": L2 table lookups that read the image file (json-int)
+    - "refcount-cache-size": size of the refcount block cache in bytes
+                             (json-int)
+    - "refcount-hits": refcount block lookups served from the cache (json-int)
+    - "refcount-misses": refcount block lookups that read the image file
+                         (json-int)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -2402,6 +2473,82 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_kvm,
     },
 
+SQMP
+query-main-loop
+---------------
+
+Show activity statistics of the main loop.
+
+Return a json-object with the following information:
+
+- "wakeups": number of times the main loop returned from polling (json-int)
+- "wakeups-per-sec": wakeups per second since the previous query-main-loop,
+                     0 on the first query (json-number)
+- "bh-runs": number of bottom half callbacks run (json-int)
+- "timers-fired": number of timer callbacks run (json-int)
+- "timer-slack": timer slack in nanoseconds, see -timer-slack (json-int)
+
+Example:
+
+-> { "execute": "query-main-loop" }
+<- { "return": { "wakeups": 18342, "wakeups-per-sec": 102.5,
+                 "bh-runs": 5210, "timers-fired": 9876,
+                 "timer-slack": 1000000 } }
+
+EQMP
+
+    {
+        .name       = "query-main-loop",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_main_loop,
+    },
+
+SQMP
+query-iothreads
+---------------
+
+Returns a list of information about each iothread.
+
+Note this list excludes the QEMU main loop thread, which is not declared
+using the -object iothread command-line option.  It is always the main thread
+of the process.
+
+Return a json-array. Each iothread is represented by a json-object, which contains:
+
+- "id": name of iothread (json-str)
+- "thread-id": ID of the underlying host thread (json-int)
+- "poll-max-ns": maximum polling time in ns, 0 disables polling (json-int)
+- "poll-grow": polling time growth factor, 0 for the default (json-int)
+- "poll-shrink": polling time shrink divisor, 0 to reset to 0 (json-int)
+- "poll-ns": current polling time in ns (json-int)
+- "poll-attempts": blocking waits that polled first (json-int)
+- "poll-hits": blocking waits that found work while polling (json-int)
+
+Example:
+
+-> { "execute":"query-iothreads" }
+<- { "return":[
+        {
+           "id":"iothread0",
+           "thread-id":3134,
+           "poll-max-ns":32768,
+           "poll-grow":2,
+           "poll-shrink":0,
+           "poll-ns":16000,
+           "poll-attempts":52310,
+           "poll-hits":48765
+        }
+     ]
+   }
+
+EQMP
+
+    {
+        .name       = "query-iothreads",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_iothreads,
+    },
+
 SQMP
 query-status
 ------------
@@ -25,6 +25,8 @@
 #include "sysemu/blockdev.h"
 #include "qom/qom-qobject.h"
 #include "hw/boards.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
 
 NameInfo *qmp_query_name(Error **errp)
 {
@@ -64,6 +66,31 @@ KvmInfo *qmp_query_kvm(Error **errp)
     return info;
 }
 
+MainLoopInfo *qmp_query_main_loop(Error **errp)
+{
+    static int64_t last_time;
+    static uint64_t last_wakeups;
+    MainLoopInfo *info = g_malloc0(sizeof(*info));
+    uint64_t wakeups, bh_runs, timers_fired;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_HOST);
+
+    qemu_main_loop_get_stats(&wakeups, &bh_runs, &timers_fired);
+    info->wakeups = wakeups;
+    info->bh_runs = bh_runs;
+    info->timers_fired = timers_fired;
+    info->timer_slack = qemu_timer_get_slack_ns();
+
+    /* The rate covers the time since the previous query.  */
+    if (last_time && now > last_time) {
+        info->wakeups_per_sec = (double)(wakeups - last_wakeups) *
+                                get_ticks_per_sec() / (now - last_time);
+    }
+    last_time = now;
+    last_wakeups = wakeups;
+
+    return info;
+}
+
 UuidInfo *qmp_query_uuid(Error **errp)
 {
     UuidInfo *info = g_malloc0(sizeof(*info));
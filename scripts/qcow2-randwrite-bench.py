@@ -0,0 +1,104 @@
+#!/usr/bin/env python
+#
+# Random write IOPS of a qcow2 image as a function of queue depth
+#
+# Random writes of --block-size bytes go to an image whose clusters were
+# all allocated when it was created, so that only the L2 lookup is
+# serialized.  Each depth issues --requests writes as back-to-back
+# aio_write batches in qemu-io, each batch followed by aio_flush.
+#
+# Example:
+#   scripts/qcow2-randwrite-bench.py --qemu-io ./qemu-io --qemu-img ./qemu-img \
+#       --size 4G --depths 1,4,16,64 /var/tmp
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+#
+
+from __future__ import print_function
+
+import optparse
+import os
+import random
+import subprocess
+import sys
+import tempfile
+import time
+
+def parse_size(s):
+    suffixes = { 'k': 1 << 10, 'm': 1 << 20, 'g': 1 << 30, 't': 1 << 40 }
+    s = s.strip().lower()
+    if s and s[-1] in suffixes:
+        return int(s[:-1]) * suffixes[s[-1]]
+    return int(s)
+
+def run_depth(opts, image, depth, size):
+    rng = random.Random(depth)
+    nr_blocks = size // opts.block_size
+    cmds = []
+    for i in range(opts.requests):
+        offset = rng.randrange(nr_blocks) * opts.block_size
+        cmds += ['-c', 'aio_write -q -P 0x5a %d %d' % (offset, opts.block_size)]
+        if (i + 1) % depth == 0:
+            cmds += ['-c', 'aio_flush']
+    cmds += ['-c', 'aio_flush']
+
+    args = [opts.qemu_io]
+    if opts.nocache:
+        args.append('-n')
+    if opts.native_aio:
+        args.append('-k')
+    args += cmds + [image]
+
+    start = time.time()
+    subprocess.check_call(args)
+    return opts.requests / (time.time() - start)
+
+def main():
+    parser = optparse.OptionParser(usage='%prog [options] DIR')
+    parser.add_option('--qemu-io', default='qemu-io',
+                      help='qemu-io binary to use')
+    parser.add_option('--qemu-img', default='qemu-img',
+                      help='qemu-img binary to use')
+    parser.add_option('--size', default='1G',
+                      help='virtual size of the test image')
+    parser.add_option('--cluster-size', default='64k',
+                      help='cluster size of the test image')
+    parser.add_option('--block-size', default='4k',
+                      help='size of each write')
+    parser.add_option('--requests', type='int', default=8192,
+                      help='number of writes per queue depth')
+    parser.add_option('--depths', default='1,2,4,8,16,32,64',
+                      help='comma-separated list of queue depths')
+    parser.add_option('-n', '--nocache', action='store_true', default=False,
+                      help='open the image with cache=none')
+    parser.add_option('-k', '--native-aio', action='store_true', default=False,
+                      help='use Linux native AIO')
+    opts, args = parser.parse_args()
+    if len(args) != 1:
+        parser.error('need a directory for the test image')
+
+    opts.block_size = parse_size(opts.block_size)
+    size = parse_size(opts.size)
+    depths = [int(d) for d in opts.depths.split(',')]
+
+    fd, image = tempfile.mkstemp(suffix='.qcow2', dir=args[0])
+    os.close(fd)
+    try:
+        subprocess.check_call([opts.qemu_img, 'create', '-q', '-f', 'qcow2',
+                               '-o', 'cluster_size=%s,preallocation=metadata'
+                               % opts.cluster_size, image, str(size)])
+
+        print('%6s %12s' % ('depth', 'IOPS'))
+        base = None
+        for depth in depths:
+            iops = run_depth(opts, image, depth, size)
+            if base is None:
+                base = iops
+            print('%6d %12.0f  (x%.2f)' % (depth, iops, iops / base))
+            sys.stdout.flush()
+    finally:
+        os.unlink(image)
+
+if __name__ == '__main__':
+    main()
@@ -260,10 +260,10 @@ typedef struct CPUARMState {
     uint32_t exclusive_addr;
     uint32_t exclusive_val;
     uint32_t exclusive_high;
-#if defined(CONFIG_USER_ONLY)
+    /* Store exclusive raised as EXCP_STREX, in user emulation mode and
+       with multi-threaded TCG.  */
     uint32_t exclusive_test;
     uint32_t exclusive_info;
-#endif
 
     /* iwMMXt coprocessor state.  */
     struct {
@@ -324,6 +324,9 @@ int cpu_arm_signal_handler(int host_signum, void *pinfo,
 int cpu_arm_handle_mmu_fault (CPUARMState *env, target_ulong address, int rw,
                               int mmu_idx);
 #define cpu_handle_mmu_fault cpu_arm_handle_mmu_fault
+#ifndef CONFIG_USER_ONLY
+void arm_cpu_do_strex(CPUARMState *env);
+#endif
 
 #define CPSR_M (0x1fU)
 #define CPSR_T (1U << 5)
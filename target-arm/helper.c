@@ -723,6 +723,9 @@ static uint64_t gt_get_countervalue(CPUARMState *env)
 static void gt_recalc_timer(ARMCPU *cpu, int timeridx)
 {
     ARMGenericTimer *gt = &cpu->env.cp15.c14_timer[timeridx];
+    /* The cp register helpers run in translated code, without the global
+     * mutex under multi-threaded TCG */
+    bool locked = qemu_tcg_lock_iothread();
 
     if (gt->ctl & 1) {
         /* Timer enabled: calculate and set current ISTATUS, irq, and
@@ -758,6 +761,9 @@ static void gt_recalc_timer(ARMCPU *cpu, int timeridx)
         qemu_set_irq(cpu->gt_timer_outputs[timeridx], 0);
         timer_del(cpu->gt_timer[timeridx]);
     }
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
 }
 
 static int gt_cntfrq_read(CPUARMState *env, const ARMCPRegInfo *ri,
@@ -867,8 +873,13 @@ static int gt_ctl_write(CPUARMState *env, const ARMCPRegInfo *ri,
         /* IMASK toggled: don't need to recalculate,
          * just set the interrupt line based on ISTATUS
          */
+        bool locked = qemu_tcg_lock_iothread();
+
         qemu_set_irq(cpu->gt_timer_outputs[timeridx],
                      (oldval & 4) && (value & 2));
+        if (locked) {
+            qemu_mutex_unlock_iothread();
+        }
     }
     return 0;
 }
@@ -2326,6 +2337,9 @@ void arm_v7m_cpu_do_interrupt(CPUState *cs)
     /* TODO: Need to escalate if the current priority is higher than the
        one we're raising.  */
     switch (env->exception_index) {
+    case EXCP_STREX:
+        arm_cpu_do_strex(env);
+        return;
     case EXCP_UDEF:
         armv7m_nvic_set_pending(env->nvic, ARMV7M_EXCP_USAGE);
         return;
@@ -2402,6 +2416,9 @@ void arm_cpu_do_interrupt(CPUState *cs)
 
     /* TODO: Vectored interrupt controller.  */
     switch (env->exception_index) {
+    case EXCP_STREX:
+        arm_cpu_do_strex(env);
+        return;
     case EXCP_UDEF:
         new_mode = ARM_CPU_MODE_UND;
         addr = 0x04;
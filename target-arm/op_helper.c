@@ -53,6 +53,7 @@ uint32_t HELPER(neon_tbl)(CPUARMState *env, uint32_t ireg, uint32_t def,
 #if !defined(CONFIG_USER_ONLY)
 
 #include "exec/softmmu_exec.h"
+#include "sysemu/cpus.h"
 
 #define MMUSUFFIX _mmu
 
@@ -85,6 +86,66 @@ void tlb_fill(CPUARMState *env, target_ulong addr, int is_write, int mmu_idx,
         raise_exception(env, env->exception_index);
     }
 }
+
+/* Store exclusive with multi-threaded TCG, raised as EXCP_STREX by
+ * gen_store_exclusive.  As in user emulation mode, the compare and the
+ * store run while every other vCPU is out of translated code.  A fault
+ * returns to cpu_exec, which ends the exclusive section.  */
+void arm_cpu_do_strex(CPUARMState *env)
+{
+    uint32_t addr = env->exclusive_test;
+    int size = env->exclusive_info & 0xf;
+    uint32_t val;
+    int rc = 1;
+
+    tcg_start_exclusive();
+    if (addr != env->exclusive_addr) {
+        goto fail;
+    }
+    switch (size) {
+    case 0:
+        val = cpu_ldub_data(env, addr);
+        break;
+    case 1:
+        val = cpu_lduw_data(env, addr);
+        break;
+    case 2:
+    case 3:
+        val = cpu_ldl_data(env, addr);
+        break;
+    default:
+        abort();
+    }
+    if (val != env->exclusive_val) {
+        goto fail;
+    }
+    if (size == 3 && cpu_ldl_data(env, addr + 4) != env->exclusive_high) {
+        goto fail;
+    }
+    val = env->regs[(env->exclusive_info >> 8) & 0xf];
+    switch (size) {
+    case 0:
+        cpu_stb_data(env, addr, val);
+        break;
+    case 1:
+        cpu_stw_data(env, addr, val);
+        break;
+    case 2:
+    case 3:
+        cpu_stl_data(env, addr, val);
+        break;
+    }
+    if (size == 3) {
+        val = env->regs[(env->exclusive_info >> 12) & 0xf];
+        cpu_stl_data(env, addr + 4, val);
+    }
+    rc = 0;
+fail:
+    env->regs[15] += 4;
+    env->regs[(env->exclusive_info >> 4) & 0xf] = rc;
+    env->exclusive_addr = -1;
+    tcg_end_exclusive();
+}
 #endif
 
 uint32_t HELPER(add_setq)(CPUARMState *env, uint32_t a, uint32_t b)
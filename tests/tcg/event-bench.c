@@ -0,0 +1,151 @@
+/*
+ * Event syscalls micro-benchmark.
+ *
+ * Measures how many poll, select and epoll_wait calls per second the
+ * emulator sustains on a set of ready pipes, which is what event-loop
+ * servers spend most of their system calls on.  Pass the number of
+ * file descriptors to watch as the first argument (default 64).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <sys/epoll.h>
+
+#define MAX_FDS     512
+#define DURATION    1.0     /* seconds per measurement */
+
+static int nfds = 64;
+static int read_fds[MAX_FDS];
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void bench(const char *name, int (*fn)(void))
+{
+    double start, elapsed;
+    long calls = 0;
+
+    start = now();
+    do {
+        int i;
+        for (i = 0; i < 1000; i++) {
+            if (fn() != nfds) {
+                fprintf(stderr, "%s: unexpected result\n", name);
+                exit(1);
+            }
+        }
+        calls += 1000;
+        elapsed = now() - start;
+    } while (elapsed < DURATION);
+
+    printf("%-12s %10.0f calls/s\n", name, calls / elapsed);
+}
+
+static struct pollfd pfd[MAX_FDS];
+
+static int do_poll(void)
+{
+    return poll(pfd, nfds, 0);
+}
+
+static int do_select(void)
+{
+    struct timeval tv = { 0, 0 };
+    fd_set rfds;
+    int i, maxfd = 0;
+
+    FD_ZERO(&rfds);
+    for (i = 0; i < nfds; i++) {
+        FD_SET(read_fds[i], &rfds);
+        if (read_fds[i] > maxfd) {
+            maxfd = read_fds[i];
+        }
+    }
+    return select(maxfd + 1, &rfds, NULL, NULL, &tv);
+}
+
+static int epfd;
+static struct epoll_event events[MAX_FDS];
+
+static int do_epoll_wait(void)
+{
+    return epoll_wait(epfd, events, MAX_FDS, 0);
+}
+
+int main(int argc, char **argv)
+{
+    struct epoll_event ev;
+    int i, p[2];
+
+    if (argc > 1) {
+        nfds = atoi(argv[1]);
+    }
+    if (nfds <= 0 || nfds > MAX_FDS) {
+        fprintf(stderr, "number of fds must be in 1..%d\n", MAX_FDS);
+        return 1;
+    }
+    /* select() can only watch descriptors below FD_SETSIZE.  */
+    if (nfds * 2 + 3 >= FD_SETSIZE) {
+        nfds = (FD_SETSIZE - 4) / 2;
+    }
+
+    epfd = epoll_create(nfds);
+    if (epfd < 0) {
+        perror("epoll_create");
+        return 1;
+    }
+
+    for (i = 0; i < nfds; i++) {
+        if (pipe(p) < 0) {
+            perror("pipe");
+            return 1;
+        }
+        /* Make every read end permanently readable.  */
+        if (write(p[1], "x", 1) != 1) {
+            perror("write");
+            return 1;
+        }
+        read_fds[i] = p[0];
+        pfd[i].fd = p[0];
+        pfd[i].events = POLLIN;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = p[0];
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, p[0], &ev) < 0) {
+            perror("epoll_ctl");
+            return 1;
+        }
+    }
+
+    printf("%d ready file descriptors\n", nfds);
+    bench("poll", do_poll);
+    bench("select", do_select);
+    bench("epoll_wait", do_epoll_wait);
+
+    return 0;
+}
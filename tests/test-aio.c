@@ -427,6 +427,235 @@ static void test_timer_schedule(void)
     timer_del(&data.timer);
 }
 
+static void test_timer_slack(void)
+{
+    TimerTestData data1 = { .n = 0, .ctx = ctx, .max = 1,
+                            .clock_type = QEMU_CLOCK_VIRTUAL };
+    TimerTestData data2 = data1;
+    int64_t now;
+    int pipefd[2];
+
+    /* See test_timer_schedule.  */
+    g_assert(!qemu_pipe(pipefd));
+    qemu_set_nonblock(pipefd[0]);
+    qemu_set_nonblock(pipefd[1]);
+    aio_set_fd_handler(ctx, pipefd[0],
+                       dummy_io_handler_read, NULL, NULL);
+    do {} while (aio_poll(ctx, false));
+
+    /* Deadlines 20 ms apart are both covered by a 100 ms slack.  */
+    qemu_timer_set_slack_ns(SCALE_MS * 100LL);
+    aio_timer_init(ctx, &data1.timer, data1.clock_type,
+                   SCALE_NS, timer_test_cb, &data1);
+    aio_timer_init(ctx, &data2.timer, data2.clock_type,
+                   SCALE_NS, timer_test_cb, &data2);
+    now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    timer_mod(&data1.timer, now + SCALE_MS * 50LL);
+    timer_mod(&data2.timer, now + SCALE_MS * 70LL);
+    do {} while (aio_poll(ctx, false));
+    g_assert_cmpint(data1.n, ==, 0);
+    g_assert_cmpint(data2.n, ==, 0);
+
+    /* A single wakeup runs both.  */
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data1.n, ==, 1);
+    g_assert_cmpint(data2.n, ==, 1);
+
+    qemu_timer_set_slack_ns(0);
+    aio_set_fd_handler(ctx, pipefd[0], NULL, NULL, NULL);
+    close(pipefd[0]);
+    close(pipefd[1]);
+
+    timer_del(&data1.timer);
+    timer_del(&data2.timer);
+}
+
+static bool event_poll_cb(EventNotifier *e)
+{
+    EventNotifierTestData *data = container_of(e, EventNotifierTestData, e);
+
+    return data->active > 0;
+}
+
+static void event_polled_cb(EventNotifier *e)
+{
+    EventNotifierTestData *data = container_of(e, EventNotifierTestData, e);
+
+    event_notifier_test_and_clear(e);
+    data->n++;
+    data->active = 0;
+}
+
+static void test_adaptive_poll(void)
+{
+    EventNotifierTestData data = { .n = 0, .active = 0 };
+    TimerTestData timer = { .n = 0, .ctx = ctx, .max = 1,
+                            .clock_type = QEMU_CLOCK_REALTIME };
+
+    event_notifier_init(&data.e, false);
+    aio_set_event_notifier(ctx, &data.e, event_polled_cb);
+    aio_set_event_notifier_poll(ctx, &data.e, event_poll_cb);
+    aio_context_set_poll_params(ctx, SCALE_MS * 100LL, 0, 0);
+    while (aio_poll(ctx, false));
+    g_assert_cmpint(ctx->poll_ns, ==, 0);
+
+    /* A wakeup within the maximum opens the polling window.  */
+    aio_timer_init(ctx, &timer.timer, timer.clock_type,
+                   SCALE_NS, timer_test_cb, &timer);
+    timer_mod(&timer.timer,
+              qemu_clock_get_ns(timer.clock_type) + SCALE_MS);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(timer.n, ==, 1);
+    g_assert_cmpint(ctx->poll_ns, >, 0);
+
+    /* Work found by the polling function runs the handler even though
+     * the notifier was never set.
+     */
+    data.active = 1;
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 1);
+    g_assert_cmpint(ctx->poll_hits, ==, 1);
+
+    aio_context_set_poll_params(ctx, 0, 0, 0);
+    aio_set_event_notifier_poll(ctx, &data.e, NULL);
+    aio_set_event_notifier(ctx, &data.e, NULL);
+    g_assert_cmpint(ctx->poll_handlers, ==, 0);
+    event_notifier_cleanup(&data.e);
+    timer_del(&timer.timer);
+}
+
+/* Many handlers, so that the context switches to epoll.  Each of them
+ * must see its own events only, also when handlers come and go while
+ * events are pending.
+ */
+#define EPOLL_TEST_HANDLERS 96
+
+typedef struct {
+    EventNotifierTestData data;
+    EventNotifier *victim;
+} EventNotifierRemoveData;
+
+/* Removes another handler, which may already be on the ready list */
+static void event_remove_cb(EventNotifier *e)
+{
+    EventNotifierRemoveData *r = container_of(e, EventNotifierRemoveData,
+                                              data.e);
+
+    event_ready_cb(e);
+    aio_set_event_notifier(ctx, r->victim, NULL);
+}
+
+static void test_event_many(void)
+{
+    EventNotifierTestData data[EPOLL_TEST_HANDLERS];
+    EventNotifierRemoveData pair[2];
+    int i;
+
+    for (i = 0; i < EPOLL_TEST_HANDLERS; i++) {
+        data[i] = (EventNotifierTestData) { .n = 0, .active = 1 };
+        event_notifier_init(&data[i].e, false);
+        aio_set_event_notifier(ctx, &data[i].e, event_ready_cb);
+    }
+    for (i = 0; i < 2; i++) {
+        pair[i].data = (EventNotifierTestData) { .n = 0, .active = 1 };
+        pair[i].victim = &pair[!i].data.e;
+        event_notifier_init(&pair[i].data.e, false);
+        aio_set_event_notifier(ctx, &pair[i].data.e, event_remove_cb);
+    }
+    g_assert(!aio_poll(ctx, false));
+#ifdef CONFIG_EPOLL_CREATE1
+    /* More handlers than the default threshold */
+    g_assert(!ctx->epoll_available || ctx->epoll_enabled);
+#endif
+
+    for (i = 0; i < EPOLL_TEST_HANDLERS; i += 3) {
+        event_notifier_set(&data[i].e);
+    }
+    /* Remove one of the ready handlers before it is dispatched.  */
+    aio_set_event_notifier(ctx, &data[3].e, NULL);
+    g_assert(aio_poll(ctx, false));
+    while (aio_poll(ctx, false));
+
+    for (i = 0; i < EPOLL_TEST_HANDLERS; i++) {
+        g_assert_cmpint(data[i].n, ==, (i % 3 == 0 && i != 3) ? 1 : 0);
+    }
+
+    /* Both are ready after one poll; whichever runs first removes the
+     * other one from the ready list.
+     */
+    event_notifier_set(&pair[0].data.e);
+    event_notifier_set(&pair[1].data.e);
+    g_assert(aio_poll(ctx, false));
+    while (aio_poll(ctx, false));
+    g_assert_cmpint(pair[0].data.n + pair[1].data.n, ==, 1);
+#ifdef CONFIG_EPOLL_CREATE1
+    g_assert(!ctx->epoll_available || ctx->epoll_enabled);
+#endif
+
+    event_notifier_set(&data[1].e);
+    wait_until_inactive(&data[1]);
+    g_assert_cmpint(data[1].n, ==, 1);
+
+    for (i = 0; i < EPOLL_TEST_HANDLERS; i++) {
+        aio_set_event_notifier(ctx, &data[i].e, NULL);
+        event_notifier_cleanup(&data[i].e);
+    }
+    for (i = 0; i < 2; i++) {
+        aio_set_event_notifier(ctx, &pair[i].data.e, NULL);
+        event_notifier_cleanup(&pair[i].data.e);
+    }
+    g_assert(!aio_poll(ctx, false));
+}
+
+/* Cost of one wakeup with a single ready descriptor, as a function of the
+ * number of registered handlers.  With ppoll it grows linearly with the
+ * handler count, with epoll it should stay flat.
+ */
+#define PERF_WAKEUPS 20000
+
+static void perf_wakeup_one(unsigned threshold, const char *name)
+{
+    static const int nr_handlers[] = { 1, 16, 64, 256, 512 };
+    EventNotifierTestData *data;
+    int i, j;
+
+    aio_context_set_epoll_threshold(ctx, threshold);
+    for (i = 0; i < G_N_ELEMENTS(nr_handlers); i++) {
+        double duration;
+
+        data = g_new0(EventNotifierTestData, nr_handlers[i]);
+        for (j = 0; j < nr_handlers[i]; j++) {
+            event_notifier_init(&data[j].e, false);
+            aio_set_event_notifier(ctx, &data[j].e, event_ready_cb);
+        }
+        while (aio_poll(ctx, false));
+
+        g_test_timer_start();
+        for (j = 0; j < PERF_WAKEUPS; j++) {
+            event_notifier_set(&data[0].e);
+            aio_poll(ctx, true);
+        }
+        duration = g_test_timer_elapsed();
+        g_assert_cmpint(data[0].n, ==, PERF_WAKEUPS);
+
+        g_test_message("%s: %4d handlers: %f us per wakeup", name,
+                       nr_handlers[i], duration * 1e6 / PERF_WAKEUPS);
+
+        for (j = 0; j < nr_handlers[i]; j++) {
+            aio_set_event_notifier(ctx, &data[j].e, NULL);
+            event_notifier_cleanup(&data[j].e);
+        }
+        g_free(data);
+    }
+    aio_context_set_epoll_threshold(ctx, 64);
+}
+
+static void perf_wakeup(void)
+{
+    perf_wakeup_one(0, "ppoll");
+    perf_wakeup_one(1, "epoll");
+}
+
 /* Now the same tests, using the context as a GSource.  They are
  * very similar to the ones above, with g_main_context_iteration
  * replacing aio_poll.  However:
@@ -788,6 +1017,12 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
+    g_test_add_func("/aio/timer/slack",             test_timer_slack);
+    g_test_add_func("/aio/event/many",              test_event_many);
+    g_test_add_func("/aio/event/adaptive-poll",     test_adaptive_poll);
+    if (g_test_perf()) {
+        g_test_add_func("/aio/perf/wakeup",         perf_wakeup);
+    }
 
     g_test_add_func("/aio-gsource/notify",                  test_source_notify);
     g_test_add_func("/aio-gsource/flush",                   test_source_flush);
@@ -0,0 +1,218 @@
+/*
+ * Interval tree tests
+ *
+ * The stress test keeps a few hundred intervals in the tree, like the
+ * tracked requests of a disk at high queue depth, and checks every lookup
+ * against a linear scan.  In -m perf mode, the cost of an overlap check is
+ * reported for both as a function of the number of intervals.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/interval-tree.h"
+
+#define STRESS_DEPTH        512
+#define STRESS_OPS          200000
+#define DISK_SECTORS        (1 << 16)
+#define MAX_REQ_SECTORS     256
+
+typedef struct TestRequest {
+    IntervalTreeNode node;
+    bool in_tree;
+} TestRequest;
+
+static TestRequest *linear_first(TestRequest *reqs, int n,
+                                 uint64_t start, uint64_t last)
+{
+    TestRequest *best = NULL;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (reqs[i].in_tree &&
+            reqs[i].node.start <= last && reqs[i].node.last >= start &&
+            (!best || reqs[i].node.start < best->node.start)) {
+            best = &reqs[i];
+        }
+    }
+    return best;
+}
+
+static void random_interval(GRand *rand, uint64_t *start, uint64_t *last)
+{
+    *start = g_rand_int_range(rand, 0, DISK_SECTORS);
+    *last = *start + g_rand_int_range(rand, 0, MAX_REQ_SECTORS);
+}
+
+static void test_empty(void)
+{
+    IntervalTreeRoot root = INTERVAL_TREE_ROOT_INIT;
+
+    g_assert(interval_tree_empty(&root));
+    g_assert(interval_tree_iter_first(&root, 0, UINT64_MAX) == NULL);
+}
+
+static void test_basic(void)
+{
+    IntervalTreeRoot root;
+    IntervalTreeNode a = { .start = 10, .last = 19 };
+    IntervalTreeNode b = { .start = 30, .last = 39 };
+    IntervalTreeNode c = { .start = 10, .last = 19 };
+
+    interval_tree_init(&root);
+    interval_tree_insert(&a, &root);
+    interval_tree_insert(&b, &root);
+    interval_tree_insert(&c, &root);
+    g_assert(!interval_tree_empty(&root));
+
+    g_assert(interval_tree_iter_first(&root, 0, 9) == NULL);
+    g_assert(interval_tree_iter_first(&root, 20, 29) == NULL);
+    g_assert(interval_tree_iter_first(&root, 40, 100) == NULL);
+    g_assert(interval_tree_iter_first(&root, 39, 39) == &b);
+    g_assert(interval_tree_iter_first(&root, 25, 30) == &b);
+
+    /* Same interval twice: removing one leaves the other */
+    g_assert(interval_tree_iter_first(&root, 0, 10) == &a ||
+             interval_tree_iter_first(&root, 0, 10) == &c);
+    interval_tree_remove(&a, &root);
+    g_assert(interval_tree_iter_first(&root, 0, 100) == &c);
+    interval_tree_remove(&c, &root);
+    g_assert(interval_tree_iter_first(&root, 0, 100) == &b);
+    interval_tree_remove(&b, &root);
+    g_assert(interval_tree_empty(&root));
+}
+
+typedef struct CountData {
+    uint64_t prev_start;
+    int count;
+} CountData;
+
+static bool count_overlap(IntervalTreeNode *node, void *opaque)
+{
+    CountData *data = opaque;
+
+    g_assert_cmpint(node->start, >=, data->prev_start);
+    data->prev_start = node->start;
+    data->count++;
+    return true;
+}
+
+static void test_stress(void)
+{
+    IntervalTreeRoot root = INTERVAL_TREE_ROOT_INIT;
+    TestRequest *reqs = g_new0(TestRequest, STRESS_DEPTH);
+    GRand *rand = g_rand_new_with_seed(42);
+    uint64_t start, last;
+    int i, j, expected;
+
+    for (i = 0; i < STRESS_OPS; i++) {
+        TestRequest *req = &reqs[g_rand_int_range(rand, 0, STRESS_DEPTH)];
+        TestRequest *first;
+        IntervalTreeNode *node;
+        CountData data = { 0, 0 };
+
+        /* Complete or submit a request */
+        if (req->in_tree) {
+            interval_tree_remove(&req->node, &root);
+            req->in_tree = false;
+        } else {
+            random_interval(rand, &req->node.start, &req->node.last);
+            interval_tree_insert(&req->node, &root);
+            req->in_tree = true;
+        }
+
+        /* Look for overlaps, as wait_for_overlapping_requests would */
+        random_interval(rand, &start, &last);
+        first = linear_first(reqs, STRESS_DEPTH, start, last);
+        node = interval_tree_iter_first(&root, start, last);
+        if (first) {
+            g_assert(node != NULL);
+            g_assert_cmpint(node->start, ==, first->node.start);
+            g_assert_cmpint(node->start, <=, last);
+            g_assert_cmpint(node->last, >=, start);
+        } else {
+            g_assert(node == NULL);
+        }
+
+        if (i % 64 == 0) {
+            expected = 0;
+            for (j = 0; j < STRESS_DEPTH; j++) {
+                if (reqs[j].in_tree &&
+                    reqs[j].node.start <= last && reqs[j].node.last >= start) {
+                    expected++;
+                }
+            }
+            interval_tree_foreach_overlap(&root, start, last,
+                                          count_overlap, &data);
+            g_assert_cmpint(data.count, ==, expected);
+        }
+    }
+
+    for (i = 0; i < STRESS_DEPTH; i++) {
+        if (reqs[i].in_tree) {
+            interval_tree_remove(&reqs[i].node, &root);
+        }
+    }
+    g_assert(interval_tree_empty(&root));
+
+    g_rand_free(rand);
+    g_free(reqs);
+}
+
+#define PERF_LOOKUPS        1000000
+
+static void perf_lookup(void)
+{
+    static const int depths[] = { 16, 64, 128, 256, 1024 };
+    GRand *rand = g_rand_new_with_seed(42);
+    uint64_t start, last;
+    double tree_time, list_time;
+    int i, j;
+
+    for (i = 0; i < G_N_ELEMENTS(depths); i++) {
+        IntervalTreeRoot root = INTERVAL_TREE_ROOT_INIT;
+        TestRequest *reqs = g_new0(TestRequest, depths[i]);
+        int found = 0;
+
+        for (j = 0; j < depths[i]; j++) {
+            random_interval(rand, &reqs[j].node.start, &reqs[j].node.last);
+            interval_tree_insert(&reqs[j].node, &root);
+            reqs[j].in_tree = true;
+        }
+
+        g_test_timer_start();
+        for (j = 0; j < PERF_LOOKUPS; j++) {
+            random_interval(rand, &start, &last);
+            found += interval_tree_iter_first(&root, start, last) != NULL;
+        }
+        tree_time = g_test_timer_elapsed();
+
+        g_test_timer_start();
+        for (j = 0; j < PERF_LOOKUPS; j++) {
+            random_interval(rand, &start, &last);
+            found += linear_first(reqs, depths[i], start, last) != NULL;
+        }
+        list_time = g_test_timer_elapsed();
+
+        g_test_message("%4d requests: tree %.3f us, list %.3f us per lookup "
+                       "(%d hits)", depths[i],
+                       tree_time * 1e6 / PERF_LOOKUPS,
+                       list_time * 1e6 / PERF_LOOKUPS, found);
+        g_free(reqs);
+    }
+    g_rand_free(rand);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/interval-tree/empty", test_empty);
+    g_test_add_func("/interval-tree/basic", test_basic);
+    g_test_add_func("/interval-tree/stress", test_stress);
+    if (g_test_perf()) {
+        g_test_add_func("/interval-tree/perf/lookup", perf_lookup);
+    }
+    return g_test_run();
+}
@@ -55,6 +55,8 @@
 #endif
 #else
 #include "exec/address-spaces.h"
+#include "sysemu/cpus.h"
+#include "qemu/main-loop.h"
 #endif
 
 #include "exec/cputlb.h"
@@ -256,13 +258,25 @@ static int cpu_restore_state_from_tb(TranslationBlock *tb, CPUArchState *env,
 bool cpu_restore_state(CPUArchState *env, uintptr_t retaddr)
 {
     TranslationBlock *tb;
+    bool found = false;
+#if !defined(CONFIG_USER_ONLY)
+    /* Helpers get here from translated code, i.e. without the global
+       mutex when TCG is multi-threaded, and retranslating the TB uses
+       the shared tcg_ctx.  */
+    bool locked = qemu_tcg_lock_iothread();
+#endif
 
     tb = tb_find_pc(retaddr);
     if (tb) {
         cpu_restore_state_from_tb(tb, env, retaddr);
-        return true;
+        found = true;
+    }
+#if !defined(CONFIG_USER_ONLY)
+    if (locked) {
+        qemu_mutex_unlock_iothread();
     }
-    return false;
+#endif
+    return found;
 }
 
 #ifdef _WIN32
@@ -694,6 +708,15 @@ void tb_flush(CPUArchState *env1)
            tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.tb_ctx.nb_tbs > 0 ?
            ((unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer)) /
            tcg_ctx.tb_ctx.nb_tbs : 0);
+#endif
+#if !defined(CONFIG_USER_ONLY)
+    bool locked = false;
+
+    /* Other vCPU threads may be executing from the code buffer.  */
+    if (mttcg_enabled) {
+        locked = qemu_tcg_lock_iothread();
+        tcg_start_exclusive();
+    }
 #endif
     if ((unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer)
         > tcg_ctx.code_gen_buffer_size) {
@@ -715,6 +738,15 @@ void tb_flush(CPUArchState *env1)
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     tcg_ctx.tb_ctx.tb_flush_count++;
+
+#if !defined(CONFIG_USER_ONLY)
+    if (mttcg_enabled) {
+        tcg_end_exclusive();
+        if (locked) {
+            qemu_mutex_unlock_iothread();
+        }
+    }
+#endif
 }
 
 #ifdef DEBUG_TB_CHECK
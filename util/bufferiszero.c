@@ -0,0 +1,324 @@
+/*
+ * Simple C functions to check for zero buffers
+ *
+ * Copyright (c) 2003 Fabrice Bellard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "qemu-common.h"
+
+/*
+ * The generic version works on any buffer.  It reads the unaligned head and
+ * tail with memcpy and the aligned middle one unsigned long at a time, in
+ * groups of eight to smooth out the effect of memory latency.
+ */
+static bool buffer_zero_int(const void *buf, size_t len)
+{
+    if (unlikely(len < sizeof(unsigned long))) {
+        const unsigned char *p = buf;
+        const unsigned char *e = p + len;
+        unsigned char t = 0;
+
+        while (p < e) {
+            t |= *p++;
+        }
+        return t == 0;
+    } else {
+        const unsigned long *p, *e;
+        unsigned long t, tail;
+
+        memcpy(&t, buf, sizeof(t));
+        memcpy(&tail, (const char *)buf + len - sizeof(tail), sizeof(tail));
+        t |= tail;
+
+        p = (const unsigned long *)
+            (((uintptr_t)buf + sizeof(long)) & -sizeof(long));
+        e = (const unsigned long *)(((uintptr_t)buf + len) & -sizeof(long));
+
+        for (; p + 8 <= e; p += 8) {
+            __builtin_prefetch(p + 8);
+            if (t) {
+                return false;
+            }
+            t = p[0] | p[1] | p[2] | p[3] | p[4] | p[5] | p[6] | p[7];
+        }
+        while (p < e) {
+            t |= *p++;
+        }
+
+        return t == 0;
+    }
+}
+
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+/* The pragmas are only needed to build code for instruction sets that the
+ * compiler does not enable by default; clang does not know push_options.
+ */
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+#include <emmintrin.h>
+
+/*
+ * Needs len >= 64.  The unaligned head and tail are read with unaligned
+ * loads, which may overlap the 16-byte aligned middle.
+ */
+static bool buffer_zero_sse2(const void *buf, size_t len)
+{
+    __m128i t = _mm_loadu_si128(buf);
+    __m128i *p = (__m128i *)(((uintptr_t)buf + 5 * 16) & -16);
+    __m128i *e = (__m128i *)(((uintptr_t)buf + len) & -16);
+    __m128i zero = _mm_setzero_si128();
+
+    /* Loop over 16-byte aligned blocks of 64 */
+    while (likely(p <= e)) {
+        __builtin_prefetch(p);
+        t = _mm_cmpeq_epi8(t, zero);
+        if (unlikely(_mm_movemask_epi8(t) != 0xFFFF)) {
+            return false;
+        }
+        t = _mm_or_si128(_mm_or_si128(p[-4], p[-3]),
+                         _mm_or_si128(p[-2], p[-1]));
+        p += 4;
+    }
+
+    /* Finish the aligned tail */
+    t = _mm_or_si128(t, e[-3]);
+    t = _mm_or_si128(t, e[-2]);
+    t = _mm_or_si128(t, e[-1]);
+
+    /* Finish the unaligned tail */
+    t = _mm_or_si128(t, _mm_loadu_si128((const void *)
+                                        ((const char *)buf + len - 16)));
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(t, zero)) == 0xFFFF;
+}
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC pop_options
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#include <cpuid.h>
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+/* Like buffer_zero_sse2 with 32-byte vectors; needs len >= 128 */
+static bool buffer_zero_avx2(const void *buf, size_t len)
+{
+    __m256i t = _mm256_loadu_si256(buf);
+    __m256i *p = (__m256i *)(((uintptr_t)buf + 5 * 32) & -32);
+    __m256i *e = (__m256i *)(((uintptr_t)buf + len) & -32);
+
+    /* Loop over 32-byte aligned blocks of 128 */
+    while (likely(p <= e)) {
+        __builtin_prefetch(p);
+        if (unlikely(!_mm256_testz_si256(t, t))) {
+            return false;
+        }
+        t = _mm256_or_si256(_mm256_or_si256(p[-4], p[-3]),
+                            _mm256_or_si256(p[-2], p[-1]));
+        p += 4;
+    }
+
+    /* Finish the aligned tail */
+    t = _mm256_or_si256(t, e[-3]);
+    t = _mm256_or_si256(t, e[-2]);
+    t = _mm256_or_si256(t, e[-1]);
+
+    /* Finish the unaligned tail */
+    t = _mm256_or_si256(t, _mm256_loadu_si256((const void *)
+                                              ((const char *)buf + len - 32)));
+
+    return _mm256_testz_si256(t, t);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+#endif /* CONFIG_AVX2_OPT || __SSE2__ */
+
+#define CACHE_SSE2    1
+#define CACHE_AVX2    2
+
+/* Bitmask of the accelerators that the host CPU supports, of those that
+ * tests have not disabled yet, and the one that is in use */
+static unsigned host_cache;
+static unsigned cpuid_cache;
+static unsigned used_accel;
+
+static size_t length_to_accel = 64;
+static bool (*buffer_accel)(const void *, size_t) = buffer_zero_int;
+
+/*
+ * Picks the best accelerator among those in @cache.  Returns the bit of
+ * the accelerator that was chosen, or zero for the generic version.
+ */
+static unsigned select_accel_fn(unsigned cache)
+{
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        buffer_accel = buffer_zero_avx2;
+        length_to_accel = 128;
+        return CACHE_AVX2;
+    }
+#endif
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+    if (cache & CACHE_SSE2) {
+        buffer_accel = buffer_zero_sse2;
+        length_to_accel = 64;
+        return CACHE_SSE2;
+    }
+#endif
+    buffer_accel = buffer_zero_int;
+    length_to_accel = 64;
+    return 0;
+}
+
+#ifdef CONFIG_AVX2_OPT
+#ifndef bit_OSXSAVE
+#define bit_OSXSAVE   (1 << 27)
+#endif
+#ifndef bit_AVX
+#define bit_AVX       (1 << 28)
+#endif
+#ifndef bit_AVX2
+#define bit_AVX2      (1 << 5)
+#endif
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (d & bit_SSE2) {
+            cache |= CACHE_SSE2;
+        }
+
+        /* AVX2 is only usable if the OS saves the YMM registers too */
+        if (max >= 7 && (c & bit_OSXSAVE) && (c & bit_AVX)) {
+            int bv;
+
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 6) == 6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+        }
+    }
+    host_cache = cpuid_cache = cache;
+    used_accel = select_accel_fn(cache);
+}
+#elif defined(__SSE2__)
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    host_cache = cpuid_cache = CACHE_SSE2;
+    used_accel = select_accel_fn(cpuid_cache);
+}
+#endif
+
+/*
+ * Switches to the next slower implementation of buffer_is_zero that the
+ * host supports, so that tests can exercise each of them.  Once the generic
+ * version was in use, goes back to the fastest one and returns false.
+ */
+bool test_buffer_is_zero_next_accel(void)
+{
+    /* If no bits set, we just tested buffer_zero_int, and there are no
+     * more acceleration options to test.
+     */
+    if (!used_accel) {
+        cpuid_cache = host_cache;
+        used_accel = select_accel_fn(cpuid_cache);
+        return false;
+    }
+
+    /* Disable the accelerator we used before and select a new one */
+    cpuid_cache &= ~used_accel;
+    used_accel = select_accel_fn(cpuid_cache);
+    return true;
+}
+
+/*
+ * Checks if a buffer is all zeroes.  The buffer may have any length and
+ * alignment.
+ */
+bool buffer_is_zero(const void *buf, size_t len)
+{
+    if (unlikely(len == 0)) {
+        return true;
+    }
+
+    /* Fetch the beginning of the buffer while we select the accelerator */
+    __builtin_prefetch(buf);
+
+    if (likely(len >= length_to_accel)) {
+        return buffer_accel(buf, len);
+    }
+    return buffer_zero_int(buf, len);
+}
+
+/*
+ * Classifies the buffer into runs of zero and non-zero blocks of
+ * @block_size bytes.  Returns the length in bytes of the run at the start
+ * of @buf and sets *is_zero to whether its blocks are all zero.  A short
+ * block at the end of the buffer counts as a block of its own.  Calling the
+ * function again on the rest of the buffer reads every byte once.
+ */
+size_t buffer_zero_run(const void *buf, size_t len, size_t block_size,
+                       bool *is_zero)
+{
+    const char *p = buf;
+    const char *e = p + len;
+    size_t n;
+    bool zero;
+
+    assert(block_size > 0);
+    if (len == 0) {
+        *is_zero = true;
+        return 0;
+    }
+
+    n = MIN(block_size, len);
+    zero = buffer_is_zero(p, n);
+    p += n;
+
+    if (zero) {
+        /* Zero runs are usually long; try eight blocks at a time first so
+         * that the accelerated loop runs on larger chunks
+         */
+        while (e - p >= 8 * block_size &&
+               buffer_is_zero(p, 8 * block_size)) {
+            p += 8 * block_size;
+        }
+    }
+    while (p < e) {
+        n = MIN(block_size, e - p);
+        if (buffer_is_zero(p, n) != zero) {
+            break;
+        }
+        p += n;
+    }
+
+    *is_zero = zero;
+    return p - (const char *)buf;
+}
@@ -0,0 +1,190 @@
+/*
+ * Interval tree
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include <stddef.h>
+#include <assert.h>
+#include "qemu/interval-tree.h"
+
+/* Total order of the nodes: by start, and by address for equal starts */
+static inline bool node_less(const IntervalTreeNode *a,
+                             const IntervalTreeNode *b)
+{
+    if (a->start != b->start) {
+        return a->start < b->start;
+    }
+    return (uintptr_t)a < (uintptr_t)b;
+}
+
+static inline void node_update(IntervalTreeNode *node)
+{
+    uint64_t last = node->last;
+
+    if (node->left && node->left->subtree_last > last) {
+        last = node->left->subtree_last;
+    }
+    if (node->right && node->right->subtree_last > last) {
+        last = node->right->subtree_last;
+    }
+    node->subtree_last = last;
+}
+
+/* Joins two treaps where every node of @a sorts before every node of @b */
+static IntervalTreeNode *merge(IntervalTreeNode *a, IntervalTreeNode *b)
+{
+    if (!a) {
+        return b;
+    }
+    if (!b) {
+        return a;
+    }
+    if (a->priority > b->priority) {
+        a->right = merge(a->right, b);
+        node_update(a);
+        return a;
+    } else {
+        b->left = merge(a, b->left);
+        node_update(b);
+        return b;
+    }
+}
+
+/* Splits @t into the nodes that sort before @key and the others */
+static void split(IntervalTreeNode *t, const IntervalTreeNode *key,
+                  IntervalTreeNode **l, IntervalTreeNode **r)
+{
+    if (!t) {
+        *l = *r = NULL;
+    } else if (node_less(t, key)) {
+        split(t->right, key, &t->right, r);
+        node_update(t);
+        *l = t;
+    } else {
+        split(t->left, key, l, &t->left);
+        node_update(t);
+        *r = t;
+    }
+}
+
+static IntervalTreeNode *insert(IntervalTreeNode *t, IntervalTreeNode *node)
+{
+    if (!t) {
+        return node;
+    }
+    if (node->priority > t->priority) {
+        split(t, node, &node->left, &node->right);
+        node_update(node);
+        return node;
+    }
+    if (node_less(node, t)) {
+        t->left = insert(t->left, node);
+    } else {
+        t->right = insert(t->right, node);
+    }
+    node_update(t);
+    return t;
+}
+
+static IntervalTreeNode *remove_node(IntervalTreeNode *t,
+                                     IntervalTreeNode *node)
+{
+    assert(t);
+    if (t == node) {
+        return merge(t->left, t->right);
+    }
+    if (node_less(node, t)) {
+        t->left = remove_node(t->left, node);
+    } else {
+        t->right = remove_node(t->right, node);
+    }
+    node_update(t);
+    return t;
+}
+
+void interval_tree_insert(IntervalTreeNode *node, IntervalTreeRoot *root)
+{
+    assert(node->start <= node->last);
+
+    /* xorshift keeps the expected depth logarithmic whatever the order of
+     * the insertions */
+    root->seed ^= root->seed << 13;
+    root->seed ^= root->seed >> 17;
+    root->seed ^= root->seed << 5;
+    if (!root->seed) {
+        root->seed = 2463534242U;
+    }
+
+    node->priority = root->seed;
+    node->left = node->right = NULL;
+    node->subtree_last = node->last;
+    root->root = insert(root->root, node);
+}
+
+void interval_tree_remove(IntervalTreeNode *node, IntervalTreeRoot *root)
+{
+    root->root = remove_node(root->root, node);
+    node->left = node->right = NULL;
+}
+
+IntervalTreeNode *interval_tree_iter_first(IntervalTreeRoot *root,
+                                           uint64_t start, uint64_t last)
+{
+    IntervalTreeNode *node = root->root;
+
+    if (!node || node->subtree_last < start) {
+        return NULL;
+    }
+
+    /* Invariant: some node in the subtree of node ends at or after start */
+    for (;;) {
+        if (node->left && node->left->subtree_last >= start) {
+            /* The leftmost node that ends at or after start is in the left
+             * subtree; if it starts after last, nothing overlaps */
+            node = node->left;
+            continue;
+        }
+        if (node->start > last) {
+            return NULL;
+        }
+        if (node->last >= start) {
+            return node;
+        }
+        node = node->right;
+        if (!node || node->subtree_last < start) {
+            return NULL;
+        }
+    }
+}
+
+static bool foreach_overlap(IntervalTreeNode *node,
+                            uint64_t start, uint64_t last,
+                            bool (*fn)(IntervalTreeNode *node, void *opaque),
+                            void *opaque)
+{
+    if (!node || node->subtree_last < start) {
+        return true;
+    }
+    if (!foreach_overlap(node->left, start, last, fn, opaque)) {
+        return false;
+    }
+    if (node->start > last) {
+        /* So do all the nodes in the right subtree */
+        return true;
+    }
+    if (node->last >= start && !fn(node, opaque)) {
+        return false;
+    }
+    return foreach_overlap(node->right, start, last, fn, opaque);
+}
+
+void interval_tree_foreach_overlap(IntervalTreeRoot *root,
+                                   uint64_t start, uint64_t last,
+                                   bool (*fn)(IntervalTreeNode *node,
+                                              void *opaque),
+                                   void *opaque)
+{
+    foreach_overlap(root->root, start, last, fn, opaque);
+}
@@ -31,6 +31,7 @@ struct progress_state {
     float current;
     float last_print;
     float min_skip;
+    float rate;
     void (*print)(void);
     void (*end)(void);
 };
@@ -45,7 +46,11 @@ static volatile sig_atomic_t print_pending;
  */
 static void progress_simple_print(void)
 {
-    printf("    (%3.2f/100%%)\r", state.current);
+    if (state.rate > 0) {
+        printf("    (%3.2f/100%%, %.1f MiB/s)\r", state.current, state.rate);
+    } else {
+        printf("    (%3.2f/100%%)\r", state.current);
+    }
     fflush(stdout);
 }
 
@@ -70,7 +75,12 @@ static void sigusr_print(int signal)
 static void progress_dummy_print(void)
 {
     if (print_pending) {
-        fprintf(stderr, "    (%3.2f/100%%)\n", state.current);
+        if (state.rate > 0) {
+            fprintf(stderr, "    (%3.2f/100%%, %.1f MiB/s)\n",
+                    state.current, state.rate);
+        } else {
+            fprintf(stderr, "    (%3.2f/100%%)\n", state.current);
+        }
         print_pending = 0;
     }
 }
@@ -105,6 +115,7 @@ static void progress_dummy_init(void)
 void qemu_progress_init(int enabled, float min_skip)
 {
     state.min_skip = min_skip;
+    state.rate = 0;
     if (enabled) {
         progress_simple_init();
     } else {
@@ -117,6 +128,15 @@ void qemu_progress_end(void)
     state.end();
 }
 
+/*
+ * Set the throughput, in MiB/s, that is shown along with the next reports.
+ * A value of zero hides it.
+ */
+void qemu_progress_set_rate(float rate)
+{
+    state.rate = rate;
+}
+
 /*
  * Report progress.
  * @delta is how much progress we made.
@@ -3684,9 +3684,32 @@ int main(int argc, char **argv, char **envp)
                 plugin_filename = optarg;
                 break;
 #endif /* CONFIG_TCG_PLUGIN */
+            case QEMU_OPTION_tcg_threads:
+                if (!strcmp(optarg, "multi")) {
+                    mttcg_enabled = true;
+                } else if (!strcmp(optarg, "single")) {
+                    mttcg_enabled = false;
+                } else {
+                    fprintf(stderr, "Invalid -tcg-threads mode: %s\n", optarg);
+                    exit(1);
+                }
+                break;
             case QEMU_OPTION_icount:
                 icount_option = optarg;
                 break;
+            case QEMU_OPTION_timer_slack:
+                {
+                    char *end;
+                    int64_t slack = strtoll(optarg, &end, 0);
+
+                    if (*end || slack < 0) {
+                        fprintf(stderr, "Invalid -timer-slack value: %s\n",
+                                optarg);
+                        exit(1);
+                    }
+                    qemu_timer_set_slack_ns(slack);
+                }
+                break;
             case QEMU_OPTION_incoming:
                 incoming = optarg;
                 runstate_set(RUN_STATE_INMIGRATE);
@@ -4068,6 +4091,26 @@ int main(int argc, char **argv, char **envp)
 
     configure_accelerator();
 
+    if (mttcg_enabled) {
+#ifndef CONFIG_LINUX
+        fprintf(stderr, "-tcg-threads multi requires a Linux host\n");
+        exit(1);
+#endif
+        if (!tcg_enabled()) {
+            mttcg_enabled = false;
+        } else if (arch_type != QEMU_ARCH_ARM) {
+            /* Only ARM runs its guest atomics (load/store exclusive) in
+             * an exclusive section */
+            fprintf(stderr, "-tcg-threads multi is only supported for "
+                    "ARM guests\n");
+            exit(1);
+        } else if (icount_option && !strncmp(icount_option, "auto", 4)) {
+            fprintf(stderr, "-icount auto is not allowed with "
+                    "-tcg-threads multi\n");
+            exit(1);
+        }
+    }
+
     if (!qtest_enabled() && qtest_chrdev) {
         qtest_init();
     }